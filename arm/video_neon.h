@@ -0,0 +1,273 @@
+/* gameplaySP
+ *
+ * Copyright (C) 2006 Exophase <exophase@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef ARM_VIDEO_NEON_H
+#define ARM_VIDEO_NEON_H
+
+#include <arm_neon.h>
+
+// NEON kernels for the scanline renderers in video.c. Text layers are
+// first expanded a tile row at a time into a line of palette indices
+// (0 where transparent), which is then composed into the destination
+// 8 pixels at a time. NEON has no 16bit gather, so the palette lookups of
+// the normal composers are done a pixel at a time.
+
+// Expands a cached 4bpp tile row (a byte per pixel, already flipped as
+// needed), adding the palette bank to opaque pixels.
+
+static inline void neon_tile_row_4bpp(u16 *dest, const u8 *tile_row,
+ u32 palette_bank)
+{
+  uint16x8_t pixels = vmovl_u8(vld1_u8(tile_row));
+
+  vst1q_u16(dest, vandq_u16(vorrq_u16(pixels, vdupq_n_u16(palette_bank)),
+   vtstq_u16(pixels, pixels)));
+}
+
+static inline void neon_tile_row_8bpp(u16 *dest, const u8 *tile_row,
+ u32 flip)
+{
+  uint8x8_t pixels = vld1_u8(tile_row);
+
+  if(flip)
+    pixels = vrev64_u8(pixels);
+
+  vst1q_u16(dest, vmovl_u8(pixels));
+}
+
+
+// Base layers draw everything, color 0 included.
+
+static inline void neon_compose_base_normal(u16 *dest, const u16 *src,
+ u32 count, const u16 *palette)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+    dest[i] = palette[src[i]];
+}
+
+static inline void neon_compose_transparent_normal(u16 *dest, const u16 *src,
+ u32 count, const u16 *palette)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+  {
+    if(src[i])
+      dest[i] = palette[src[i]];
+  }
+}
+
+// Color effect composers keep the palette index plus the layer's combine
+// bits, base layers write bg_combine where transparent.
+
+static inline void neon_compose_base_color16(u16 *dest, const u16 *src,
+ u32 count, u32 pixel_combine, u32 bg_combine)
+{
+  uint16x8_t combine = vdupq_n_u16(pixel_combine);
+  uint16x8_t bg = vdupq_n_u16(bg_combine);
+  u32 i;
+
+  for(; count >= 8; count -= 8)
+  {
+    uint16x8_t pixels = vld1q_u16(src);
+
+    vst1q_u16(dest, vbslq_u16(vtstq_u16(pixels, pixels),
+     vorrq_u16(pixels, combine), bg));
+    src += 8;
+    dest += 8;
+  }
+
+  for(i = 0; i < count; i++)
+    dest[i] = src[i] ? (src[i] | pixel_combine) : bg_combine;
+}
+
+static inline void neon_compose_transparent_color16(u16 *dest,
+ const u16 *src, u32 count, u32 pixel_combine)
+{
+  uint16x8_t combine = vdupq_n_u16(pixel_combine);
+  u32 i;
+
+  for(; count >= 8; count -= 8)
+  {
+    uint16x8_t pixels = vld1q_u16(src);
+
+    vst1q_u16(dest, vbslq_u16(vtstq_u16(pixels, pixels),
+     vorrq_u16(pixels, combine), vld1q_u16(dest)));
+    src += 8;
+    dest += 8;
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    if(src[i])
+      dest[i] = src[i] | pixel_combine;
+  }
+}
+
+// The 32bit composers widen the indices four at a time. Opaque pixels are
+// ORed over under (the alpha one pushes what was there into the top half,
+// keeping it as the bottom pixel to blend with), transparent ones get
+// transparent.
+
+#define neon_compose_32(under, transparent)                                   \
+  uint32x4_t combine = vdupq_n_u32(pixel_combine);                            \
+  u32 i;                                                                      \
+                                                                              \
+  for(; count >= 8; count -= 8)                                               \
+  {                                                                           \
+    uint16x8_t pixels_wide = vld1q_u16(src);                                  \
+    uint32x4_t pixels = vmovl_u16(vget_low_u16(pixels_wide));                 \
+                                                                              \
+    vst1q_u32(dest, vbslq_u32(vtstq_u32(pixels, pixels),                      \
+     vorrq_u32(vorrq_u32(pixels, combine), under(0)), transparent(0)));       \
+    pixels = vmovl_u16(vget_high_u16(pixels_wide));                           \
+    vst1q_u32(dest + 4, vbslq_u32(vtstq_u32(pixels, pixels),                  \
+     vorrq_u32(vorrq_u32(pixels, combine), under(4)), transparent(4)));       \
+    src += 8;                                                                 \
+    dest += 8;                                                                \
+  }                                                                           \
+
+#define neon_dest_none(offset)   vdupq_n_u32(0)
+#define neon_dest_bg(offset)     bg
+#define neon_dest_keep(offset)   vld1q_u32(dest + offset)
+#define neon_dest_stack(offset)  vshlq_n_u32(vld1q_u32(dest + offset), 16)
+
+static inline void neon_compose_base_color32(u32 *dest, const u16 *src,
+ u32 count, u32 pixel_combine, u32 bg_combine)
+{
+  uint32x4_t bg = vdupq_n_u32(bg_combine);
+  neon_compose_32(neon_dest_none, neon_dest_bg);
+
+  for(i = 0; i < count; i++)
+    dest[i] = src[i] ? (src[i] | pixel_combine) : bg_combine;
+}
+
+static inline void neon_compose_transparent_color32(u32 *dest,
+ const u16 *src, u32 count, u32 pixel_combine)
+{
+  neon_compose_32(neon_dest_none, neon_dest_keep);
+
+  for(i = 0; i < count; i++)
+  {
+    if(src[i])
+      dest[i] = src[i] | pixel_combine;
+  }
+}
+
+static inline void neon_compose_transparent_alpha(u32 *dest, const u16 *src,
+ u32 count, u32 pixel_combine)
+{
+  neon_compose_32(neon_dest_stack, neon_dest_keep);
+
+  for(i = 0; i < count; i++)
+  {
+    if(src[i])
+      dest[i] = (dest[i] << 16) | src[i] | pixel_combine;
+  }
+}
+
+// Base alpha has the backdrop's combine bits in pixel_combine already.
+static inline void neon_compose_base_alpha(u32 *dest, const u16 *src,
+ u32 count, u32 pixel_combine, u32 bg_combine)
+{
+  neon_compose_base_color32(dest, src, count, pixel_combine, bg_combine);
+}
+
+
+static inline void neon_fill_16(u16 *dest, u16 color, u32 count)
+{
+  uint16x8_t colors = vdupq_n_u16(color);
+  u32 i;
+
+  for(; count >= 8; count -= 8)
+  {
+    vst1q_u16(dest, colors);
+    dest += 8;
+  }
+
+  for(i = 0; i < count; i++)
+    dest[i] = color;
+}
+
+static inline void neon_fill_32(u32 *dest, u32 color, u32 count)
+{
+  uint32x4_t colors = vdupq_n_u32(color);
+  u32 i;
+
+  for(; count >= 4; count -= 4)
+  {
+    vst1q_u32(dest, colors);
+    dest += 4;
+  }
+
+  for(i = 0; i < count; i++)
+    dest[i] = color;
+}
+
+
+// Unscaled bitmap rows. Mode 3/5 convert the colors the same way as
+// convert_palette does, mode 4 goes through the palette.
+
+#ifdef USE_BGR_FORMAT
+  #define neon_convert_palette(value)                                         \
+    vorrq_u16(vshlq_n_u16(vandq_u16(value, vdupq_n_u16(0x7FE0)), 1),          \
+     vandq_u16(value, vdupq_n_u16(0x1F)))                                     \
+
+#else
+  #define neon_convert_palette(value)                                         \
+    vorrq_u16(vorrq_u16(vshlq_n_u16(value, 11),                               \
+     vshlq_n_u16(vandq_u16(value, vdupq_n_u16(0x03E0)), 1)),                  \
+     vshrq_n_u16(value, 10))                                                  \
+
+#endif
+
+static inline void neon_bitmap_row_16bpp(u16 *dest, const u16 *src,
+ u32 count)
+{
+  u32 i;
+
+  for(; count >= 8; count -= 8)
+  {
+    uint16x8_t pixels = vld1q_u16(src);
+
+    vst1q_u16(dest, neon_convert_palette(pixels));
+    src += 8;
+    dest += 8;
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    u32 current_pixel = eswap16(src[i]);
+    convert_palette(current_pixel);
+    dest[i] = current_pixel;
+  }
+}
+
+static inline void neon_bitmap_row_8bpp(u16 *dest, const u8 *src,
+ u32 count, const u16 *palette)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+    dest[i] = palette[src[i]];
+}
+
+#endif
@@ -156,5 +156,6 @@ typedef u32 fixed8_24;
 #include "sound.h"
 #include "main.h"
 #include "cheats.h"
+#include "rewind.h"
 
 #endif
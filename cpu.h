@@ -164,6 +164,7 @@ extern u32 *rom_branch_hash[ROM_BRANCH_HASH_SIZE];
 void flush_translation_cache_rom(void);
 void flush_translation_cache_ram(void);
 void flush_translation_cache_bios(void);
+void flush_translation_cache_ram_all(void);
 void dump_translation_cache(void);
 void init_caches(void);
 void init_emitter(void);
@@ -3504,20 +3504,29 @@ void flush_translation_cache_bios(void)
   memset(bios_rom + 0x4000, 0, 0x4000);
 }
 
-void init_caches(void)
+/* Drops every RAM translation and wipes all the block tags in the SMC
+   mirrors, not only the range known to hold code. Used when RAM contents
+   are replaced wholesale (ie. savestate loads), ROM and BIOS translations
+   can't be affected by that and are kept. */
+void flush_translation_cache_ram_all(void)
 {
-  /* Ensure we wipe everything including the SMC mirrors */
-  flush_translation_cache_rom();
   ewram_code_min = 0;
   ewram_code_max = 0x3FFFF;
   iwram_code_min = 0;
   iwram_code_max = 0x7FFF;
   flush_translation_cache_ram();
-  flush_translation_cache_bios();
   /* Ensure 0 and FFFF get zeroed out */
   memset(ram_block_ptrs, 0, sizeof(ram_block_ptrs));
 }
 
+void init_caches(void)
+{
+  /* Ensure we wipe everything including the SMC mirrors */
+  flush_translation_cache_rom();
+  flush_translation_cache_ram_all();
+  flush_translation_cache_bios();
+}
+
 #define cache_dump_prefix ""
 
 void dump_translation_cache(void)
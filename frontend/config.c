@@ -25,6 +25,13 @@ static const struct {
   CE_NUM(color_correct),
   CE_NUM(lcd_blend),
   CE_NUM(show_fps),
+  CE_NUM(rewind_buffer),
+  CE_NUM(rewind_interval),
+  CE_NUM(render_thread),
+  CE_NUM(line_reuse),
+  CE_NUM(rate_control),
+  CE_NUM(threaded_audio),
+  CE_NUM(threaded_scaling),
 };
 
 void config_write(FILE *f)
@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "common.h"
 #include "main.h"
 #include "memmap.h"
 #include "frontend/menu.h"
 #include "frontend/plat.h"
+#include "frontend/scale.h"
 #include "frontend/libpicofe/plat.h"
 
 /* Percentage of free space allowed in the audio buffer before
@@ -12,6 +15,15 @@
  * audio, since the buffer will stay closer to filled. */
 #define FRAMESKIP_UNDERRUN_THRESHOLD 0.5
 
+/* With rate control the buffer is kept half full by stretching the
+ * audio, frames are only skipped once it falls well below that. */
+#define FRAMESKIP_RATE_CONTROL_THRESHOLD 0.75
+
+/* Largest change to the audio output rate, 0.5% is too small to hear
+ * but covers the usual difference between the host clock and the
+ * audio device's. */
+#define RATE_CONTROL_MAX_ADJUST 0.005
+
 int should_quit = 0;
 
 u32 idle_loop_target_pc = 0xFFFFFFFF;
@@ -37,12 +49,130 @@ int color_correct;
 int lcd_blend;
 int show_fps;
 int limit_frames;
+int rewind_buffer;
+int rewind_interval;
+render_thread_t render_thread;
+int line_reuse;
+int rate_control;
+int threaded_audio;
+int threaded_scaling;
+
+static int rewinding = 0;
+static int frame_timer_reset = 1;
 
 static float vsyncsps = 0.0;
 static float rendersps = 0.0;
 
+/* Backup flushes are written by a separate thread so slow storage never
+ * stalls emulation. The emulation thread only snapshots dirty data, and
+ * picks up the result of the write once it's done. */
+static pthread_t backup_thread;
+static pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backup_cond = PTHREAD_COND_INITIALIZER;
+static backup_flush_type backup_flush;
+static int backup_flush_queued = 0;
+static int backup_flush_written = 0;
+static u32 backup_flush_result = 0;
+static int backup_thread_running = 0;
+static int backup_thread_quit = 0;
+
 void quit();
 
+static void *backup_thread_func(void *unused)
+{
+  u32 result;
+
+  pthread_mutex_lock(&backup_mutex);
+
+  while (1) {
+    while (!backup_flush_queued && !backup_thread_quit)
+      pthread_cond_wait(&backup_cond, &backup_mutex);
+
+    if (!backup_flush_queued)
+      break;
+
+    pthread_mutex_unlock(&backup_mutex);
+    result = write_backup_flush(backup_filename, &backup_flush);
+    pthread_mutex_lock(&backup_mutex);
+
+    backup_flush_queued = 0;
+    backup_flush_written = 1;
+    backup_flush_result = result;
+    pthread_cond_broadcast(&backup_cond);
+  }
+
+  pthread_mutex_unlock(&backup_mutex);
+  return NULL;
+}
+
+/* Hands the result of the last write back to the emulation state, so a
+ * failed write is retried. Called with backup_mutex held. */
+static void backup_thread_collect(void)
+{
+  if (!backup_flush_written)
+    return;
+
+  finish_backup_flush(&backup_flush, backup_flush_result);
+  backup_flush_written = 0;
+}
+
+static void backup_thread_start(void)
+{
+  backup_thread_quit = 0;
+  backup_thread_running =
+    !pthread_create(&backup_thread, NULL, backup_thread_func, NULL);
+}
+
+static void backup_thread_wait(void)
+{
+  if (!backup_thread_running)
+    return;
+
+  pthread_mutex_lock(&backup_mutex);
+  while (backup_flush_queued)
+    pthread_cond_wait(&backup_cond, &backup_mutex);
+  backup_thread_collect();
+  pthread_mutex_unlock(&backup_mutex);
+}
+
+static void backup_thread_stop(void)
+{
+  if (!backup_thread_running)
+    return;
+
+  pthread_mutex_lock(&backup_mutex);
+  backup_thread_quit = 1;
+  pthread_cond_broadcast(&backup_cond);
+  pthread_mutex_unlock(&backup_mutex);
+
+  pthread_join(backup_thread, NULL);
+  backup_thread_running = 0;
+  backup_thread_collect();
+}
+
+/* Called once per frame, hands rate limited flushes to the thread. If the
+ * previous flush is still being written the new one waits a frame. */
+static void update_backup_async(void)
+{
+  if (use_libretro_save_method)
+    return;
+
+  if (!backup_thread_running) {
+    if (backup_flush_due())
+      update_backup();
+    return;
+  }
+
+  pthread_mutex_lock(&backup_mutex);
+  backup_thread_collect();
+  if (backup_flush_due() && !backup_flush_queued &&
+      prepare_backup_flush(&backup_flush)) {
+    backup_flush_queued = 1;
+    pthread_cond_signal(&backup_cond);
+  }
+  pthread_mutex_unlock(&backup_mutex);
+}
+
 void gamepak_related_name(char *buf, size_t len, char *new_extension)
 {
   char root_dir[512];
@@ -116,10 +246,77 @@ void config_file_name(char *buf, size_t len, int is_game)
   }
 }
 
+static u64 rewind_clock_usec(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void setup_rewind(void)
+{
+  /* Matches the "Rewind Buffer" menu entries, OFF/2MB/4MB/... */
+  u32 buffer_size = rewind_buffer ? (1024 * 1024) << rewind_buffer : 0;
+
+  if (!init_rewind(buffer_size, rewind_interval, rewind_clock_usec))
+    printf("Could not allocate the rewind buffer\n");
+}
+
+void setup_video(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cores < 1)
+    cores = 1;
+
+  init_line_reuse(line_reuse);
+  init_color_correction(color_correct);
+
+  /* The emulation keeps running on its own core meanwhile */
+  video_scale_workers(threaded_scaling ? (cores > 1 ? cores - 1 : 1) : 0);
+
+#ifdef HAVE_RENDER_THREAD
+  init_render_thread(render_thread == RENDER_THREAD_LINE);
+  init_render_bands(render_thread == RENDER_THREAD_FRAME ? cores : 0);
+#endif
+}
+
+void setup_audio(void)
+{
+  init_sound_rate_control(rate_control);
+
+#ifdef HAVE_AUDIO_THREAD
+  init_audio_thread(threaded_audio);
+#endif
+}
+
+static void print_rewind_stats(void)
+{
+  rewind_stats_type stats;
+
+  if (!rewind_enabled())
+    return;
+
+  rewind_get_stats(&stats);
+  if (!stats.captures)
+    return;
+
+  printf("Rewind: %u snapshots, %u/%u KB used, state %u bytes\n",
+    stats.snapshots, stats.buffer_used / 1024, stats.buffer_size / 1024,
+    stats.state_size);
+  printf("Rewind: average delta %u bytes, average capture %u us\n",
+    (u32)(stats.total_delta_size / stats.captures),
+    (u32)(stats.total_capture_usec / stats.captures));
+}
+
 void handle_emu_action(emu_action action)
 {
   static frameskip_style_t prev_frameskip_style;
   static emu_action prev_action = EACTION_NONE;
+
+  /* Rewind runs for as long as it is held */
+  rewinding = (action == EACTION_REWIND);
+
   if (prev_action != EACTION_NONE && prev_action == action) return;
 
   switch (action)
@@ -156,8 +353,12 @@ void handle_emu_action(emu_action action)
       break;
     case EACTION_MENU:
       toggle_fast_forward(1);
+      backup_thread_wait();
       update_backup();
       menu_loop();
+      setup_video();
+      setup_audio();
+      frame_timer_reset = 1;
       break;
     default:
       break;
@@ -166,6 +367,39 @@ void handle_emu_action(emu_action action)
   prev_action = action;
 }
 
+/* Sleeps until the next frame is due by the host clock. Frames that are
+ * late aren't made up for, and the clock restarts from now after a pause
+ * (the menu) or any gap of more than a few frames. */
+static void wait_for_frame(void)
+{
+  static struct timespec next;
+  const long frame_ns = (long)((308 * 228 * 4) * 1000000000.0 / GBC_BASE_RATE);
+  struct timespec now;
+  s64 behind;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (frame_timer_reset) {
+    frame_timer_reset = 0;
+    next = now;
+    return;
+  }
+
+  next.tv_nsec += frame_ns;
+  if (next.tv_nsec >= 1000000000) {
+    next.tv_nsec -= 1000000000;
+    next.tv_sec++;
+  }
+
+  behind = (s64)(now.tv_sec - next.tv_sec) * 1000000000 +
+    (now.tv_nsec - next.tv_nsec);
+
+  if (behind > 0 || behind < -4 * (s64)frame_ns)
+    next = now;
+  else
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+}
+
 void synchronize(void)
 {
   static uint32_t vsyncs = 0;
@@ -181,7 +415,8 @@ void synchronize(void)
     case FRAMESKIP_AUTO:
       skip_next_frame = 0;
 
-      if (capacity > FRAMESKIP_UNDERRUN_THRESHOLD) {
+      if (capacity > (rate_control ? FRAMESKIP_RATE_CONTROL_THRESHOLD :
+          FRAMESKIP_UNDERRUN_THRESHOLD)) {
         skip_next_frame = 1;
         skipped_frames++;
       }
@@ -200,6 +435,13 @@ void synchronize(void)
     skipped_frames = 0;
   }
 
+  /* Frames are paced by the host clock instead of waiting for room in the
+   * audio buffer, and the audio is stretched to keep the buffer half full. */
+  if (rate_control && limit_frames) {
+    adjust_sound_output_rate(RATE_CONTROL_MAX_ADJUST * (capacity * 2.0 - 1.0));
+    wait_for_frame();
+  }
+
   if (show_fps) {
     ticks = plat_get_ticks_ms();
     if (ticks > nextsec) {
@@ -364,6 +606,7 @@ int main(int argc, char *argv[])
 
   init_main();
   init_sound(1);
+  init_video();
   menu_init();
 
 #if defined(HAVE_DYNAREC)
@@ -385,12 +628,20 @@ int main(int argc, char *argv[])
 #endif
 
   reset_gba();
+  backup_thread_start();
+  setup_rewind();
+  setup_video();
+  setup_audio();
 
   do {
+    int rewound;
+
     update_input();
 
     synchronize();
 
+    rewound = rewinding && rewind_step();
+
 #ifdef HAVE_DYNAREC
     if (dynarec_enable)
       execute_arm_translate(execute_cycles);
@@ -398,8 +649,13 @@ int main(int argc, char *argv[])
 #endif
       execute_arm(execute_cycles);
 
+    if (!rewound)
+      rewind_capture();
+
     render_audio();
 
+    update_backup_async();
+
     print_hud();
 
     if (!skip_next_frame)
@@ -412,8 +668,23 @@ int main(int argc, char *argv[])
 
 void quit()
 {
+  video_scale_workers(0);
+
+#ifdef HAVE_RENDER_THREAD
+  init_render_thread(0);
+  init_render_bands(0);
+#endif
+
+#ifdef HAVE_AUDIO_THREAD
+  init_audio_thread(0);
+#endif
+
+  backup_thread_stop();
   update_backup();
 
+  print_rewind_stats();
+  rewind_term();
+
   memory_term();
 
   if (gba_screen_pixels_prev) {
@@ -14,6 +14,7 @@ typedef enum {
   EACTION_SAVE_STATE,
   EACTION_LOAD_STATE,
   EACTION_QUIT,
+  EACTION_REWIND,
 } emu_action;
 
 typedef enum {
@@ -43,6 +44,12 @@ typedef enum {
   SCALING_FULL_SMOOTH,
 } scaling_mode_t;
 
+typedef enum {
+  RENDER_THREAD_NONE = 0,
+  RENDER_THREAD_LINE,
+  RENDER_THREAD_FRAME,
+} render_thread_t;
+
 
 extern int should_quit;
 
@@ -55,6 +62,13 @@ extern int color_correct;
 extern int lcd_blend;
 extern int show_fps;
 extern int limit_frames;
+extern int rewind_buffer;
+extern int rewind_interval;
+extern render_thread_t render_thread;
+extern int line_reuse;
+extern int rate_control;
+extern int threaded_audio;
+extern int threaded_scaling;
 
 extern uint16_t *gba_screen_pixels_prev;
 extern uint16_t *gba_processed_pixels;
@@ -66,5 +80,8 @@ void config_file_name(char *buf, size_t len, int is_game);
 void handle_emu_action(emu_action action);
 int save_state_file(unsigned state_slot);
 int load_state_file(unsigned state_slot);
+void setup_rewind(void);
+void setup_video(void);
+void setup_audio(void);
 
 #endif /* __FRONTEND_MAIN_H__ */
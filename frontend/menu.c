@@ -53,6 +53,7 @@ me_bind_action emuctrl_actions[] =
   { "Show/Hide FPS    ", 1 << EACTION_TOGGLE_FPS },
   { "Toggle FF        ", 1 << EACTION_TOGGLE_FF },
   { "Enter Menu       ", 1 << EACTION_MENU },
+  { "Rewind (hold)    ", 1 << EACTION_REWIND },
   { NULL,                0 }
 };
 
@@ -114,12 +115,28 @@ static const char h_color_correct[]   = "Modifies colors to simulate original di
 static const char h_lcd_blend[]       = "Blends frames to simulate LCD lag";
 static const char h_show_fps[]        = "Shows frames and vsyncs per second";
 static const char h_dynarec_enable[]  = "Improves performance, but may reduce accuracy";
+static const char h_rewind_buffer[]   = "Memory used to keep rewind history";
+static const char h_rewind_interval[] = "Frames between rewind snapshots,\n"
+          "higher values are cheaper but coarser";
+static const char h_render_thread[]   = "Line: draws the screen on another CPU core\n"
+          "Frame: draws whole frames on all CPU cores";
+static const char h_line_reuse[]      = "Copies lines that didn't change since the\n"
+          "last frame instead of drawing them";
+static const char h_rate_control[]    = "Runs at a steady frame rate and stretches\n"
+          "the audio slightly to stay in sync";
+static const char h_threaded_audio[]  = "Outputs audio from another CPU core";
+static const char h_threaded_scaling[] = "Scales frames on other CPU cores while the\n"
+          "next one runs, shows them a frame later";
 
 
 static const char *men_frameskip[] = { "OFF", "Auto", "Manual", NULL };
 
 static const char *men_scaling[] = { "Native", "3:2 Sharp", "3:2 Smooth", "4:3 Sharp", "4:3 Smooth", NULL};
 
+static const char *men_rewind_buffer[] = { "OFF", "2MB", "4MB", "8MB", "16MB", NULL };
+
+static const char *men_render_thread[] = { "OFF", "Line", "Frame", NULL };
+
 static menu_entry e_menu_options[] =
 {
   mee_enum         ("Frameskip",                0, frameskip_style, men_frameskip),
@@ -129,6 +146,17 @@ static menu_entry e_menu_options[] =
   mee_onoff_h      ("LCD Ghosting",             0, lcd_blend, 1, h_lcd_blend),
   mee_onoff_h      ("Dynamic Recompiler",       0, dynarec_enable, 1, h_dynarec_enable),
   mee_onoff_h      ("Show FPS",                 0, show_fps, 1, h_show_fps),
+  mee_enum_h       ("Rewind Buffer",            0, rewind_buffer, men_rewind_buffer, h_rewind_buffer),
+  mee_range_h      ("Rewind Interval",          0, rewind_interval, 1, 10, h_rewind_interval),
+#ifdef HAVE_RENDER_THREAD
+  mee_enum_h       ("Threaded Rendering",       0, render_thread, men_render_thread, h_render_thread),
+#endif
+  mee_onoff_h      ("Reuse Unchanged Lines",    0, line_reuse, 1, h_line_reuse),
+  mee_onoff_h      ("Audio Rate Control",       0, rate_control, 1, h_rate_control),
+#ifdef HAVE_AUDIO_THREAD
+  mee_onoff_h      ("Threaded Audio",           0, threaded_audio, 1, h_threaded_audio),
+#endif
+  mee_onoff_h      ("Threaded Scaling",         0, threaded_scaling, 1, h_threaded_scaling),
   mee_cust_nosave  ("Save global config",       MA_OPT_SAVECFG,      mh_savecfg, mgn_saveloadcfg),
   mee_cust_nosave  ("Save game config",         MA_OPT_SAVECFG_GAME, mh_savecfg, mgn_saveloadcfg),
   mee_handler_h    ("Restore defaults",         mh_restore_defaults, h_restore_def),
@@ -139,12 +167,18 @@ static int menu_loop_options(int id, int keys)
 {
   static int sel = 0;
   int prev_dynarec_enable = dynarec_enable;
+  int prev_rewind_buffer = rewind_buffer;
+  int prev_rewind_interval = rewind_interval;
 
   me_loop(e_menu_options, &sel);
 
   if (prev_dynarec_enable != dynarec_enable)
     init_caches();
 
+  if (prev_rewind_buffer != rewind_buffer ||
+      prev_rewind_interval != rewind_interval)
+    setup_rewind();
+
   return 0;
 }
 
@@ -192,6 +226,7 @@ static int main_menu_handler(int id, int keys)
     return menu_loop_savestate(1);
   case MA_MAIN_RESET_GAME:
     reset_gba();
+    rewind_reset();
     return 1;
   case MA_MAIN_EXIT:
     should_quit = 1;
@@ -231,6 +266,13 @@ void menu_set_defaults(void)
   lcd_blend = 0;
   show_fps = 0;
   limit_frames = 1;
+  rewind_buffer = 0;
+  rewind_interval = 2;
+  render_thread = 0;
+  line_reuse = 0;
+  rate_control = 0;
+  threaded_audio = 0;
+  threaded_scaling = 0;
 }
 
 void menu_loop(void)
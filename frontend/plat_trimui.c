@@ -1,4 +1,5 @@
 #include <SDL/SDL.h>
+#include <semaphore.h>
 #include "common.h"
 
 #include "frontend/main.h"
@@ -11,10 +12,16 @@
 
 static SDL_Surface* screen;
 
+// Single producer, single consumer ring: only plat_sound_write() moves
+// buf_w and only the SDL callback moves buf_r. Both count samples without
+// wrapping, BUF_LEN must be a power of two.
 #define BUF_LEN 8192
-
 static short buf[BUF_LEN];
-static int buf_w, buf_r;
+static unsigned buf_w, buf_r;
+
+// Set while the writer waits for the callback to free some space.
+static int buf_waiting;
+static sem_t buf_sem;
 
 static char msg[HUD_LEN];
 
@@ -113,6 +120,10 @@ void plat_video_menu_leave(void)
   SDL_LockSurface(screen);
   memset(g_menuscreen_ptr, 0, 320 * 240 * sizeof(uint16_t));
   SDL_UnlockSurface(screen);
+
+  /* Settings may have changed, draw the next frame
+   * wherever it's shown from now on */
+  video_set_direct(NULL, 0, 0);
 }
 
 void plat_video_open(void)
@@ -126,6 +137,26 @@ void plat_video_set_msg(char *new_msg)
 
 void plat_video_flip(void)
 {
+  uint32_t pitch = screen->pitch / sizeof(uint16_t);
+
+  /* Show the frame the scale workers drew since the last flip */
+  if (video_scale_finish()) {
+    if (msg[0])
+      video_print_msg(screen->pixels, screen->h, pitch, msg);
+    g_menuscreen_ptr = fb_flip();
+  }
+
+  /* And hand them this one, unless it has to be drawn here */
+  if (!SDL_MUSTLOCK(screen)) {
+    if (msg[0])
+      video_clear_msg(screen->pixels, screen->h, pitch);
+
+    if (video_scale_start(screen->pixels, screen->h, pitch)) {
+      msg[0] = 0;
+      return;
+    }
+  }
+
   video_post_process();
   SDL_LockSurface(screen);
   if (msg[0])
@@ -139,6 +170,9 @@ void plat_video_flip(void)
 
   g_menuscreen_ptr = fb_flip();
   msg[0] = 0;
+
+  if (!SDL_MUSTLOCK(screen))
+    video_set_direct(screen->pixels, screen->h, screen->pitch / sizeof(uint16_t));
 }
 
 void plat_video_close(void)
@@ -148,24 +182,33 @@ void plat_video_close(void)
 void plat_sound_callback(void *unused, u8 *stream, int len)
 {
   short *p = (short *)stream;
-  len /= sizeof(short);
+  unsigned samples = len / sizeof(short);
+  unsigned r = buf_r;
+  unsigned count = __atomic_load_n(&buf_w, __ATOMIC_ACQUIRE) - r;
+  unsigned first;
 
-  while (buf_r != buf_w && len > 0) {
-    *p++ = buf[buf_r++];
-    buf_r %= BUF_LEN;
-    --len;
-  }
+  if (count > samples)
+    count = samples;
 
-  while(len > 0) {
-    *p++ = 0;
-    --len;
-  }
+  first = BUF_LEN - (r % BUF_LEN);
+  if (first > count)
+    first = count;
+
+  memcpy(p, buf + (r % BUF_LEN), first * sizeof(short));
+  memcpy(p + first, buf, (count - first) * sizeof(short));
+  memset(p + count, 0, (samples - count) * sizeof(short));
+
+  __atomic_store_n(&buf_r, r + count, __ATOMIC_SEQ_CST);
+
+  if (count && __atomic_load_n(&buf_waiting, __ATOMIC_SEQ_CST))
+    sem_post(&buf_sem);
 }
 
 void plat_sound_finish(void)
 {
   SDL_PauseAudio(1);
   SDL_CloseAudio();
+  sem_destroy(&buf_sem);
 }
 
 int plat_sound_init(void)
@@ -175,9 +218,12 @@ int plat_sound_init(void)
     return -1;
   }
 
+  buf_w = buf_r = 0;
+  sem_init(&buf_sem, 0, 0);
+
   SDL_AudioSpec spec;
 
-  spec.freq = sound_frequency;
+  spec.freq = sound_output_frequency;
   spec.format = AUDIO_S16SYS;
   spec.channels = 2;
   spec.samples = 512;
@@ -194,10 +240,8 @@ int plat_sound_init(void)
 
 float plat_sound_capacity(void)
 {
-  int buffered = 0;
-  if (buf_w != buf_r) {
-    buffered = buf_w > buf_r ? buf_w - buf_r : (buf_w + BUF_LEN) - buf_r;
-  }
+  unsigned buffered = __atomic_load_n(&buf_w, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&buf_r, __ATOMIC_ACQUIRE);
 
   return 1.0 - (float)buffered / BUF_LEN;
 }
@@ -205,25 +249,39 @@ float plat_sound_capacity(void)
 void plat_sound_write(void *data, int bytes)
 {
   short *sound_data = (short *)data;
-  SDL_LockAudio();
+  unsigned len = bytes / sizeof(short);
 
-  while (bytes > 0) {
-    while (((buf_w + 1) % BUF_LEN) == buf_r) {
-      SDL_UnlockAudio();
+  while (len > 0) {
+    unsigned w = buf_w;
+    unsigned space = BUF_LEN - (w - __atomic_load_n(&buf_r, __ATOMIC_SEQ_CST));
+    unsigned count, first;
 
-      if (!limit_frames)
+    if (space == 0) {
+      // With rate control frames are paced by the clock, not by waiting.
+      if (!limit_frames || rate_control)
         return;
 
-      plat_sleep_ms(1);
-      SDL_LockAudio();
+      // Check again once the callback knows to wake us, it may have read
+      // in between.
+      __atomic_store_n(&buf_waiting, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&buf_r, __ATOMIC_SEQ_CST) == w - BUF_LEN)
+        sem_wait(&buf_sem);
+      __atomic_store_n(&buf_waiting, 0, __ATOMIC_SEQ_CST);
+      continue;
     }
-    buf[buf_w] = *sound_data++;
 
-    ++buf_w;
-    buf_w %= BUF_LEN;
-    bytes -= sizeof(short);
+    count = len < space ? len : space;
+    first = BUF_LEN - (w % BUF_LEN);
+    if (first > count)
+      first = count;
+
+    memcpy(buf + (w % BUF_LEN), sound_data, first * sizeof(short));
+    memcpy(buf, sound_data + first, (count - first) * sizeof(short));
+
+    __atomic_store_n(&buf_w, w + count, __ATOMIC_RELEASE);
+    sound_data += count;
+    len -= count;
   }
-  SDL_UnlockAudio();
 }
 
 void plat_sdl_event_handler(void *event_)
@@ -253,7 +311,9 @@ int plat_init(void)
   }
   in_probe();
 
+  // Mixed at the device rate, cheaper than resampling to it.
   sound_frequency = 48000;
+  init_sound_output(sound_frequency);
 
   if (plat_sound_init()) {
     fprintf(stderr, "SDL sound failed to init: %s\n", SDL_GetError());
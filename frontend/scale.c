@@ -1,7 +1,9 @@
 #include "common.h"
-#include "gba_cc_lut.h"
 #include "frontend/main.h"
 #include "frontend/libpicofe/fonts.h"
+#include "frontend/scale.h"
+#include "frontend/scale_kernels.h"
+#include <pthread.h>
 
 #define Average(A, B) ((((A) & 0xF7DE) >> 1) + (((B) & 0xF7DE) >> 1) + ((A) & (B) & 0x0821))
 
@@ -323,150 +325,137 @@ static inline void gba_upscale_aspect(uint16_t *to, uint16_t *from,
   }
 }
 
-static inline void gba_nofilter_noscale(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch, uint16_t *src) {
+static inline void gba_nofilter_noscale(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch, uint16_t *src, uint32_t src_pitch, uint32_t first, uint32_t last) {
   int dst_x = ((dst_pitch - GBA_SCREEN_PITCH) / 2);
   int dst_y = ((dst_h - GBA_SCREEN_HEIGHT) / 2);
 
-  for (int y = 0; y < GBA_SCREEN_HEIGHT; y++) {
-    memcpy(dst + (dst_y + y) * dst_pitch + dst_x,
-           src + y * GBA_SCREEN_PITCH,
+  dst += dst_y * dst_pitch + dst_x;
+
+  /* Already there when the core drew into dst */
+  if (dst == src)
+    return;
+
+  for (int y = first; y < last; y++) {
+    memcpy(dst + y * dst_pitch,
+           src + y * src_pitch,
            GBA_SCREEN_PITCH * sizeof(src[0]));
   }
 }
 
-/* drowsnug's nofilter upscaler, edited by eggs for smoothness */
-#define AVERAGE16(c1, c2) (((c1) + (c2) + (((c1) ^ (c2)) & 0x0821))>>1)  //More accurate
-static inline void gba_smooth_upscale(uint16_t *dst, uint16_t *src, int h)
+void video_clear_msg(uint16_t *dst, uint32_t h, uint32_t pitch)
 {
-  int Eh = 0;
-  int dh = 0;
-  int width = 240;
-  int vf = 0;
-
-  dst += ((240-h)/2) * 320;  // blank upper border. h=240(full) or h=214(aspect)
-
-  int x, y;
-  for (y = 0; y < h; y++)
-  {
-    int source = dh * width;
-    for (x = 0; x < 320/4; x++)
-    {
-      register uint16_t a, b, c;
-
-      a = src[source];
-      b = src[source+1];
-      c = src[source+2];
-
-      if(vf == 1){
-        a = AVERAGE16(a, src[source+width]);
-        b = AVERAGE16(b, src[source+width+1]);
-        c = AVERAGE16(c, src[source+width+2]);
-      }
-
-      *dst++ = a;
-      *dst++ = AVERAGE16(AVERAGE16(a,b),b);
-      *dst++ = AVERAGE16(b,AVERAGE16(b,c));
-      *dst++ = c;
-      source+=3;
-
-    }
-    Eh += 160;
-    if(Eh >= h) {
-      Eh -= h;
-      dh++;
-      vf = 0;
-    }
-    else
-      vf = 1;
-  }
+  memset(dst + (h - 10) * pitch, 0, 10 * pitch * sizeof(uint16_t));
 }
 
-#define EXTRACT(c, mask, offset) ((c >> offset) & mask)
-#define BLENDCHANNEL(cl, cm, cr, mask, offset) ((((EXTRACT(cl, mask, offset) + 2 * EXTRACT(cm, mask, offset) + EXTRACT(cr, mask, offset)) >> 2) & mask) << offset)
-#define BLENDB(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0000000000011111, 0)
-#define BLENDG(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0000011111100000, 0)
-#define BLENDR(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0011111000000000, 2)
-static inline void gba_smooth_subpx_upscale(uint16_t *dst, uint16_t *src, int h)
+void video_print_msg(uint16_t *dst, uint32_t h, uint32_t pitch, char *msg)
 {
-  int Eh = 0;
-  int dh = 0;
-  int width = 240;
-  int vf = 0;
-
-  dst += ((240-h)/2) * 320;  // blank upper border. h=240(full) or h=214(aspect)
+  basic_text_out16_nf(dst, pitch, 2, h - 10, msg);
+}
 
-  int x, y;
-  for (y = 0; y < h; y++)
-  {
-    int source = dh * width;
-    for (x = 0; x < 320/4; x++)
-    {
-      register uint16_t a, b, c;
+/* Unscaled frames that aren't post processed are drawn by the core
+ * straight into the framebuffer, centred as gba_nofilter_noscale would
+ * copy them. Called with the framebuffer the next frame will be shown
+ * from, or NULL if it can't be drawn into directly. */
+static uint16_t *direct_pixels;
+static uint32_t direct_pitch;
 
-      a = src[source];
-      b = src[source+1];
-      c = src[source+2];
+void video_set_direct(uint16_t *dst, uint32_t h, uint32_t pitch) {
+  uint16_t *pixels = NULL;
 
-      if(vf == 1){
-        a = AVERAGE16(a, src[source+width]);
-        b = AVERAGE16(b, src[source+width+1]);
-        c = AVERAGE16(c, src[source+width+2]);
-      }
+  if (dst && scaling_mode == SCALING_NONE && !lcd_blend)
+    pixels = dst + ((h - GBA_SCREEN_HEIGHT) / 2) * pitch +
+             ((pitch - GBA_SCREEN_PITCH) / 2);
 
-      *dst++ = a;
-      *dst++ = BLENDB(a, a, b) | BLENDG(a, b, b) | BLENDR(b, b, b);
-      *dst++ = BLENDB(b, b, b) | BLENDG(b, b, c) | BLENDR(b, c, c);
-      *dst++ = c;
+  if (pixels == direct_pixels && pitch == direct_pitch)
+    return;
 
-      source+=3;
-    }
-    Eh += 160;
-    if(Eh >= h) {
-      Eh -= h;
-      dh++;
-      vf = 0;
-    }
-    else
-      vf = 1;
-  }
+  direct_pixels = pixels;
+  direct_pitch = pitch;
+  video_set_screen_target(pixels, pitch);
 }
 
-void video_clear_msg(uint16_t *dst, uint32_t h, uint32_t pitch)
+/* What a frame is post processed and scaled with. Settings are kept in
+ * the job, so scale workers never look at them while the menu runs. */
+typedef struct {
+  uint16_t *dst;
+  uint32_t h;
+  uint32_t pitch;
+  uint16_t *src;
+  scaling_mode_t mode;
+  int blend;
+  uint32_t rows;
+} scale_job_t;
+
+static void scale_job_init(scale_job_t *job, uint16_t *dst, uint32_t h,
+    uint32_t pitch, uint16_t *src)
 {
-  memset(dst + (h - 10) * pitch, 0, 10 * pitch * sizeof(uint16_t));
-}
+  job->dst = dst;
+  job->h = h;
+  job->pitch = pitch;
+  job->src = src;
+  job->mode = scaling_mode;
+  job->blend = lcd_blend;
 
-void video_print_msg(uint16_t *dst, uint32_t h, uint32_t pitch, char *msg)
-{
-  basic_text_out16_nf(dst, pitch, 2, h - 10, msg);
+  switch (scaling_mode)
+  {
+    case SCALING_ASPECT_SHARP:
+    case SCALING_ASPECT_SMOOTH:
+      job->rows = 214;
+      break;
+    case SCALING_FULL_SHARP:
+    case SCALING_FULL_SMOOTH:
+      job->rows = 240;
+      break;
+    default:
+      job->rows = GBA_SCREEN_HEIGHT;
+      break;
+  }
 }
 
-void video_scale(uint16_t *dst, uint32_t h, uint32_t pitch) {
-  uint16_t *gba_screen_pixels_buf = gba_screen_pixels;
+/* Draws rows first to last - 1 of the scaled picture */
+static void scale_rows(const scale_job_t *job, uint32_t first, uint32_t last) {
+  uint16_t *gba_screen_pixels_buf = job->src;
 
-  if (color_correct || lcd_blend)
+  if (job->blend)
     gba_screen_pixels_buf = gba_processed_pixels;
 
-  switch (scaling_mode)
+  switch (job->mode)
   {
     case SCALING_ASPECT_SHARP:
-      gba_smooth_subpx_upscale(dst, gba_screen_pixels_buf, 214);
-      break;
-    case SCALING_ASPECT_SMOOTH:
-      gba_smooth_upscale(dst, gba_screen_pixels_buf, 214);
-      break;
     case SCALING_FULL_SHARP:
-      gba_smooth_subpx_upscale(dst, gba_screen_pixels_buf, 240);
+      gba_smooth_scale_rows(scale_kernels->smooth_subpx_row, job->dst,
+          gba_screen_pixels_buf, job->rows, first, last);
       break;
+    case SCALING_ASPECT_SMOOTH:
     case SCALING_FULL_SMOOTH:
-      gba_smooth_upscale(dst, gba_screen_pixels_buf, 240);
+      gba_smooth_scale_rows(scale_kernels->smooth_row, job->dst,
+          gba_screen_pixels_buf, job->rows, first, last);
       break;
     default:
-      gba_nofilter_noscale(dst, h, pitch, gba_screen_pixels_buf);
+      gba_nofilter_noscale(job->dst, job->h, job->pitch, gba_screen_pixels_buf, GBA_SCREEN_PITCH, first, last);
       break;
   }
 }
 
+/* The frame last handed to the scale workers, the newest finished one
+ * until the next frame is shown. */
+static uint16_t *scale_last_frame;
+
+void video_scale(uint16_t *dst, uint32_t h, uint32_t pitch) {
+  scale_job_t job;
+
+  video_scale_finish();
+
+  if (direct_pixels) {
+    gba_nofilter_noscale(dst, h, pitch, direct_pixels, direct_pitch, 0, GBA_SCREEN_HEIGHT);
+    return;
+  }
+
+  scale_job_init(&job, dst, h, pitch,
+      scale_last_frame ? scale_last_frame : gba_screen_pixels);
+  scale_rows(&job, 0, job.rows);
+}
+
 /* Video post processing START */
 
 /* Note: This code is intentionally W.E.T.
@@ -475,35 +464,14 @@ void video_scale(uint16_t *dst, uint32_t h, uint32_t pitch) {
  * afford to do unnecessary comparisons/switches
  * inside the inner for loops */
 
-static void video_post_process_cc(void)
+static void video_post_process_mix(uint16_t *src, uint32_t first, uint32_t last)
 {
-   uint16_t *src = gba_screen_pixels;
-   uint16_t *dst = gba_processed_pixels;
+   uint16_t *src_curr = src + first * GBA_SCREEN_PITCH;
+   uint16_t *src_prev = gba_screen_pixels_prev + first * GBA_SCREEN_PITCH;
+   uint16_t *dst      = gba_processed_pixels + first * GBA_SCREEN_PITCH;
    size_t x, y;
 
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
-   {
-      for (x = 0; x < GBA_SCREEN_PITCH; x++)
-      {
-         u16 src_color = *(src + x);
-
-         /* Convert colour to RGB555 and perform lookup */
-         *(dst + x) = *(gba_cc_lut + (((src_color & 0xFFC0) >> 1) | (src_color & 0x1F)));
-      }
-
-      src += GBA_SCREEN_PITCH;
-      dst += GBA_SCREEN_PITCH;
-   }
-}
-
-static void video_post_process_mix(void)
-{
-   uint16_t *src_curr = gba_screen_pixels;
-   uint16_t *src_prev = gba_screen_pixels_prev;
-   uint16_t *dst      = gba_processed_pixels;
-   size_t x, y;
-
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
+   for (y = first; y < last; y++)
    {
       for (x = 0; x < GBA_SCREEN_PITCH; x++)
       {
@@ -526,79 +494,243 @@ static void video_post_process_mix(void)
    }
 }
 
-static void video_post_process_cc_mix(void)
-{
-   uint16_t *src_curr = gba_screen_pixels;
-   uint16_t *src_prev = gba_screen_pixels_prev;
-   uint16_t *dst      = gba_processed_pixels;
-   size_t x, y;
-
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
-   {
-      for (x = 0; x < GBA_SCREEN_PITCH; x++)
-      {
-         /* Get colours from current + previous frames (RGB565) */
-         uint16_t rgb_curr = *(src_curr + x);
-         uint16_t rgb_prev = *(src_prev + x);
-
-         /* Store colours for next frame */
-         *(src_prev + x)   = rgb_curr;
-
-         /* Mix colours
-          * > "Mixing Packed RGB Pixels Efficiently"
-          *   http://blargg.8bitalley.com/info/rgb_mixing.html */
-         uint16_t rgb_mix  = (rgb_curr + rgb_prev + ((rgb_curr ^ rgb_prev) & 0x821)) >> 1;
-
-         /* Convert colour to RGB555 and perform lookup */
-         *(dst + x) = *(gba_cc_lut + (((rgb_mix & 0xFFC0) >> 1) | (rgb_mix & 0x1F)));
-      }
-
-      src_curr += GBA_SCREEN_PITCH;
-      src_prev += GBA_SCREEN_PITCH;
-      dst      += GBA_SCREEN_PITCH;
-   }
-}
-
-void video_post_process(void)
+/* Returns 0 if the buffers couldn't be allocated */
+static int video_post_process_init(void)
 {
    size_t buf_size = GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * sizeof(u16);
 
-   /* If post processing is disabled, return
-    * immediately */
-   if (!color_correct && !lcd_blend)
-      return;
-
    /* Initialise output buffer, if required */
-   if (!gba_processed_pixels &&
-       (color_correct || lcd_blend))
+   if (!gba_processed_pixels)
    {
       gba_processed_pixels = (u16*)malloc(buf_size);
 
       if (!gba_processed_pixels)
-         return;
+         return 0;
 
       memset(gba_processed_pixels, 0xFFFF, buf_size);
    }
 
    /* Initialise 'history' buffer, if required */
-   if (!gba_screen_pixels_prev &&
-       lcd_blend)
+   if (!gba_screen_pixels_prev)
    {
       gba_screen_pixels_prev = (u16*)malloc(buf_size);
 
       if (!gba_screen_pixels_prev)
-         return;
+         return 0;
 
       memset(gba_screen_pixels_prev, 0xFFFF, buf_size);
    }
 
-   /* Assign post processing function */
-   if (color_correct && lcd_blend)
-     video_post_process_cc_mix();
-   else if (color_correct)
-     video_post_process_cc();
-   else if (lcd_blend)
-     video_post_process_mix();
+   return 1;
+}
+
+void video_post_process(void)
+{
+   /* If post processing is disabled, return
+    * immediately. Colour correction is done by
+    * the renderer */
+   if (!lcd_blend)
+      return;
+
+   if (!video_post_process_init())
+      return;
+
+   video_post_process_mix(gba_screen_pixels, 0, GBA_SCREEN_HEIGHT);
 }
 
 /* Video post processing END */
+
+/* Threaded scaling START */
+
+/* With scale workers, video_scale_start() hands a finished frame to a
+ * pool of threads that post process and scale it in bands of rows, while
+ * the emulation draws the next frame into a second screen buffer. The
+ * frame is shown by the next plat_video_flip(), so it comes a frame later
+ * than without. All rows are post processed before any are scaled, since
+ * a scaled row can read the source row below its own. */
+
+#define SCALE_WORKERS_MAX 8
+#define SCALE_BAND_ROWS   16
+
+static scale_job_t scale_job;
+static uint16_t *scale_spare_pixels;
+static pthread_t scale_threads[SCALE_WORKERS_MAX];
+static uint32_t scale_workers = 0;
+static uint32_t scale_generation = 0;
+static uint32_t scale_pending = 0;
+static uint32_t scale_mix_pending = 0;
+static uint32_t scale_busy = 0;
+static uint32_t scale_quit = 0;
+static uint32_t scale_next_row[2];
+static pthread_mutex_t scale_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scale_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scale_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Hands out the next band of rows, returns 0 once all are taken */
+static int scale_next_band(uint32_t *next_row, uint32_t rows,
+    uint32_t *first, uint32_t *last)
+{
+  *first = __atomic_fetch_add(next_row, SCALE_BAND_ROWS, __ATOMIC_SEQ_CST);
+  if (*first >= rows)
+    return 0;
+
+  *last = *first + SCALE_BAND_ROWS;
+  if (*last > rows)
+    *last = rows;
+  return 1;
+}
+
+static void *scale_worker_function(void *unused)
+{
+  uint32_t generation = 0;
+  uint32_t first, last;
+
+  pthread_mutex_lock(&scale_mutex);
+
+  while (1)
+  {
+    while (scale_generation == generation && !scale_quit)
+      pthread_cond_wait(&scale_work_cond, &scale_mutex);
+
+    if (scale_quit)
+      break;
+
+    generation = scale_generation;
+    pthread_mutex_unlock(&scale_mutex);
+
+    if (scale_job.blend)
+    {
+      while (scale_next_band(&scale_next_row[0], GBA_SCREEN_HEIGHT,
+          &first, &last))
+        video_post_process_mix(scale_job.src, first, last);
+
+      pthread_mutex_lock(&scale_mutex);
+      if (--scale_mix_pending == 0)
+        pthread_cond_broadcast(&scale_work_cond);
+      while (scale_mix_pending)
+        pthread_cond_wait(&scale_work_cond, &scale_mutex);
+      pthread_mutex_unlock(&scale_mutex);
+    }
+
+    while (scale_next_band(&scale_next_row[1], scale_job.rows, &first, &last))
+      scale_rows(&scale_job, first, last);
+
+    pthread_mutex_lock(&scale_mutex);
+    if (--scale_pending == 0)
+      pthread_cond_signal(&scale_done_cond);
+  }
+
+  pthread_mutex_unlock(&scale_mutex);
+  return NULL;
+}
+
+int video_scale_start(uint16_t *dst, uint32_t h, uint32_t pitch)
+{
+  uint16_t *frame = gba_screen_pixels;
+
+  video_scale_finish();
+  scale_last_frame = NULL;
+
+  /* Unscaled frames are better drawn straight into dst */
+  if (!scale_workers || direct_pixels ||
+      (scaling_mode == SCALING_NONE && !lcd_blend))
+    return 0;
+
+  if (lcd_blend && !video_post_process_init())
+    return 0;
+
+  scale_job_init(&scale_job, dst, h, pitch, frame);
+
+  /* The next frame is drawn into the other buffer */
+  gba_screen_pixels = scale_spare_pixels;
+  scale_spare_pixels = frame;
+  scale_last_frame = frame;
+
+  pthread_mutex_lock(&scale_mutex);
+  scale_next_row[0] = 0;
+  scale_next_row[1] = 0;
+  scale_pending = scale_workers;
+  scale_mix_pending = scale_workers;
+  scale_generation++;
+  pthread_cond_broadcast(&scale_work_cond);
+  pthread_mutex_unlock(&scale_mutex);
+
+  scale_busy = 1;
+  return 1;
+}
+
+int video_scale_finish(void)
+{
+  if (!scale_busy)
+    return 0;
+
+  pthread_mutex_lock(&scale_mutex);
+  while (scale_pending)
+    pthread_cond_wait(&scale_done_cond, &scale_mutex);
+  pthread_mutex_unlock(&scale_mutex);
+
+  scale_busy = 0;
+  return 1;
+}
+
+void video_scale_workers(uint32_t workers)
+{
+  size_t buf_size = GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * sizeof(uint16_t);
+  uint32_t i;
+
+  if (workers > SCALE_WORKERS_MAX)
+    workers = SCALE_WORKERS_MAX;
+
+  if (workers == scale_workers)
+    return;
+
+  video_scale_finish();
+
+  if (scale_workers)
+  {
+    pthread_mutex_lock(&scale_mutex);
+    scale_quit = 1;
+    pthread_cond_broadcast(&scale_work_cond);
+    pthread_mutex_unlock(&scale_mutex);
+
+    for (i = 0; i < scale_workers; i++)
+      pthread_join(scale_threads[i], NULL);
+
+    scale_quit = 0;
+    scale_workers = 0;
+
+    /* Keep the last frame where video_scale() finds it */
+    if (scale_last_frame)
+      memcpy(gba_screen_pixels, scale_last_frame, buf_size);
+    scale_last_frame = NULL;
+
+    free(scale_spare_pixels);
+    scale_spare_pixels = NULL;
+  }
+
+  if (!workers)
+    return;
+
+  scale_spare_pixels = (uint16_t*)calloc(1, buf_size);
+  if (!scale_spare_pixels)
+    return;
+
+  /* New workers start out waiting for generation 1 */
+  scale_generation = 0;
+
+  for (i = 0; i < workers; i++)
+  {
+    if (pthread_create(scale_threads + i, NULL, scale_worker_function, NULL))
+      break;
+  }
+
+  scale_workers = i;
+
+  if (!scale_workers)
+  {
+    free(scale_spare_pixels);
+    scale_spare_pixels = NULL;
+  }
+}
+
+/* Threaded scaling END */
@@ -2,7 +2,11 @@
 #define __FRONTEND_SCALE_H__
 
 void video_post_process(void);
+void video_set_direct(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch);
 void video_scale(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch);
+void video_scale_workers(uint32_t workers);
+int video_scale_start(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch);
+int video_scale_finish(void);
 void video_clear_msg(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch);
 void video_print_msg(uint16_t *dst, uint32_t dst_h, uint32_t dst_pitch, char *msg);
 
@@ -0,0 +1,349 @@
+#include <stddef.h>
+#include "frontend/scale_kernels.h"
+
+#define SRC_WIDTH 240
+#define DST_WIDTH 320
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define SCALE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCALE_NEON
+#include <arm_neon.h>
+#endif
+
+/* drowsnug's nofilter upscaler, edited by eggs for smoothness */
+#define AVERAGE16(c1, c2) (((c1) + (c2) + (((c1) ^ (c2)) & 0x0821))>>1)  //More accurate
+
+#define EXTRACT(c, mask, offset) ((c >> offset) & mask)
+#define BLENDCHANNEL(cl, cm, cr, mask, offset) ((((EXTRACT(cl, mask, offset) + 2 * EXTRACT(cm, mask, offset) + EXTRACT(cr, mask, offset)) >> 2) & mask) << offset)
+#define BLENDB(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0000000000011111, 0)
+#define BLENDG(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0000011111100000, 0)
+#define BLENDR(cl, cm, cr) BLENDCHANNEL(cl, cm, cr, 0b0011111000000000, 2)
+
+static void smooth_row_c(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  int x;
+  for (x = 0; x < DST_WIDTH/4; x++)
+  {
+    register uint16_t a, b, c;
+
+    a = src[0];
+    b = src[1];
+    c = src[2];
+
+    if(src_below){
+      a = AVERAGE16(a, src_below[0]);
+      b = AVERAGE16(b, src_below[1]);
+      c = AVERAGE16(c, src_below[2]);
+      src_below+=3;
+    }
+
+    *dst++ = a;
+    *dst++ = AVERAGE16(AVERAGE16(a,b),b);
+    *dst++ = AVERAGE16(b,AVERAGE16(b,c));
+    *dst++ = c;
+    src+=3;
+  }
+}
+
+static void smooth_subpx_row_c(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  int x;
+  for (x = 0; x < DST_WIDTH/4; x++)
+  {
+    register uint16_t a, b, c;
+
+    a = src[0];
+    b = src[1];
+    c = src[2];
+
+    if(src_below){
+      a = AVERAGE16(a, src_below[0]);
+      b = AVERAGE16(b, src_below[1]);
+      c = AVERAGE16(c, src_below[2]);
+      src_below+=3;
+    }
+
+    *dst++ = a;
+    *dst++ = BLENDB(a, a, b) | BLENDG(a, b, b) | BLENDR(b, b, b);
+    *dst++ = BLENDB(b, b, b) | BLENDG(b, b, c) | BLENDR(b, c, c);
+    *dst++ = c;
+    src+=3;
+  }
+}
+
+const scale_kernels_t scale_kernels_c = {
+  "c", smooth_row_c, smooth_subpx_row_c
+};
+
+/* The vector kernels do the same math on 16bit lanes. AVERAGE16 is
+ * computed as (c1 & c2) + (((c1 ^ c2) & ~0x0821) >> 1) + ((c1 ^ c2) & 0x0821),
+ * which is equal to it but can't overflow a lane. The subpixel blends are
+ * (3 * near + far) >> 2 per channel, which is what BLENDCHANNEL works out
+ * to for the weights used; a pixel blended with itself stays the same.
+ *
+ * A row takes 3 source pixels a b c at a time to 4 output pixels:
+ *   smooth: a, F(a, b), F(c, b), c with F(p, q) = AVERAGE16(AVERAGE16(p, q), q)
+ *   subpx:  a, B(a, b) | G(b, a) | R(b, b), B(b, b) | G(b, c) | R(c, b), c
+ * where B, G and R are the channel blends of their first argument weighted
+ * 3 to 1 with the second. */
+
+#ifdef SCALE_SSE2
+
+/* SSE2 has no byte shuffles, so 8 output pixels are built from the 6
+ * source pixels s0-s5 they come from: lo holds s0-s3 and hi s2-s5, and
+ * each output lane picks its operands from those with shufflelo. */
+#define SHUFFLE_PAIR(lo, hi, l3, l2, l1, l0, h3, h2, h1, h0)                  \
+  _mm_unpacklo_epi64(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(l3, l2, l1, l0)),   \
+                     _mm_shufflelo_epi16(hi, _MM_SHUFFLE(h3, h2, h1, h0)))
+
+__attribute__((target("sse2")))
+static inline __m128i average16_sse2(__m128i c1, __m128i c2)
+{
+  __m128i diff = _mm_xor_si128(c1, c2);
+  __m128i low = _mm_and_si128(diff, _mm_set1_epi16(0x0821));
+
+  return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(c1, c2), low),
+      _mm_srli_epi16(_mm_xor_si128(diff, low), 1));
+}
+
+/* 3 * p + q */
+__attribute__((target("sse2")))
+static inline __m128i weigh3_1_sse2(__m128i p, __m128i q)
+{
+  return _mm_add_epi16(_mm_add_epi16(p, _mm_add_epi16(p, p)), q);
+}
+
+__attribute__((target("sse2")))
+static inline void load_pixels_sse2(const uint16_t *src,
+    const uint16_t *src_below, __m128i *lo, __m128i *hi)
+{
+  *lo = _mm_loadl_epi64((const __m128i *)src);
+  *hi = _mm_loadl_epi64((const __m128i *)(src + 2));
+
+  if (src_below) {
+    *lo = average16_sse2(*lo, _mm_loadl_epi64((const __m128i *)src_below));
+    *hi = average16_sse2(*hi,
+        _mm_loadl_epi64((const __m128i *)(src_below + 2)));
+  }
+}
+
+__attribute__((target("sse2")))
+static void smooth_row_sse2(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  int x;
+
+  for (x = 0; x < DST_WIDTH / 8; x++) {
+    __m128i lo, hi, p, q;
+
+    load_pixels_sse2(src, src_below, &lo, &hi);
+
+    /* p = a a c c, q = a b b c */
+    p = SHUFFLE_PAIR(lo, hi, 2, 2, 0, 0, 3, 3, 1, 1);
+    q = SHUFFLE_PAIR(lo, hi, 2, 1, 1, 0, 3, 2, 2, 1);
+
+    _mm_storeu_si128((__m128i *)dst,
+        average16_sse2(average16_sse2(p, q), q));
+
+    src += 6;
+    if (src_below)
+      src_below += 6;
+    dst += 8;
+  }
+}
+
+__attribute__((target("sse2")))
+static void smooth_subpx_row_sse2(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  const __m128i mask_b = _mm_set1_epi16(0x001F);
+  const __m128i mask_g = _mm_set1_epi16(0x07E0);
+  int x;
+
+  for (x = 0; x < DST_WIDTH / 8; x++) {
+    __m128i lo, hi, p_b, p_g, p_r, q, b, g, r;
+
+    load_pixels_sse2(src, src_below, &lo, &hi);
+
+    /* The pixel weighted 3 in each channel's blend: p_b = a a b c,
+     * p_g = a b b c and p_r = a b c c. The other one is p_g for blue and
+     * red, and q = a a c c for green. */
+    p_b = SHUFFLE_PAIR(lo, hi, 2, 1, 0, 0, 3, 2, 1, 1);
+    p_g = SHUFFLE_PAIR(lo, hi, 2, 1, 1, 0, 3, 2, 2, 1);
+    p_r = SHUFFLE_PAIR(lo, hi, 2, 2, 1, 0, 3, 3, 2, 1);
+    q   = SHUFFLE_PAIR(lo, hi, 2, 2, 0, 0, 3, 3, 1, 1);
+
+    b = _mm_srli_epi16(weigh3_1_sse2(_mm_and_si128(p_b, mask_b),
+        _mm_and_si128(p_g, mask_b)), 2);
+    g = _mm_and_si128(_mm_srli_epi16(weigh3_1_sse2(
+        _mm_and_si128(p_g, mask_g), _mm_and_si128(q, mask_g)), 2), mask_g);
+    r = _mm_slli_epi16(_mm_srli_epi16(weigh3_1_sse2(
+        _mm_srli_epi16(p_r, 11), _mm_srli_epi16(p_g, 11)), 2), 11);
+
+    _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_or_si128(b, g), r));
+
+    src += 6;
+    if (src_below)
+      src_below += 6;
+    dst += 8;
+  }
+}
+
+static const scale_kernels_t scale_kernels_sse2 = {
+  "sse2", smooth_row_sse2, smooth_subpx_row_sse2
+};
+
+#endif /* SCALE_SSE2 */
+
+#ifdef SCALE_NEON
+
+/* NEON splits 24 source pixels into their a, b and c columns with vld3
+ * and interleaves the 4 output columns back with vst4. */
+
+static inline uint16x8_t average16_neon(uint16x8_t c1, uint16x8_t c2)
+{
+  uint16x8_t diff = veorq_u16(c1, c2);
+  uint16x8_t low = vandq_u16(diff, vdupq_n_u16(0x0821));
+
+  return vaddq_u16(vaddq_u16(vandq_u16(c1, c2), low),
+      vshrq_n_u16(veorq_u16(diff, low), 1));
+}
+
+static inline uint16x8x3_t load_pixels_neon(const uint16_t *src,
+    const uint16_t *src_below)
+{
+  uint16x8x3_t pixels = vld3q_u16(src);
+
+  if (src_below) {
+    uint16x8x3_t below = vld3q_u16(src_below);
+
+    pixels.val[0] = average16_neon(pixels.val[0], below.val[0]);
+    pixels.val[1] = average16_neon(pixels.val[1], below.val[1]);
+    pixels.val[2] = average16_neon(pixels.val[2], below.val[2]);
+  }
+
+  return pixels;
+}
+
+static void smooth_row_neon(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  int x;
+
+  for (x = 0; x < SRC_WIDTH / 24; x++) {
+    uint16x8x3_t pixels = load_pixels_neon(src, src_below);
+    uint16x8x4_t out;
+
+    out.val[0] = pixels.val[0];
+    out.val[1] = average16_neon(
+        average16_neon(pixels.val[0], pixels.val[1]), pixels.val[1]);
+    out.val[2] = average16_neon(
+        average16_neon(pixels.val[2], pixels.val[1]), pixels.val[1]);
+    out.val[3] = pixels.val[2];
+    vst4q_u16(dst, out);
+
+    src += 24;
+    if (src_below)
+      src_below += 24;
+    dst += 32;
+  }
+}
+
+/* (3 * p + q) >> 2 of a channel. Blue and green fit in their lanes where
+ * they are, red is moved down first so it can't overflow. */
+#define BLEND3_1_NEON(p, q, mask)                                             \
+  vandq_u16(vshrq_n_u16(vmlaq_n_u16(vandq_u16(q, vdupq_n_u16(mask)),          \
+      vandq_u16(p, vdupq_n_u16(mask)), 3), 2), vdupq_n_u16(mask))
+
+#define BLEND3_1_RED_NEON(p, q)                                               \
+  vshlq_n_u16(vshrq_n_u16(vmlaq_n_u16(vshrq_n_u16(q, 11),                     \
+      vshrq_n_u16(p, 11), 3), 2), 11)
+
+static void smooth_subpx_row_neon(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below)
+{
+  int x;
+
+  for (x = 0; x < SRC_WIDTH / 24; x++) {
+    uint16x8x3_t pixels = load_pixels_neon(src, src_below);
+    uint16x8_t a = pixels.val[0], b = pixels.val[1], c = pixels.val[2];
+    uint16x8x4_t out;
+
+    out.val[0] = a;
+    out.val[1] = vorrq_u16(vorrq_u16(BLEND3_1_NEON(a, b, 0x001F),
+        BLEND3_1_NEON(b, a, 0x07E0)), vandq_u16(b, vdupq_n_u16(0xF800)));
+    out.val[2] = vorrq_u16(vorrq_u16(vandq_u16(b, vdupq_n_u16(0x001F)),
+        BLEND3_1_NEON(b, c, 0x07E0)), BLEND3_1_RED_NEON(c, b));
+    out.val[3] = c;
+    vst4q_u16(dst, out);
+
+    src += 24;
+    if (src_below)
+      src_below += 24;
+    dst += 32;
+  }
+}
+
+static const scale_kernels_t scale_kernels_neon = {
+  "neon", smooth_row_neon, smooth_subpx_row_neon
+};
+
+const scale_kernels_t *scale_kernels = &scale_kernels_neon;
+
+#else
+
+const scale_kernels_t *scale_kernels = &scale_kernels_c;
+
+#endif /* SCALE_NEON */
+
+#ifdef SCALE_SSE2
+
+__attribute__((constructor))
+static void init_scale_kernels(void)
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+    scale_kernels = &scale_kernels_sse2;
+}
+
+#endif
+
+/* Output row y is drawn from source row 160 * y / h, blended with the one
+ * below when the previous output row came from the same one. Any range of
+ * rows can be drawn on its own. h=240(full) or h=214(aspect) */
+void gba_smooth_scale_rows(scale_row_t row, uint16_t *dst,
+    const uint16_t *src, int h, int first, int last)
+{
+  int y;
+
+  dst += ((240-h)/2 + first) * DST_WIDTH;  // blank upper border
+
+  for (y = first; y < last; y++)
+  {
+    int dh = 160 * y / h;
+    int vf = y && (160 * (y - 1) / h == dh);
+    const uint16_t *source = src + dh * SRC_WIDTH;
+
+    row(dst, source, vf ? source + SRC_WIDTH : NULL);
+    dst += DST_WIDTH;
+  }
+}
+
+void gba_smooth_upscale(const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h)
+{
+  gba_smooth_scale_rows(kernels->smooth_row, dst, src, h, 0, h);
+}
+
+void gba_smooth_subpx_upscale(const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h)
+{
+  gba_smooth_scale_rows(kernels->smooth_subpx_row, dst, src, h, 0, h);
+}
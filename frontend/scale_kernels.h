@@ -0,0 +1,33 @@
+#ifndef __FRONTEND_SCALE_KERNELS_H__
+#define __FRONTEND_SCALE_KERNELS_H__
+
+#include <stdint.h>
+
+/* The smooth scalers stretch the 240x160 GBA screen to 320 pixels wide
+ * rows, 3 source pixels to 4. They are drawn a row at a time by these
+ * kernels; src_below is the next source row to blend with, or NULL. */
+typedef void (*scale_row_t)(uint16_t *dst, const uint16_t *src,
+    const uint16_t *src_below);
+
+typedef struct {
+  const char *name;
+  scale_row_t smooth_row;
+  scale_row_t smooth_subpx_row;
+} scale_kernels_t;
+
+/* The plain C kernels, and the fastest ones the CPU runs (picked at
+ * startup on x86, SSE2 is optional on 32bit builds; NEON at build time).
+ * All of them give the same output. */
+extern const scale_kernels_t scale_kernels_c;
+extern const scale_kernels_t *scale_kernels;
+
+/* Draws output rows first to last - 1 of an h rows high picture */
+void gba_smooth_scale_rows(scale_row_t row, uint16_t *dst,
+    const uint16_t *src, int h, int first, int last);
+
+void gba_smooth_upscale(const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h);
+void gba_smooth_subpx_upscale(const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h);
+
+#endif /* __FRONTEND_SCALE_KERNELS_H__ */
@@ -20,6 +20,13 @@
 #include "common.h"
 #include "zip.h"
 
+#if defined(_WIN32)
+#include <io.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /* Sound */
 #define gbc_sound_tone_control_low(channel, address)                          \
 {                                                                             \
@@ -254,6 +261,8 @@ static void trigger_timer(u32 timer_number, u32 value)
                         sound_frequency) / GBC_BASE_RATE) * 2;
 
             sound_update_frequency_step(timer_number);
+            // Samples popped so far go where the buffer position was.
+            render_direct_sound();
             adjust_sound_buffer(timer_number, 0);
             adjust_sound_buffer(timer_number, 1);
          }
@@ -311,12 +320,40 @@ u8 ewram[1024 * 256 * 2];
 u8 iwram[1024 * 32 * 2];
 u8 vram[1024 * 96];
 
+u8 vram_dirty[VRAM_DIRTY_PAGES];
+u8 palette_dirty[PALETTE_DIRTY_ROWS];
+u8 oam_dirty[OAM_DIRTY_ENTRIES];
+
 u8 bios_rom[1024 * 16 * 2];
 u32 bios_read_protect;
 
 // Up to 128kb, store SRAM, flash ROM, or EEPROM here.
 u8 gamepak_backup[1024 * 128];
 
+// Pages of gamepak_backup modified since the last flush to disk.
+u8 backup_dirty[BACKUP_DIRTY_PAGES];
+u32 backup_dirty_pending = 0;
+
+// Frames since the first unflushed write and since the latest one.
+u32 backup_dirty_frames = 0;
+u32 backup_idle_frames = 0;
+
+// Size of the image currently on disk, 0 if it has to be rewritten.
+u32 backup_file_size = 0;
+
+#define mark_backup_dirty(offset)                                             \
+  backup_dirty[(offset) >> BACKUP_DIRTY_SHIFT] = 1;                           \
+  backup_dirty_pending = 1;                                                   \
+  backup_idle_frames = 0                                                      \
+
+static void mark_backup_dirty_range(u32 offset, u32 length)
+{
+  memset(backup_dirty + (offset >> BACKUP_DIRTY_SHIFT), 1,
+   length >> BACKUP_DIRTY_SHIFT);
+  backup_dirty_pending = 1;
+  backup_idle_frames = 0;
+}
+
 // Keeps us knowing how much we have left.
 u8 *gamepak_rom;
 u32 gamepak_size;
@@ -477,6 +514,7 @@ void function_cc write_eeprom(u32 unused_address, u32 value)
         {
           eeprom_mode = EEPROM_WRITE_MODE;
           memset(gamepak_backup + eeprom_address, 0, 8);
+          mark_backup_dirty(eeprom_address);
         }
       }
       break;
@@ -484,6 +522,7 @@ void function_cc write_eeprom(u32 unused_address, u32 value)
     case EEPROM_WRITE_MODE:
       gamepak_backup[eeprom_address + (eeprom_counter / 8)] |=
        (value & 0x01) << (7 - (eeprom_counter % 8));
+      mark_backup_dirty(eeprom_address);
       eeprom_counter++;
       if(eeprom_counter == 64)
       {
@@ -726,11 +765,26 @@ static cpu_alert_type trigger_dma(u32 dma_number, u32 value)
 }
 
 
-#define access_register8_high(address)                                        \
-  value = (value << 8) | (address8(io_registers, address))                    \
+// I/O register writes are dispatched through a table with one entry per
+// halfword. Each entry holds the handler for 16bit writes (and optionally a
+// dedicated one for 8bit writes) plus the mask of bits that can be written.
+// Registers without a handler are plain masked stores, which is the common
+// case for the video registers touched every line by HBlank effects.
+// 8bit writes without a dedicated handler are merged into their halfword and
+// take the 16bit path. Paired registers that games usually write with a
+// single 32bit store (DMA, timers, BG affine) get a direct 32bit handler.
 
-#define access_register8_low(address)                                         \
-  value = ((address8(io_registers, address + 1)) << 8) | value                \
+typedef cpu_alert_type (*io_write_handler_type)(u32 address, u32 value);
+
+typedef struct
+{
+  io_write_handler_type write16;
+  io_write_handler_type write8;
+  u32 mask;
+} io_register_handler_type;
+
+static io_register_handler_type io_register_handlers[0x400 / 2];
+static io_write_handler_type io_register32_handlers[0x400 / 4];
 
 #define access_register16_high(address)                                       \
   value = (value << 16) | (readaddress16(io_registers, address))              \
@@ -738,730 +792,388 @@ static cpu_alert_type trigger_dma(u32 dma_number, u32 value)
 #define access_register16_low(address)                                        \
   value = ((readaddress16(io_registers, address + 2)) << 16) | value          \
 
-cpu_alert_type function_cc write_io_register8(u32 address, u32 value)
+static cpu_alert_type io_write_dispcnt(u32 address, u32 value)
 {
-  value &= 0xff;
-  switch(address)
-  {
-    case 0x00:
-    {
-      u32 dispcnt = read_ioreg(REG_DISPCNT);
-
-      if((value & 0x07) != (dispcnt & 0x07))
-        reg[OAM_UPDATED] = 1;
-
-      address8(io_registers, 0x00) = value;
-      break;
-    }
-
-    // DISPSTAT (lower byte)
-    case 0x04:
-      address8(io_registers, 0x04) =
-       (address8(io_registers, 0x04) & 0x07) | (value & ~0x07);
-      break;
-
-    // VCOUNT
-    case 0x06:
-    case 0x07:
-      break;
-
-    // BG2 reference X
-    case 0x28:
-      access_register8_low(0x28);
-      access_register16_low(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    case 0x29:
-      access_register8_high(0x28);
-      access_register16_low(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    case 0x2A:
-      access_register8_low(0x2A);
-      access_register16_high(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    case 0x2B:
-      access_register8_high(0x2A);
-      access_register16_high(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    // BG2 reference Y
-    case 0x2C:
-      access_register8_low(0x2C);
-      access_register16_low(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    case 0x2D:
-      access_register8_high(0x2C);
-      access_register16_low(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    case 0x2E:
-      access_register8_low(0x2E);
-      access_register16_high(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    case 0x2F:
-      access_register8_high(0x2E);
-      access_register16_high(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    // BG3 reference X
-    case 0x38:
-      access_register8_low(0x38);
-      access_register16_low(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
+  u32 dispcnt = read_ioreg(REG_DISPCNT);
 
-    case 0x39:
-      access_register8_high(0x38);
-      access_register16_low(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
-
-    case 0x3A:
-      access_register8_low(0x3A);
-      access_register16_high(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
-
-    case 0x3B:
-      access_register8_high(0x3A);
-      access_register16_high(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
-
-    // BG3 reference Y
-    case 0x3C:
-      access_register8_low(0x3C);
-      access_register16_low(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
+  if((value & 0x07) != (dispcnt & 0x07))
+    reg[OAM_UPDATED] = 1;
 
-    case 0x3D:
-      access_register8_high(0x3C);
-      access_register16_low(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
-
-    case 0x3E:
-      access_register8_low(0x3E);
-      access_register16_high(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
-
-    case 0x3F:
-      access_register8_high(0x3E);
-      access_register16_high(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
-
-    // Sound 1 control sweep
-    case 0x60:
-      access_register8_low(0x60);
-      gbc_sound_tone_control_sweep();
-      break;
+  write_ioreg(REG_DISPCNT, value);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x61:
-      access_register8_low(0x60);
-      gbc_sound_tone_control_sweep();
-      break;
+// BG2/BG3 reference points (0x28, 0x2C, 0x38, 0x3C), 28bit signed
 
-    // Sound 1 control duty/length/envelope
-    case 0x62:
-      access_register8_low(0x62);
-      gbc_sound_tone_control_low(0, 0x62);
-      break;
+static void write_affine_reference(u32 address, u32 value)
+{
+  s32 reference = (s32)(value << 4) >> 4;
+  u32 layer = (address >> 4) & 0x01;
 
-    case 0x63:
-      access_register8_high(0x62);
-      gbc_sound_tone_control_low(0, 0x62);
-      break;
+  if(address & 0x04)
+    affine_reference_y[layer] = reference;
+  else
+    affine_reference_x[layer] = reference;
 
-    // Sound 1 control frequency
-    case 0x64:
-      access_register8_low(0x64);
-      gbc_sound_tone_control_high(0, 0x64);
-      break;
+  address32(io_registers, address) = eswap32(value);
+}
 
-    case 0x65:
-      access_register8_high(0x64);
-      gbc_sound_tone_control_high(0, 0x64);
-      break;
+static cpu_alert_type io_write_affine_reference(u32 address, u32 value)
+{
+  u32 base_address = address & ~0x03;
 
-    // Sound 2 control duty/length/envelope
-    case 0x68:
-      access_register8_low(0x68);
-      gbc_sound_tone_control_low(1, 0x68);
-      break;
+  if(address & 0x02)
+    access_register16_high(base_address);
+  else
+    access_register16_low(base_address);
 
-    case 0x69:
-      access_register8_high(0x68);
-      gbc_sound_tone_control_low(1, 0x68);
-      break;
+  write_affine_reference(base_address, value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 2 control frequency
-    case 0x6C:
-      access_register8_low(0x6C);
-      gbc_sound_tone_control_high(1, 0x6C);
-      break;
+static cpu_alert_type io_write_affine_reference32(u32 address, u32 value)
+{
+  write_affine_reference(address, value);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x6D:
-      access_register8_high(0x6C);
-      gbc_sound_tone_control_high(1, 0x6C);
-      break;
+static cpu_alert_type io_write_sound1_sweep(u32 address, u32 value)
+{
+  gbc_sound_tone_control_sweep();
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 3 control wave
-    case 0x70:
-      access_register8_low(0x70);
-      gbc_sound_wave_control();
-      break;
+static cpu_alert_type io_write_sound1_control_low(u32 address, u32 value)
+{
+  gbc_sound_tone_control_low(0, 0x62);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x71:
-      access_register8_high(0x70);
-      gbc_sound_wave_control();
-      break;
+static cpu_alert_type io_write_sound1_control_high(u32 address, u32 value)
+{
+  gbc_sound_tone_control_high(0, 0x64);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 3 control length/volume
-    case 0x72:
-      access_register8_low(0x72);
-      gbc_sound_tone_control_low_wave();
-      break;
+static cpu_alert_type io_write_sound2_control_low(u32 address, u32 value)
+{
+  gbc_sound_tone_control_low(1, 0x68);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x73:
-      access_register8_high(0x72);
-      gbc_sound_tone_control_low_wave();
-      break;
+static cpu_alert_type io_write_sound2_control_high(u32 address, u32 value)
+{
+  gbc_sound_tone_control_high(1, 0x6C);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 3 control frequency
-    case 0x74:
-      access_register8_low(0x74);
-      gbc_sound_tone_control_high_wave();
-      break;
+static cpu_alert_type io_write_sound3_wave(u32 address, u32 value)
+{
+  gbc_sound_wave_control();
+  return CPU_ALERT_NONE;
+}
 
-    case 0x75:
-      access_register8_high(0x74);
-      gbc_sound_tone_control_high_wave();
-      break;
+static cpu_alert_type io_write_sound3_control_low(u32 address, u32 value)
+{
+  gbc_sound_tone_control_low_wave();
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 4 control length/envelope
-    case 0x78:
-      access_register8_low(0x78);
-      gbc_sound_tone_control_low(3, 0x78);
-      break;
+static cpu_alert_type io_write_sound3_control_high(u32 address, u32 value)
+{
+  gbc_sound_tone_control_high_wave();
+  return CPU_ALERT_NONE;
+}
 
-    case 0x79:
-      access_register8_high(0x78);
-      gbc_sound_tone_control_low(3, 0x78);
-      break;
+static cpu_alert_type io_write_sound4_control_low(u32 address, u32 value)
+{
+  gbc_sound_tone_control_low(3, 0x78);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound 4 control frequency
-    case 0x7C:
-      access_register8_low(0x7C);
-      gbc_sound_noise_control();
-      break;
+static cpu_alert_type io_write_sound4_control_high(u32 address, u32 value)
+{
+  gbc_sound_noise_control();
+  return CPU_ALERT_NONE;
+}
 
-    case 0x7D:
-      access_register8_high(0x7C);
-      gbc_sound_noise_control();
-      break;
+static cpu_alert_type io_write_soundcnt_l(u32 address, u32 value)
+{
+  gbc_trigger_sound(value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound control L
-    case 0x80:
-      access_register8_low(0x80);
-      gbc_trigger_sound(value);
-      break;
+static cpu_alert_type io_write_soundcnt_h(u32 address, u32 value)
+{
+  trigger_sound();
+  return CPU_ALERT_NONE;
+}
 
-    case 0x81:
-      access_register8_high(0x80);
-      gbc_trigger_sound(value);
-      break;
+static cpu_alert_type io_write_soundcnt_x(u32 address, u32 value)
+{
+  sound_control_x(value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound control H
-    case 0x82:
-      access_register8_low(0x82);
-      trigger_sound();
-      break;
+static cpu_alert_type io_write_wave_ram(u32 address, u32 value)
+{
+  gbc_sound_wave_update = 1;
+  address16(io_registers, address) = eswap16(value);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x83:
-      access_register8_high(0x82);
-      trigger_sound();
-      break;
+// Sound FIFO A (0xA0 - 0xA3) and B (0xA4 - 0xA7)
 
-    // Sound control X
-    case 0x84:
-      sound_control_x(value);
-      break;
+static cpu_alert_type io_write_fifo8(u32 address, u32 value)
+{
+  sound_timer_queue8((address >> 2) & 0x01, value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound wave RAM
-    case 0x90:
-    case 0x91:
-    case 0x92:
-    case 0x93:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0x97:
-    case 0x98:
-    case 0x99:
-    case 0x9A:
-    case 0x9B:
-    case 0x9C:
-    case 0x9D:
-    case 0x9E:
-    case 0x9F:
-      gbc_sound_wave_update = 1;
-      address8(io_registers, address) = value;
-      break;
+static cpu_alert_type io_write_fifo16(u32 address, u32 value)
+{
+  sound_timer_queue16((address >> 2) & 0x01, value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound FIFO A
-    case 0xA0:
-      sound_timer_queue8(0, value);
-      break;
+static cpu_alert_type io_write_fifo32(u32 address, u32 value)
+{
+  sound_timer_queue32((address >> 2) & 0x01, value);
+  return CPU_ALERT_NONE;
+}
 
-    // Sound FIFO B
-    case 0xA4:
-      sound_timer_queue8(1, value);
-      break;
+// DMA control (0xBA, 0xC6, 0xD2, 0xDE), 32bit writes start at the length
 
-    // DMA control (trigger byte)
-    case 0xBB:
-      access_register8_low(0xBA);
-      return trigger_dma(0, value);
+static cpu_alert_type io_write_dma_control(u32 address, u32 value)
+{
+  return trigger_dma((address - 0xBA) / 12, value);
+}
 
-    case 0xC7:
-      access_register8_low(0xC6);
-      return trigger_dma(1, value);
+static cpu_alert_type io_write_dma_control32(u32 address, u32 value)
+{
+  u32 dma_number = (address - 0xB8) / 12;
 
-    case 0xD3:
-      access_register8_low(0xD2);
-      return trigger_dma(2, value);
+  write_ioreg(REG_DMA0CNT_L + (dma_number * 6), value & 0xFFFF);
+  return trigger_dma(dma_number, value >> 16);
+}
 
-    case 0xDF:
-      access_register8_low(0xDE);
-      return trigger_dma(3, value);
+// Timer reload (0x100, 0x104, 0x108, 0x10C) and control (+2)
 
-    // Timer counts
-    case 0x100:
-      access_register8_low(0x100);
-      count_timer(0);
-      break;
+static cpu_alert_type io_write_timer_count(u32 address, u32 value)
+{
+  u32 timer_number = (address >> 2) & 0x03;
 
-    case 0x101:
-      access_register8_high(0x100);
-      count_timer(0);
-      break;
+  count_timer(timer_number);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x104:
-      access_register8_low(0x104);
-      count_timer(1);
-      break;
+static cpu_alert_type io_write_timer_control(u32 address, u32 value)
+{
+  trigger_timer((address >> 2) & 0x03, value);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x105:
-      access_register8_high(0x104);
-      count_timer(1);
-      break;
+static cpu_alert_type io_write_timer32(u32 address, u32 value)
+{
+  io_write_timer_count(address, value & 0xFFFF);
+  trigger_timer((address >> 2) & 0x03, value >> 16);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x108:
-      access_register8_low(0x108);
-      count_timer(2);
-      break;
+// Interrupt flags are cleared by writing 1s
 
-    case 0x109:
-      access_register8_high(0x108);
-      count_timer(2);
-      break;
+static cpu_alert_type io_write_if(u32 address, u32 value)
+{
+  write_ioreg(REG_IF, read_ioreg(REG_IF) & (~value));
+  return CPU_ALERT_NONE;
+}
 
-    case 0x10C:
-      access_register8_low(0x10C);
-      count_timer(3);
-      break;
+static cpu_alert_type io_write_if8(u32 address, u32 value)
+{
+  address8(io_registers, address) &= ~value;
+  return CPU_ALERT_NONE;
+}
 
-    case 0x10D:
-      access_register8_high(0x10C);
-      count_timer(3);
-      break;
+static cpu_alert_type halt_cpu(u32 value)
+{
+  if((value & 0x01) == 0)
+    reg[CPU_HALT_STATE] = CPU_HALT;
+  else
+    reg[CPU_HALT_STATE] = CPU_STOP;
 
-    // Timer control (trigger byte)
-    case 0x103:
-      access_register8_low(0x102);
-      trigger_timer(0, value);
-      break;
+  return CPU_ALERT_HALT;
+}
 
-    case 0x107:
-      access_register8_low(0x106);
-      trigger_timer(1, value);
-      break;
+static cpu_alert_type io_write_haltcnt(u32 address, u32 value)
+{
+  return halt_cpu(value >> 8);
+}
 
-    case 0x10B:
-      access_register8_low(0x10A);
-      trigger_timer(2, value);
-      break;
+static cpu_alert_type io_write_haltcnt8(u32 address, u32 value)
+{
+  // The low byte is POSTFLG, only the high byte halts
+  if(address & 0x01)
+    return halt_cpu(value);
 
-    case 0x10F:
-      access_register8_low(0x10E);
-      trigger_timer(3, value);
-      break;
+  address8(io_registers, address) = value;
+  return CPU_ALERT_NONE;
+}
 
-    // IF
-    case 0x202:
-      address8(io_registers, 0x202) &= ~value;
-      break;
+static cpu_alert_type io_write_store32(u32 address, u32 value)
+{
+  address32(io_registers, address) = eswap32(value);
+  return CPU_ALERT_NONE;
+}
 
-    case 0x203:
-      address8(io_registers, 0x203) &= ~value;
-      break;
+#define io_register_handler(address, handler16, handler8, write_mask)         \
+  io_register_handlers[(address) >> 1].write16 = handler16;                   \
+  io_register_handlers[(address) >> 1].write8 = handler8;                     \
+  io_register_handlers[(address) >> 1].mask = write_mask                      \
 
-    // Halt
-    case 0x301:
-      if((value & 0x01) == 0)
-        reg[CPU_HALT_STATE] = CPU_HALT;
-      else
-        reg[CPU_HALT_STATE] = CPU_STOP;
+#define io_register32_handler(address, handler32)                             \
+  io_register32_handlers[(address) >> 2] = handler32                          \
 
-      return CPU_ALERT_HALT;
-      break;
+static void init_io_register_handlers(void)
+{
+  u32 i;
 
-    default:
-      address8(io_registers, address) = value;
-      break;
+  for(i = 0; i < 0x400; i += 2)
+  {
+    io_register_handler(i, NULL, NULL, 0xFFFF);
   }
 
-  return CPU_ALERT_NONE;
-}
+  io_register_handler(0x00, io_write_dispcnt, NULL, 0xFFFF);
+  // DISPSTAT flags (low 3 bits) and VCOUNT are read only
+  io_register_handler(0x04, NULL, NULL, 0xFFF8);
+  io_register_handler(0x06, NULL, NULL, 0x0000);
 
-cpu_alert_type function_cc write_io_register16(u32 address, u32 value)
-{
-  value &= 0xffff;
-  switch(address)
+  for(i = 0x28; i < 0x40; i += 2)
   {
-    case 0x00:
+    if(i & 0x08)
     {
-      u32 dispcnt = read_ioreg(REG_DISPCNT);
-      if((value & 0x07) != (dispcnt & 0x07))
-        reg[OAM_UPDATED] = 1;
-
-      write_ioreg(REG_DISPCNT, value);
-      break;
+      io_register_handler(i, io_write_affine_reference, NULL, 0xFFFF);
     }
+  }
 
-    // DISPSTAT
-    case 0x04:
-      write_ioreg(REG_DISPSTAT, (read_ioreg(REG_DISPSTAT) & 0x07) | (value & ~0x07));
-      break;
-
-    // VCOUNT
-    case 0x06:
-      break;
-
-    // BG2 reference X
-    case 0x28:
-      access_register16_low(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    case 0x2A:
-      access_register16_high(0x28);
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
-
-    // BG2 reference Y
-    case 0x2C:
-      access_register16_low(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    case 0x2E:
-      access_register16_high(0x2C);
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    // BG3 reference X
-
-    case 0x38:
-      access_register16_low(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
-
-    case 0x3A:
-      access_register16_high(0x38);
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
-
-    // BG3 reference Y
-    case 0x3C:
-      access_register16_low(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
-
-    case 0x3E:
-      access_register16_high(0x3C);
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
-
-    // Sound 1 control sweep
-    case 0x60:
-      gbc_sound_tone_control_sweep();
-      break;
-
-    // Sound 1 control duty/length/envelope
-    case 0x62:
-      gbc_sound_tone_control_low(0, 0x62);
-      break;
-
-    // Sound 1 control frequency
-    case 0x64:
-      gbc_sound_tone_control_high(0, 0x64);
-      break;
-
-    // Sound 2 control duty/length/envelope
-    case 0x68:
-      gbc_sound_tone_control_low(1, 0x68);
-      break;
-
-    // Sound 2 control frequency
-    case 0x6C:
-      gbc_sound_tone_control_high(1, 0x6C);
-      break;
-
-    // Sound 3 control wave
-    case 0x70:
-      gbc_sound_wave_control();
-      break;
-
-    // Sound 3 control length/volume
-    case 0x72:
-      gbc_sound_tone_control_low_wave();
-      break;
-
-    // Sound 3 control frequency
-    case 0x74:
-      gbc_sound_tone_control_high_wave();
-      break;
-
-    // Sound 4 control length/envelope
-    case 0x78:
-      gbc_sound_tone_control_low(3, 0x78);
-      break;
-
-    // Sound 4 control frequency
-    case 0x7C:
-      gbc_sound_noise_control();
-      break;
-
-    // Sound control L
-    case 0x80:
-      gbc_trigger_sound(value);
-      break;
-
-    // Sound control H
-    case 0x82:
-      trigger_sound();
-      break;
-
-    // Sound control X
-    case 0x84:
-      sound_control_x(value);
-      break;
-
-    // Sound wave RAM
-    case 0x90:
-    case 0x91:
-    case 0x92:
-    case 0x93:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0x97:
-    case 0x98:
-    case 0x99:
-    case 0x9A:
-    case 0x9B:
-    case 0x9C:
-    case 0x9D:
-    case 0x9E:
-      gbc_sound_wave_update = 1;
-      address16(io_registers, address) = eswap16(value);
-      break;
-
-    // Sound FIFO A
-    case 0xA0:
-      sound_timer_queue16(0, value);
-      break;
-
-    // Sound FIFO B
-    case 0xA4:
-      sound_timer_queue16(1, value);
-      break;
-
-    // DMA control
-    case 0xBA:
-      return trigger_dma(0, value);
-
-    case 0xC6:
-      return trigger_dma(1, value);
-
-    case 0xD2:
-      return trigger_dma(2, value);
-
-    case 0xDE:
-      return trigger_dma(3, value);
-
-    // Timer counts
-    case 0x100:
-      count_timer(0);
-      break;
-
-    case 0x104:
-      count_timer(1);
-      break;
-
-    case 0x108:
-      count_timer(2);
-      break;
+  io_register_handler(0x60, io_write_sound1_sweep, NULL, 0xFFFF);
+  io_register_handler(0x62, io_write_sound1_control_low, NULL, 0xFFFF);
+  io_register_handler(0x64, io_write_sound1_control_high, NULL, 0xFFFF);
+  io_register_handler(0x68, io_write_sound2_control_low, NULL, 0xFFFF);
+  io_register_handler(0x6C, io_write_sound2_control_high, NULL, 0xFFFF);
+  io_register_handler(0x70, io_write_sound3_wave, NULL, 0xFFFF);
+  io_register_handler(0x72, io_write_sound3_control_low, NULL, 0xFFFF);
+  io_register_handler(0x74, io_write_sound3_control_high, NULL, 0xFFFF);
+  io_register_handler(0x78, io_write_sound4_control_low, NULL, 0xFFFF);
+  io_register_handler(0x7C, io_write_sound4_control_high, NULL, 0xFFFF);
+  io_register_handler(0x80, io_write_soundcnt_l, NULL, 0xFFFF);
+  io_register_handler(0x82, io_write_soundcnt_h, NULL, 0xFFFF);
+  io_register_handler(0x84, io_write_soundcnt_x, NULL, 0xFFFF);
+
+  for(i = 0x90; i < 0xA0; i += 2)
+  {
+    io_register_handler(i, io_write_wave_ram, NULL, 0xFFFF);
+  }
 
-    case 0x10C:
-      count_timer(3);
-      break;
+  for(i = 0xA0; i < 0xA8; i += 2)
+  {
+    io_register_handler(i, io_write_fifo16, io_write_fifo8, 0xFFFF);
+  }
 
-    /* Timer control 0 */
-    case 0x102:
-      trigger_timer(0, value);
-      break;
+  for(i = 0; i < 4; i++)
+  {
+    io_register_handler(0xBA + (i * 12), io_write_dma_control, NULL, 0xFFFF);
+    io_register_handler(0x100 + (i * 4), io_write_timer_count, NULL, 0xFFFF);
+    io_register_handler(0x102 + (i * 4), io_write_timer_control, NULL,
+     0xFFFF);
+  }
 
-    /* Timer control 1 */
-    case 0x106:
-      trigger_timer(1, value);
-      break;
+  // P1 (key input) and WAITCNT are not writable
+  io_register_handler(0x130, NULL, NULL, 0x0000);
+  io_register_handler(0x202, io_write_if, io_write_if8, 0xFFFF);
+  io_register_handler(0x204, NULL, NULL, 0x0000);
+  io_register_handler(0x300, io_write_haltcnt, io_write_haltcnt8, 0xFFFF);
 
-    /* Timer control 2 */
-    case 0x10A:
-      trigger_timer(2, value);
-      break;
+  // Pairs of plain fully writable registers can be stored in one go, the
+  // rest fall back to two 16bit writes unless they have a handler below.
+  for(i = 0; i < 0x400; i += 4)
+  {
+    io_register_handler_type *io_low = io_register_handlers + (i >> 1);
+    io_register_handler_type *io_high = io_low + 1;
 
-    /* Timer control 3 */
-    case 0x10E:
-      trigger_timer(3, value);
-      break;
+    if(!io_low->write16 && !io_high->write16 &&
+     (io_low->mask == 0xFFFF) && (io_high->mask == 0xFFFF))
+    {
+      io_register32_handler(i, io_write_store32);
+    }
+    else
+    {
+      io_register32_handler(i, NULL);
+    }
+  }
 
-    // P1
-    case 0x130:
-      break;
+  io_register32_handler(0x28, io_write_affine_reference32);
+  io_register32_handler(0x2C, io_write_affine_reference32);
+  io_register32_handler(0x38, io_write_affine_reference32);
+  io_register32_handler(0x3C, io_write_affine_reference32);
+  io_register32_handler(0xA0, io_write_fifo32);
+  io_register32_handler(0xA4, io_write_fifo32);
 
-    // Interrupt flag
-    case 0x202:
-      write_ioreg(REG_IF, read_ioreg(REG_IF) & (~value));
-      break;
+  for(i = 0; i < 4; i++)
+  {
+    io_register32_handler(0xB8 + (i * 12), io_write_dma_control32);
+    io_register32_handler(0x100 + (i * 4), io_write_timer32);
+  }
+}
 
-    // WAITCNT
-    case 0x204:
-      break;
+cpu_alert_type function_cc write_io_register16(u32 address, u32 value)
+{
+  const io_register_handler_type *io = io_register_handlers + (address >> 1);
+  u32 mask = io->mask;
 
-    // Halt
-    case 0x300:
-      if(((value >> 8) & 0x01) == 0)
-        reg[CPU_HALT_STATE] = CPU_HALT;
-      else
-        reg[CPU_HALT_STATE] = CPU_STOP;
+  value &= 0xffff;
 
-      return CPU_ALERT_HALT;
+  if(io->write16)
+    return io->write16(address, value);
 
-    default:
-      address16(io_registers, address) = eswap16(value);
-      break;
-  }
+  address16(io_registers, address) =
+   eswap16((readaddress16(io_registers, address) & ~mask) | (value & mask));
 
   return CPU_ALERT_NONE;
 }
 
-
-cpu_alert_type function_cc write_io_register32(u32 address, u32 value)
+cpu_alert_type function_cc write_io_register8(u32 address, u32 value)
 {
-  switch(address)
-  {
-    // BG2 reference X
-    case 0x28:
-      affine_reference_x[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x28) = eswap32(value);
-      break;
+  const io_register_handler_type *io = io_register_handlers + (address >> 1);
 
-    // BG2 reference Y
-    case 0x2C:
-      affine_reference_y[0] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x2C) = eswap32(value);
-      break;
-
-    // BG3 reference X
-    case 0x38:
-      affine_reference_x[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x38) = eswap32(value);
-      break;
+  value &= 0xff;
 
-    // BG3 reference Y
-    case 0x3C:
-      affine_reference_y[1] = (s32)(value << 4) >> 4;
-      address32(io_registers, 0x3C) = eswap32(value);
-      break;
+  if(io->write8)
+    return io->write8(address, value);
 
-    // Sound FIFO A
-    case 0xA0:
-      sound_timer_queue32(0, value);
-      break;
+  // Merge with the other byte of the halfword
+  if(address & 0x01)
+    value = (value << 8) | address8(io_registers, address - 1);
+  else
+    value = (address8(io_registers, address + 1) << 8) | value;
 
-    // Sound FIFO B
-    case 0xA4:
-      sound_timer_queue32(1, value);
-      break;
+  return write_io_register16(address & ~0x01, value);
+}
 
-    default:
-    {
-      cpu_alert_type alert_low =
-        write_io_register16(address, value & 0xFFFF);
+cpu_alert_type function_cc write_io_register32(u32 address, u32 value)
+{
+  io_write_handler_type handler32 = io_register32_handlers[address >> 2];
+  cpu_alert_type alert_low, alert_high;
 
-      cpu_alert_type alert_high =
-        write_io_register16(address + 2, value >> 16);
+  if(handler32)
+    return handler32(address, value);
 
-      if(alert_high)
-        return alert_high;
+  alert_low = write_io_register16(address, value & 0xFFFF);
+  alert_high = write_io_register16(address + 2, value >> 16);
 
-      return alert_low;
-    }
-  }
+  if(alert_high)
+    return alert_high;
 
-  return CPU_ALERT_NONE;
+  return alert_low;
 }
 
 #define write_palette8(address, value)                                        \
@@ -1472,6 +1184,7 @@ cpu_alert_type function_cc write_io_register32(u32 address, u32 value)
   address16(palette_ram, palette_address) = eswap16(value);                   \
   convert_palette(value);                                                     \
   address16(palette_ram_converted, palette_address) = value;                  \
+  mark_palette_dirty(palette_address);                                        \
 }                                                                             \
 
 #define write_palette32(address, value)                                       \
@@ -1484,6 +1197,7 @@ cpu_alert_type function_cc write_io_register32(u32 address, u32 value)
   address16(palette_ram_converted, palette_address + 2) = value_high;         \
   convert_palette(value_low);                                                 \
   address16(palette_ram_converted, palette_address) = value_low;              \
+  mark_palette_dirty(palette_address);                                        \
 }                                                                             \
 
 
@@ -1548,9 +1262,15 @@ void function_cc write_backup(u32 address, u32 value)
           if(flash_mode == FLASH_ERASE_MODE)
           {
             if(flash_size == FLASH_SIZE_64KB)
+            {
               memset(gamepak_backup, 0xFF, 1024 * 64);
+              mark_backup_dirty_range(0, 1024 * 64);
+            }
             else
+            {
               memset(gamepak_backup, 0xFF, 1024 * 128);
+              mark_backup_dirty_range(0, 1024 * 128);
+            }
             flash_mode = FLASH_BASE_MODE;
           }
           break;
@@ -1561,7 +1281,10 @@ void function_cc write_backup(u32 address, u32 value)
       flash_command_position = 0;
     }
     if(backup_type == BACKUP_SRAM)
+    {
       gamepak_backup[0x5555] = value;
+      mark_backup_dirty(0x5555);
+    }
   }
   else
 
@@ -1575,6 +1298,8 @@ void function_cc write_backup(u32 address, u32 value)
     {
       // Erase sector
       memset(flash_bank_ptr + (address & 0xF000), 0xFF, 1024 * 4);
+      mark_backup_dirty_range((flash_bank_ptr - gamepak_backup) +
+       (address & 0xF000), 1024 * 4);
       flash_mode = FLASH_BASE_MODE;
       flash_command_position = 0;
     }
@@ -1593,6 +1318,7 @@ void function_cc write_backup(u32 address, u32 value)
     {
       // Write value to flash ROM
       flash_bank_ptr[address] = value;
+      mark_backup_dirty((flash_bank_ptr - gamepak_backup) + address);
       flash_mode = FLASH_BASE_MODE;
     }
     else
@@ -1604,6 +1330,7 @@ void function_cc write_backup(u32 address, u32 value)
       if(address >= 0x8000)
         sram_size = SRAM_SIZE_64KB;
       gamepak_backup[address] = value;
+      mark_backup_dirty(address);
     }
   }
 }
@@ -1617,13 +1344,16 @@ void function_cc write_backup(u32 address, u32 value)
 
 #define write_vram8()                                                         \
   address &= ~0x01;                                                           \
-  address16(vram, address) = eswap16((value << 8) | value)                    \
+  address16(vram, address) = eswap16((value << 8) | value);                   \
+  mark_vram_dirty(address)                                                    \
 
 #define write_vram16()                                                        \
-  address16(vram, address) = eswap16(value)                                   \
+  address16(vram, address) = eswap16(value);                                  \
+  mark_vram_dirty(address)                                                    \
 
 #define write_vram32()                                                        \
-  address32(vram, address) = eswap32(value)                                   \
+  address32(vram, address) = eswap32(value);                                  \
+  mark_vram_dirty(address)                                                    \
 
 // RTC code derived from VBA's (due to lack of any real publically available
 // documentation...)
@@ -1928,6 +1658,7 @@ void function_cc write_rtc(u32 address, u32 value)
       /* OAM RAM */                                                           \
       reg[OAM_UPDATED] = 1;                                                   \
       address##type(oam_ram, address & 0x3FF) = eswap##type(value);           \
+      mark_oam_dirty(address & 0x3FF);                                        \
       break;                                                                  \
                                                                               \
     case 0x08:                                                                \
@@ -2024,16 +1755,51 @@ cpu_alert_type function_cc write_memory32(u32 address, u32 value)
 
 char backup_filename[512];
 
+static u32 backup_size(void)
+{
+  switch(backup_type)
+  {
+    case BACKUP_SRAM:
+      if(sram_size == SRAM_SIZE_32KB)
+        return 0x8000;
+      return 0x10000;
+
+    case BACKUP_FLASH:
+      if(flash_size == FLASH_SIZE_64KB)
+        return 0x10000;
+      return 0x20000;
+
+    case BACKUP_EEPROM:
+      if(eeprom_size == EEPROM_512_BYTE)
+        return 0x200;
+      return 0x2000;
+
+    default:
+      return 0;
+  }
+}
+
+static void clear_backup_dirty(void)
+{
+  memset(backup_dirty, 0, sizeof(backup_dirty));
+  backup_dirty_pending = 0;
+  backup_dirty_frames = 0;
+  backup_idle_frames = 0;
+}
+
 u32 load_backup(char *name)
 {
   FILE *fd = fopen(name, "rb");
 
+  clear_backup_dirty();
+
   if(fd)
   {
     u32 backup_size = file_length(fd);
 
     fread(gamepak_backup, 1, backup_size, fd);
     fclose(fd);
+    backup_file_size = backup_size;
 
     // The size might give away what kind of backup it is.
     switch(backup_size)
@@ -2069,62 +1835,267 @@ u32 load_backup(char *name)
   else
   {
     backup_type = BACKUP_NONE;
+    backup_file_size = 0;
     memset(gamepak_backup, 0xFF, 1024 * 128);
   }
 
   return 0;
 }
 
-u32 save_backup(char *name)
+// Makes sure what was written to fd reached the storage, not just the
+// OS cache. Where there's no way to ask for that it's left to fclose().
+
+static u32 sync_backup_file(FILE *fd)
+{
+  if(fflush(fd) != 0)
+    return 0;
+
+#if defined(_WIN32)
+  return _commit(_fileno(fd)) == 0;
+#elif defined(__unix__) || defined(__APPLE__)
+  return fsync(fileno(fd)) == 0;
+#else
+  return 1;
+#endif
+}
+
+// Syncs the directory holding name, so a rename into it is on disk too.
+// Best effort, not every filesystem lets directories be synced.
+
+static void sync_backup_dir(const char *name)
+{
+#if defined(__unix__) || defined(__APPLE__)
+  char dir_name[512];
+  char *separator;
+  int dir_fd;
+
+  snprintf(dir_name, sizeof(dir_name), "%s", name);
+  separator = strrchr(dir_name, '/');
+
+  if(!separator)
+    strcpy(dir_name, ".");
+  else if(separator == dir_name)
+    dir_name[1] = 0;
+  else
+    *separator = 0;
+
+  dir_fd = open(dir_name, O_RDONLY);
+
+  if(dir_fd >= 0)
+  {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+#endif
+}
+
+// Writes the whole image to a temporary file and renames it over the old
+// save, so an interrupted write never leaves a truncated .sav behind. The
+// data is synced before the rename, otherwise a crash could leave the
+// renamed file empty on storage that reorders its writes.
+
+static u32 write_backup_file(const char *name, const u8 *data, u32 size)
 {
-  if(backup_type != BACKUP_NONE)
+  char temp_name[512 + 8];
+  FILE *fd;
+  u32 written;
+
+  snprintf(temp_name, sizeof(temp_name), "%s.tmp", name);
+  fd = fopen(temp_name, "wb");
+
+  if(!fd)
+    return 0;
+
+  written = fwrite(data, 1, size, fd);
+
+  if(!sync_backup_file(fd))
+    written = 0;
+
+  if((fclose(fd) != 0) || (written != size))
   {
-    FILE *fd = fopen(name, "wb");
+    remove(temp_name);
+    return 0;
+  }
 
-    if(fd)
-    {
-      u32 backup_size = 0;
+#ifdef _WIN32
+  // rename() does not replace existing files here.
+  remove(name);
+#endif
 
-      switch(backup_type)
-      {
-        case BACKUP_SRAM:
-          if(sram_size == SRAM_SIZE_32KB)
-            backup_size = 0x8000;
-          else
-            backup_size = 0x10000;
-          break;
+  if(rename(temp_name, name) != 0)
+  {
+    remove(temp_name);
+    return 0;
+  }
 
-        case BACKUP_FLASH:
-          if(flash_size == FLASH_SIZE_64KB)
-            backup_size = 0x10000;
-          else
-            backup_size = 0x20000;
-          break;
+  sync_backup_dir(name);
+  return 1;
+}
 
-        case BACKUP_EEPROM:
-          if(eeprom_size == EEPROM_512_BYTE)
-            backup_size = 0x200;
-          else
-            backup_size = 0x2000;
-          break;
+// Patches the dirty ranges into the existing save in place. Fails if the
+// file is missing or has a different size, the caller rewrites it then.
 
-        default:
-          break;
-      }
+static u32 write_backup_ranges(const char *name,
+ const backup_flush_type *flush)
+{
+  FILE *fd = fopen(name, "r+b");
+  u32 result = 1;
+  u32 i;
 
-      fwrite(gamepak_backup, 1, backup_size, fd);
-      fclose(fd);
-      return 1;
+  if(!fd)
+    return 0;
+
+  if(file_length(fd) != flush->size)
+  {
+    fclose(fd);
+    return 0;
+  }
+
+  for(i = 0; i < flush->range_count; i++)
+  {
+    const backup_range_type *range = flush->ranges + i;
+
+    if(fseek(fd, range->offset, SEEK_SET) ||
+     (fwrite(flush->data + range->offset, 1, range->length, fd) !=
+     range->length))
+    {
+      result = 0;
+      break;
     }
   }
 
+  if(result && !sync_backup_file(fd))
+    result = 0;
+
+  if(fclose(fd) != 0)
+    result = 0;
+
+  return result;
+}
+
+u32 save_backup(char *name)
+{
+  u32 size = backup_size();
+
+  if(size && write_backup_file(name, gamepak_backup, size))
+  {
+    clear_backup_dirty();
+    backup_file_size = size;
+    return 1;
+  }
+
   return 0;
 }
 
+// Meant to be called once per frame, returns non zero once the dirty
+// backup should be flushed. Writes are given time to settle so a game
+// saving over many frames results in one flush, but a game that keeps
+// writing is still flushed every BACKUP_FLUSH_MAX_FRAMES.
+
+u32 backup_flush_due(void)
+{
+  if(!backup_dirty_pending)
+    return 0;
+
+  backup_dirty_frames++;
+  backup_idle_frames++;
+
+  return (backup_idle_frames >= BACKUP_FLUSH_IDLE_FRAMES) ||
+   (backup_dirty_frames >= BACKUP_FLUSH_MAX_FRAMES);
+}
+
+// Snapshots the backup and its dirty ranges into flush and clears the
+// dirty state. This only copies memory so it is cheap enough for the
+// emulation thread, the file access is done by write_backup_flush(),
+// which does not touch any emulator state and may run on another thread.
+// Its result has to be handed to finish_backup_flush() before the next
+// flush is prepared. Returns 0 if there is nothing to write.
+
+u32 prepare_backup_flush(backup_flush_type *flush)
+{
+  u32 size = backup_size();
+  u32 pages = size >> BACKUP_DIRTY_SHIFT;
+  backup_range_type *range = NULL;
+  u32 page;
+
+  if(!backup_dirty_pending || !size)
+    return 0;
+
+  flush->size = size;
+  flush->range_count = 0;
+  flush->full_rewrite = (size != backup_file_size);
+  memcpy(flush->data, gamepak_backup, size);
+
+  // EEPROM images can be smaller than a page.
+  if(pages == 0)
+    pages = 1;
+
+  for(page = 0; (page < pages) && !flush->full_rewrite; page++)
+  {
+    u32 offset = page << BACKUP_DIRTY_SHIFT;
+    u32 end = offset + (1 << BACKUP_DIRTY_SHIFT);
+
+    if(!backup_dirty[page])
+      continue;
+
+    if(end > size)
+      end = size;
+
+    // Close enough to the previous range to be written in one go.
+    if(range && (offset <= (range->offset + range->length +
+     (BACKUP_FLUSH_MERGE_GAP << BACKUP_DIRTY_SHIFT))))
+    {
+      range->length = end - range->offset;
+    }
+    else if(flush->range_count == BACKUP_FLUSH_MAX_RANGES)
+    {
+      flush->full_rewrite = 1;
+    }
+    else
+    {
+      range = flush->ranges + flush->range_count;
+      range->offset = offset;
+      range->length = end - offset;
+      flush->range_count++;
+    }
+  }
+
+  clear_backup_dirty();
+  return 1;
+}
+
+u32 write_backup_flush(const char *name, const backup_flush_type *flush)
+{
+  if(!flush->full_rewrite && write_backup_ranges(name, flush))
+    return 1;
+
+  return write_backup_file(name, flush->data, flush->size);
+}
+
+// Takes the result of write_backup_flush(), on the emulation thread. The
+// file size is only recorded once the image is known to be on disk. If
+// the write failed, the file is in an unknown state and the dirty state
+// the snapshot took over is gone, so the next flush rewrites it in full.
+
+void finish_backup_flush(const backup_flush_type *flush, u32 written)
+{
+  if(written)
+  {
+    backup_file_size = flush->size;
+  }
+  else
+  {
+    backup_file_size = 0;
+    backup_dirty_pending = 1;
+  }
+}
+
 void update_backup(void)
 {
-  if (!use_libretro_save_method)
-    save_backup(backup_filename);
+  static backup_flush_type flush;
+
+  if (!use_libretro_save_method && prepare_backup_flush(&flush))
+    finish_backup_flush(&flush, write_backup_flush(backup_filename, &flush));
 }
 
 #define CONFIG_FILENAME "game_config.txt"
@@ -2586,15 +2557,23 @@ dma_region_type dma_region_map[16] =
   smc_trigger |= address##transfer_size(iwram, type##_ptr & 0x7FFF)           \
 
 #define dma_write_vram(type, transfer_size)                                   \
-  address##transfer_size(vram, type##_ptr & 0x1FFFF) =                        \
-                                 eswap##transfer_size(read_value)             \
+{                                                                             \
+  u32 vram_offset = type##_ptr & 0x1FFFF;                                     \
+  if(vram_offset >= 0x18000)                                                  \
+    vram_offset -= 0x8000;                                                    \
+                                                                              \
+  address##transfer_size(vram, vram_offset) =                                 \
+                                 eswap##transfer_size(read_value);            \
+  mark_vram_dirty(vram_offset);                                               \
+}                                                                             \
 
 #define dma_write_io(type, transfer_size)                                     \
   write_io_register##transfer_size(type##_ptr & 0x3FF, read_value)            \
 
 #define dma_write_oam_ram(type, transfer_size)                                \
   address##transfer_size(oam_ram, type##_ptr & 0x3FF) =                       \
-                                  eswap##transfer_size(read_value)            \
+                                  eswap##transfer_size(read_value);           \
+  mark_oam_dirty(type##_ptr & 0x3FF)                                          \
 
 #define dma_write_palette_ram(type, transfer_size)                            \
   write_palette##transfer_size(type##_ptr & 0x3FF, read_value)                \
@@ -3211,12 +3190,15 @@ void init_memory(void)
   init_memory_gamepak();
   map_null(read, 0xE000000, 0x10000000);
 
+  init_io_register_handlers();
+
   memset(io_registers, 0, sizeof(io_registers));
   memset(oam_ram, 0, sizeof(oam_ram));
   memset(palette_ram, 0, sizeof(palette_ram));
   memset(iwram, 0, sizeof(iwram));
   memset(ewram, 0, sizeof(ewram));
   memset(vram, 0, sizeof(vram));
+  mark_all_dirty();
 
   write_ioreg(REG_DISPCNT, 0x80);
   write_ioreg(REG_P1, 0x3FF);
@@ -3245,6 +3227,44 @@ void init_memory(void)
   bios_read_protect = 0xe129f000;
 }
 
+// Returns non zero if any VRAM page overlapping [start, end) is dirty for
+// the given client.
+
+u32 vram_range_dirty(u32 client, u32 start, u32 end)
+{
+  u32 page = start >> VRAM_DIRTY_SHIFT;
+  u32 last_page = (end - 1) >> VRAM_DIRTY_SHIFT;
+
+  for(; page <= last_page; page++)
+  {
+    if(vram_dirty[page] & client)
+      return 1;
+  }
+
+  return 0;
+}
+
+void clear_dirty_pages(u32 client)
+{
+  u32 i;
+
+  for(i = 0; i < VRAM_DIRTY_PAGES; i++)
+    vram_dirty[i] &= ~client;
+
+  for(i = 0; i < PALETTE_DIRTY_ROWS; i++)
+    palette_dirty[i] &= ~client;
+
+  for(i = 0; i < OAM_DIRTY_ENTRIES; i++)
+    oam_dirty[i] &= ~client;
+}
+
+void mark_all_dirty(void)
+{
+  memset(vram_dirty, DIRTY_CLIENT_ALL, sizeof(vram_dirty));
+  memset(palette_dirty, DIRTY_CLIENT_ALL, sizeof(palette_dirty));
+  memset(oam_dirty, DIRTY_CLIENT_ALL, sizeof(oam_dirty));
+}
+
 void memory_term(void)
 {
   if (gamepak_file_large)
@@ -3298,12 +3318,14 @@ void gba_load_state(const void* src)
    savestate_block(read);
 
 #ifdef HAVE_DYNAREC
+   // Only RAM contents come from the state, ROM/BIOS code is still valid.
    if (dynarec_enable)
-      init_caches();
+      flush_translation_cache_ram_all();
 #endif
 
    reg[OAM_UPDATED] = 1;
    gbc_sound_update = 1;
+   mark_all_dirty();
 
    for(i = 0; i < 512; i++)
    {
@@ -169,6 +169,32 @@ typedef enum
   FLASH_MANUFACTURER_SST       = 0xBF
 } flash_manufacturer_id_type;
 
+// The backup is flushed to disk by page, only rewriting the pages touched
+// by write_backup()/write_eeprom() since the last flush. Nearby dirty pages
+// are merged into one write.
+
+#define BACKUP_DIRTY_SHIFT          8
+#define BACKUP_DIRTY_PAGES          ((1024 * 128) >> BACKUP_DIRTY_SHIFT)
+#define BACKUP_FLUSH_MERGE_GAP      4
+#define BACKUP_FLUSH_MAX_RANGES     32
+#define BACKUP_FLUSH_IDLE_FRAMES    30
+#define BACKUP_FLUSH_MAX_FRAMES     600
+
+typedef struct
+{
+  u32 offset;
+  u32 length;
+} backup_range_type;
+
+typedef struct
+{
+  u32 size;
+  u32 full_rewrite;
+  u32 range_count;
+  backup_range_type ranges[BACKUP_FLUSH_MAX_RANGES];
+  u8 data[1024 * 128];
+} backup_flush_type;
+
 u8 function_cc read_memory8(u32 address);
 u32 read_memory8s(u32 address);
 u32 function_cc read_memory16(u32 address);
@@ -192,6 +218,7 @@ extern char gamepak_title[13];
 extern char gamepak_code[5];
 extern char gamepak_maker[3];
 extern char gamepak_filename[512];
+extern char backup_filename[512];
 
 cpu_alert_type dma_transfer(dma_transfer_type *dma);
 u8 *memory_region(u32 address, u32 *memory_limit);
@@ -199,6 +226,10 @@ u32 load_gamepak(const char *name);
 u32 load_backup(char *name);
 s32 load_bios(char *name);
 void update_backup(void);
+u32 backup_flush_due(void);
+u32 prepare_backup_flush(backup_flush_type *flush);
+u32 write_backup_flush(const char *name, const backup_flush_type *flush);
+void finish_backup_flush(const backup_flush_type *flush, u32 written);
 void init_memory(void);
 void init_gamepak_buffer(void);
 void memory_term(void);
@@ -227,6 +258,51 @@ extern u8 iwram[1024 * 32 * 2];
 
 extern u8 *memory_map_read[8 * 1024];
 
+// Dirty tracking for VRAM, palette RAM and OAM. Every store to these
+// memories (CPU, DMA or dynarec stubs) sets the byte covering the written
+// unit to 0xFF. Each consumer owns one bit of that byte, so it can skip the
+// regions that did not change since it last looked and clear only its own
+// bit without disturbing the others. A byte per unit (instead of a packed
+// bitmap) lets the store stubs flag a write with a single store.
+
+#define VRAM_DIRTY_SHIFT        9     // 512 byte VRAM pages
+#define PALETTE_DIRTY_SHIFT     5     // 16 color palette rows
+#define OAM_DIRTY_SHIFT         3     // single OAM entries
+
+#define VRAM_DIRTY_PAGES        (0x18000 >> VRAM_DIRTY_SHIFT)
+#define PALETTE_DIRTY_ROWS      (0x400 >> PALETTE_DIRTY_SHIFT)
+#define OAM_DIRTY_ENTRIES       (0x400 >> OAM_DIRTY_SHIFT)
+
+typedef enum
+{
+  DIRTY_CLIENT_RENDER        = 0x01,
+  DIRTY_CLIENT_SAVESTATE     = 0x02,
+  DIRTY_CLIENT_TILE_CACHE    = 0x04,
+  DIRTY_CLIENT_OBJ_LIST      = 0x08,
+  DIRTY_CLIENT_LINE_REUSE    = 0x10,
+  DIRTY_CLIENT_COLOR_CORRECT = 0x20,
+  DIRTY_CLIENT_DEBUG         = 0x80,
+  DIRTY_CLIENT_ALL           = 0xFF
+} dirty_client_type;
+
+extern u8 vram_dirty[VRAM_DIRTY_PAGES];
+extern u8 palette_dirty[PALETTE_DIRTY_ROWS];
+extern u8 oam_dirty[OAM_DIRTY_ENTRIES];
+
+// Offsets are relative to the start of each memory (VRAM already mirrored)
+#define mark_vram_dirty(offset)                                               \
+  vram_dirty[(offset) >> VRAM_DIRTY_SHIFT] = DIRTY_CLIENT_ALL                 \
+
+#define mark_palette_dirty(offset)                                            \
+  palette_dirty[(offset) >> PALETTE_DIRTY_SHIFT] = DIRTY_CLIENT_ALL           \
+
+#define mark_oam_dirty(offset)                                                \
+  oam_dirty[(offset) >> OAM_DIRTY_SHIFT] = DIRTY_CLIENT_ALL                   \
+
+u32 vram_range_dirty(u32 client, u32 start, u32 end);
+void clear_dirty_pages(u32 client);
+void mark_all_dirty(void);
+
 extern u32 reg[64];
 
 extern flash_device_id_type flash_device_id;
@@ -27,6 +27,7 @@ bool libretro_supports_bitmasks    = false;
 bool libretro_supports_ff_override = false;
 bool libretro_ff_enabled           = false;
 bool libretro_ff_enabled_prev      = false;
+bool libretro_rewind_pressed       = false;
 
 unsigned turbo_period      = TURBO_PERIOD_MIN;
 unsigned turbo_pulse_width = TURBO_PULSE_WIDTH_MIN;
@@ -82,6 +83,9 @@ u32 update_input(void)
       libretro_ff_enabled = libretro_supports_ff_override &&
             (ret & (1 << RETRO_DEVICE_ID_JOYPAD_R2));
 
+      libretro_rewind_pressed = rewind_enabled() &&
+            (ret & (1 << RETRO_DEVICE_ID_JOYPAD_L2));
+
       turbo_a = (ret & (1 << RETRO_DEVICE_ID_JOYPAD_X));
       turbo_b = (ret & (1 << RETRO_DEVICE_ID_JOYPAD_Y));
    }
@@ -93,6 +97,9 @@ u32 update_input(void)
        libretro_ff_enabled = libretro_supports_ff_override &&
             input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R2);
 
+      libretro_rewind_pressed = rewind_enabled() &&
+            input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L2);
+
       turbo_a = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_X);
       turbo_b = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_Y);
    }
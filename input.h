@@ -60,6 +60,7 @@ extern bool libretro_supports_bitmasks;
 extern bool libretro_supports_ff_override;
 extern bool libretro_ff_enabled;
 extern bool libretro_ff_enabled_prev;
+extern bool libretro_rewind_pressed;
 
 /* Minimum (and default) turbo pulse train
  * is 2 frames ON, 2 frames OFF */
@@ -9,7 +9,12 @@
 #include "memmap.h"
 
 #include "gba_memory.h"
-#include "gba_cc_lut.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #if defined(VITA) && defined(HAVE_DYNAREC)
 #include <psp2/kernel/sysmem.h>
@@ -87,6 +92,16 @@ u32 translation_gate_targets = 0;
 static u16 *gba_screen_pixels_prev = NULL;
 static u16 *gba_processed_pixels   = NULL;
 
+/* Screen buffers are sized for the largest output
+ * format, which is only picked in retro_load_game() */
+#ifdef FRONTEND_SUPPORTS_XRGB8888
+#define SCREEN_BUFFER_PIXEL_SIZE sizeof(u32)
+#else
+#define SCREEN_BUFFER_PIXEL_SIZE sizeof(u16)
+#endif
+
+static unsigned video_pixel_size = sizeof(u16);
+
 static void (*video_post_process)(void) = NULL;
 static bool post_process_cc  = false;
 static bool post_process_mix = false;
@@ -200,110 +215,163 @@ static void init_frameskip(void)
 
 /* Video post processing START */
 
+/* Frame mixing averages each pixel of the current
+ * frame with the previous one, per channel:
+ * > "Mixing Packed RGB Pixels Efficiently"
+ *   http://blargg.8bitalley.com/info/rgb_mixing.html
+ *
+ * (curr + prev + ((curr ^ prev) & low_bits)) >> 1
+ * is computed as
+ * (curr & prev) + (((curr ^ prev) & ~low_bits) >> 1)
+ *    + ((curr ^ prev) & low_bits)
+ * which never goes over the pixel width, so whole
+ * vectors of 16bit (RGB565) or 32bit (XRGB8888)
+ * lanes can be mixed at once. The frame is one
+ * contiguous block, since the pitch is the width.
+ *
+ * Instead of copying every frame into the history
+ * buffer, the two screen buffers are swapped once
+ * the frame is mixed and the next frame is drawn
+ * over the older one. This is fine since every line
+ * of a frame that isn't skipped gets drawn (line
+ * reuse keeps copies of its own). */
+
+#define GBA_SCREEN_PIXELS (GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT)
+
 /* Note: This code is intentionally W.E.T.
  * (Write Everything Twice). These functions
  * are performance critical, and we cannot
  * afford to do unnecessary comparisons/switches
  * inside the inner for loops */
 
-static void video_post_process_cc(void)
+static void video_post_process_swap(void)
 {
-   uint16_t *src = gba_screen_pixels;
-   uint16_t *dst = gba_processed_pixels;
-   size_t x, y;
-
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
-   {
-      for (x = 0; x < GBA_SCREEN_PITCH; x++)
-      {
-         u16 src_color = *(src + x);
-
-         /* Convert colour to RGB555 and perform lookup */
-         *(dst + x) = *(gba_cc_lut + (((src_color & 0xFFC0) >> 1) | (src_color & 0x1F)));
-      }
+   u16 *pixels            = gba_screen_pixels;
 
-      src += GBA_SCREEN_PITCH;
-      dst += GBA_SCREEN_PITCH;
-   }
+   gba_screen_pixels      = gba_screen_pixels_prev;
+   gba_screen_pixels_prev = pixels;
 }
 
 static void video_post_process_mix(void)
 {
-   uint16_t *src_curr = gba_screen_pixels;
-   uint16_t *src_prev = gba_screen_pixels_prev;
-   uint16_t *dst      = gba_processed_pixels;
-   size_t x, y;
+   const uint16_t *src_curr = gba_screen_pixels;
+   const uint16_t *src_prev = gba_screen_pixels_prev;
+   uint16_t *dst            = gba_processed_pixels;
+   size_t i                 = 0;
+
+#if defined(__SSE2__)
+   const __m128i low_bits = _mm_set1_epi16(0x821);
 
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
+   for (; i < (GBA_SCREEN_PIXELS & ~7); i += 8)
    {
-      for (x = 0; x < GBA_SCREEN_PITCH; x++)
-      {
-         /* Get colours from current + previous frames (RGB565) */
-         uint16_t rgb_curr = *(src_curr + x);
-         uint16_t rgb_prev = *(src_prev + x);
+      __m128i rgb_curr = _mm_loadu_si128((const __m128i*)(src_curr + i));
+      __m128i rgb_prev = _mm_loadu_si128((const __m128i*)(src_prev + i));
+      __m128i rgb_diff = _mm_xor_si128(rgb_curr, rgb_prev);
+      __m128i rgb_mix  = _mm_add_epi16(_mm_and_si128(rgb_curr, rgb_prev),
+            _mm_srli_epi16(_mm_andnot_si128(low_bits, rgb_diff), 1));
+
+      rgb_mix = _mm_add_epi16(rgb_mix, _mm_and_si128(rgb_diff, low_bits));
+      _mm_storeu_si128((__m128i*)(dst + i), rgb_mix);
+   }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   const uint16x8_t low_bits = vdupq_n_u16(0x821);
 
-         /* Store colours for next frame */
-         *(src_prev + x)   = rgb_curr;
+   for (; i < (GBA_SCREEN_PIXELS & ~7); i += 8)
+   {
+      uint16x8_t rgb_curr = vld1q_u16(src_curr + i);
+      uint16x8_t rgb_prev = vld1q_u16(src_prev + i);
+      uint16x8_t rgb_diff = veorq_u16(rgb_curr, rgb_prev);
+      uint16x8_t rgb_mix  = vaddq_u16(vandq_u16(rgb_curr, rgb_prev),
+            vshrq_n_u16(vbicq_u16(rgb_diff, low_bits), 1));
 
-         /* Mix colours
-          * > "Mixing Packed RGB Pixels Efficiently"
-          *   http://blargg.8bitalley.com/info/rgb_mixing.html */
-         *(dst + x)        = (rgb_curr + rgb_prev + ((rgb_curr ^ rgb_prev) & 0x821)) >> 1;
-      }
+      vst1q_u16(dst + i, vaddq_u16(rgb_mix, vandq_u16(rgb_diff, low_bits)));
+   }
+#endif
+
+   for (; i < GBA_SCREEN_PIXELS; i++)
+   {
+      /* Get colours from current + previous frames (RGB565) */
+      uint16_t rgb_curr = src_curr[i];
+      uint16_t rgb_prev = src_prev[i];
 
-      src_curr += GBA_SCREEN_PITCH;
-      src_prev += GBA_SCREEN_PITCH;
-      dst      += GBA_SCREEN_PITCH;
+      /* Mix colours */
+      dst[i]            = (rgb_curr + rgb_prev + ((rgb_curr ^ rgb_prev) & 0x821)) >> 1;
    }
+
+   video_post_process_swap();
 }
 
-static void video_post_process_cc_mix(void)
+#ifdef FRONTEND_SUPPORTS_XRGB8888
+static void video_post_process_mix_xrgb8888(void)
 {
-   uint16_t *src_curr = gba_screen_pixels;
-   uint16_t *src_prev = gba_screen_pixels_prev;
-   uint16_t *dst      = gba_processed_pixels;
-   size_t x, y;
+   const uint32_t *src_curr = (const uint32_t*)gba_screen_pixels;
+   const uint32_t *src_prev = (const uint32_t*)gba_screen_pixels_prev;
+   uint32_t *dst            = (uint32_t*)gba_processed_pixels;
+   size_t i                 = 0;
 
-   for (y = 0; y < GBA_SCREEN_HEIGHT; y++)
-   {
-      for (x = 0; x < GBA_SCREEN_PITCH; x++)
-      {
-         /* Get colours from current + previous frames (RGB565) */
-         uint16_t rgb_curr = *(src_curr + x);
-         uint16_t rgb_prev = *(src_prev + x);
+#if defined(__SSE2__)
+   const __m128i low_bits = _mm_set1_epi32(0x10101);
 
-         /* Store colours for next frame */
-         *(src_prev + x)   = rgb_curr;
+   for (; i < (GBA_SCREEN_PIXELS & ~3); i += 4)
+   {
+      __m128i rgb_curr = _mm_loadu_si128((const __m128i*)(src_curr + i));
+      __m128i rgb_prev = _mm_loadu_si128((const __m128i*)(src_prev + i));
+      __m128i rgb_diff = _mm_xor_si128(rgb_curr, rgb_prev);
+      __m128i rgb_mix  = _mm_add_epi32(_mm_and_si128(rgb_curr, rgb_prev),
+            _mm_srli_epi32(_mm_andnot_si128(low_bits, rgb_diff), 1));
+
+      rgb_mix = _mm_add_epi32(rgb_mix, _mm_and_si128(rgb_diff, low_bits));
+      _mm_storeu_si128((__m128i*)(dst + i), rgb_mix);
+   }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   const uint32x4_t low_bits = vdupq_n_u32(0x10101);
 
-         /* Mix colours
-          * > "Mixing Packed RGB Pixels Efficiently"
-          *   http://blargg.8bitalley.com/info/rgb_mixing.html */
-         uint16_t rgb_mix  = (rgb_curr + rgb_prev + ((rgb_curr ^ rgb_prev) & 0x821)) >> 1;
+   for (; i < (GBA_SCREEN_PIXELS & ~3); i += 4)
+   {
+      uint32x4_t rgb_curr = vld1q_u32(src_curr + i);
+      uint32x4_t rgb_prev = vld1q_u32(src_prev + i);
+      uint32x4_t rgb_diff = veorq_u32(rgb_curr, rgb_prev);
+      uint32x4_t rgb_mix  = vaddq_u32(vandq_u32(rgb_curr, rgb_prev),
+            vshrq_n_u32(vbicq_u32(rgb_diff, low_bits), 1));
 
-         /* Convert colour to RGB555 and perform lookup */
-         *(dst + x) = *(gba_cc_lut + (((rgb_mix & 0xFFC0) >> 1) | (rgb_mix & 0x1F)));
-      }
+      vst1q_u32(dst + i, vaddq_u32(rgb_mix, vandq_u32(rgb_diff, low_bits)));
+   }
+#endif
 
-      src_curr += GBA_SCREEN_PITCH;
-      src_prev += GBA_SCREEN_PITCH;
-      dst      += GBA_SCREEN_PITCH;
+   for (; i < GBA_SCREEN_PIXELS; i++)
+   {
+      /* Get colours from current + previous frames (XRGB8888) */
+      uint32_t rgb_curr = src_curr[i];
+      uint32_t rgb_prev = src_prev[i];
+      uint32_t rgb_diff = rgb_curr ^ rgb_prev;
+
+      /* Mix colours (the unused top byte can't carry
+       * out of the pixel this way) */
+      dst[i]            = (rgb_curr & rgb_prev) +
+            ((rgb_diff & ~0x10101) >> 1) + (rgb_diff & 0x10101);
    }
+
+   video_post_process_swap();
 }
+#endif
 
 static void init_post_processing(void)
 {
-   size_t buf_size = GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * sizeof(u16);
+   size_t buf_size = GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * SCREEN_BUFFER_PIXEL_SIZE;
 
    video_post_process = NULL;
 
+   /* Colour correction is done by the renderer,
+    * which draws with a corrected palette */
+   init_color_correction(post_process_cc);
+
    /* If post processing is disabled, return
     * immediately */
-   if (!post_process_cc && !post_process_mix)
+   if (!post_process_mix)
       return;
 
    /* Initialise output buffer, if required */
-   if (!gba_processed_pixels &&
-       (post_process_cc || post_process_mix))
+   if (!gba_processed_pixels)
    {
 #ifdef _3DS
       gba_processed_pixels = (u16*)linearMemAlign(buf_size, 128);
@@ -317,11 +385,16 @@ static void init_post_processing(void)
       memset(gba_processed_pixels, 0xFFFF, buf_size);
    }
 
-   /* Initialise 'history' buffer, if required */
-   if (!gba_screen_pixels_prev &&
-       post_process_mix)
+   /* Initialise 'history' buffer, if required. It
+    * takes turns with gba_screen_pixels, so it must
+    * be allocated the same way */
+   if (!gba_screen_pixels_prev)
    {
+#ifdef _3DS
+      gba_screen_pixels_prev = (u16*)linearMemAlign(buf_size, 128);
+#else
       gba_screen_pixels_prev = (u16*)malloc(buf_size);
+#endif
 
       if (!gba_screen_pixels_prev)
          return;
@@ -330,11 +403,11 @@ static void init_post_processing(void)
    }
 
    /* Assign post processing function */
-   if (post_process_cc && post_process_mix)
-      video_post_process = video_post_process_cc_mix;
-   else if (post_process_cc)
-      video_post_process = video_post_process_cc;
-   else if (post_process_mix)
+#ifdef FRONTEND_SUPPORTS_XRGB8888
+   if (video_pixel_size == sizeof(u32))
+      video_post_process = video_post_process_mix_xrgb8888;
+   else
+#endif
       video_post_process = video_post_process_mix;
 }
 
@@ -372,7 +445,7 @@ static void video_run(void)
    if (skip_next_frame)
    {
       video_cb(NULL, GBA_SCREEN_WIDTH, GBA_SCREEN_HEIGHT,
-            GBA_SCREEN_PITCH * 2);
+            GBA_SCREEN_PITCH * video_pixel_size);
       return;
    }
 
@@ -405,7 +478,7 @@ static void video_run(void)
             GBA_SCREEN_PITCH * 2);
 #else 
    video_cb(gba_screen_pixels_buf, GBA_SCREEN_WIDTH, GBA_SCREEN_HEIGHT,
-            GBA_SCREEN_PITCH * 2);
+            GBA_SCREEN_PITCH * video_pixel_size);
 #endif
 }
 
@@ -450,7 +523,7 @@ void retro_get_system_av_info(struct retro_system_av_info* info)
    info->geometry.max_height = GBA_SCREEN_HEIGHT;
    info->geometry.aspect_ratio = 0;
    info->timing.fps = ((float) GBA_FPS);
-   info->timing.sample_rate = GBA_SOUND_FREQUENCY;
+   info->timing.sample_rate = sound_output_frequency;
 }
 
 void retro_init(void)
@@ -523,12 +596,13 @@ void retro_init(void)
    if (!gamepak_rom)
       init_gamepak_buffer();
    init_sound(1);
+   init_video();
 
    if(!gba_screen_pixels)
 #ifdef _3DS
-      gba_screen_pixels = (uint16_t*)linearMemAlign(GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * sizeof(uint16_t), 128);
+      gba_screen_pixels = (uint16_t*)linearMemAlign(GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * SCREEN_BUFFER_PIXEL_SIZE, 128);
 #else
-      gba_screen_pixels = (uint16_t*)malloc(GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * sizeof(uint16_t));
+      gba_screen_pixels = (uint16_t*)malloc(GBA_SCREEN_PITCH * GBA_SCREEN_HEIGHT * SCREEN_BUFFER_PIXEL_SIZE);
 #endif
 
    libretro_supports_bitmasks = false;
@@ -556,6 +630,7 @@ void retro_deinit(void)
 {
    perf_cb.perf_log();
    memory_term();
+   rewind_term();
 
 #if defined(HAVE_MMAP) && defined(HAVE_DYNAREC)
    munmap(rom_translation_cache, ROM_TRANSLATION_CACHE_SIZE);
@@ -595,13 +670,15 @@ void retro_deinit(void)
    linearFree(gba_screen_pixels);
    if (gba_processed_pixels)
       linearFree(gba_processed_pixels);
+   if (gba_screen_pixels_prev)
+      linearFree(gba_screen_pixels_prev);
 #else
    free(gba_screen_pixels);
    if (gba_processed_pixels)
       free(gba_processed_pixels);
-#endif
    if (gba_screen_pixels_prev)
       free(gba_screen_pixels_prev);
+#endif
 
    gba_screen_pixels      = NULL;
    gba_processed_pixels   = NULL;
@@ -609,6 +686,9 @@ void retro_deinit(void)
    video_post_process     = NULL;
    post_process_cc        = false;
    post_process_mix       = false;
+   init_color_correction(0);
+   init_video_output(0);
+   video_pixel_size       = sizeof(u16);
 }
 
 static retro_time_t retro_perf_dummy_get_time_usec() { return 0; }
@@ -657,6 +737,7 @@ void retro_reset(void)
 {
    update_backup();
    reset_gba();
+   rewind_reset();
 }
 
 size_t retro_serialize_size(void)
@@ -727,8 +808,40 @@ static void extract_directory(char* buf, const char* path, size_t size)
       strncpy(buf, ".", size);
 }
 
+static void set_input_descriptors();
+
+static u64 rewind_clock_usec(void)
+{
+   return perf_cb.get_time_usec();
+}
+
+static void log_rewind_stats(void)
+{
+   rewind_stats_type stats;
+
+   if (!log_cb || !rewind_enabled())
+      return;
+
+   rewind_get_stats(&stats);
+   if (!stats.captures)
+      return;
+
+   log_cb(RETRO_LOG_INFO,
+         "[gpSP]: Rewind: %u snapshots, %u/%u KB used, state %u bytes\n",
+         stats.snapshots, stats.buffer_used / 1024, stats.buffer_size / 1024,
+         stats.state_size);
+   log_cb(RETRO_LOG_INFO,
+         "[gpSP]: Rewind: average delta %u bytes, average capture %u us\n",
+         (unsigned)(stats.total_delta_size / stats.captures),
+         (unsigned)(stats.total_capture_usec / stats.captures));
+}
+
 static void check_variables(int started_from_load)
 {
+   static unsigned rewind_buffer_size = 0;
+   static unsigned rewind_interval    = 0;
+   unsigned rewind_buffer_size_prev   = rewind_buffer_size;
+   unsigned rewind_interval_prev      = rewind_interval;
    struct retro_variable var;
    bool frameskip_type_prev;
    bool post_process_cc_prev;
@@ -838,6 +951,11 @@ static void check_variables(int started_from_load)
          post_process_mix = true;
    }
 
+   var.key   = "gpsp_line_reuse";
+   var.value = NULL;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      init_line_reuse(strcmp(var.value, "enabled") == 0);
+
    /* Check whether post processing options
     * have changed */
    if ((post_process_cc != post_process_cc_prev) ||
@@ -855,6 +973,13 @@ static void check_variables(int started_from_load)
          else
             use_libretro_save_method = 0;
       }
+
+      var.key = "gpsp_audio_rate";
+      var.value = NULL;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+         init_sound_output(strtol(var.value, NULL, 10));
+      else
+         init_sound_output(0);
    }
 
    var.key           = "gpsp_turbo_period";
@@ -878,6 +1003,30 @@ static void check_variables(int started_from_load)
       turbo_a_counter = 0;
       turbo_b_counter = 0;
    }
+
+   var.key            = "gpsp_rewind_buffer";
+   var.value          = NULL;
+   rewind_buffer_size = 0;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      rewind_buffer_size = atoi(var.value) * 1024 * 1024;
+
+   var.key         = "gpsp_rewind_interval";
+   var.value       = NULL;
+   rewind_interval = 2;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      rewind_interval = atoi(var.value);
+
+   if (started_from_load ||
+       (rewind_buffer_size != rewind_buffer_size_prev) ||
+       (rewind_interval != rewind_interval_prev))
+   {
+      log_rewind_stats();
+      if (!init_rewind(rewind_buffer_size, rewind_interval, rewind_clock_usec))
+         error_msg("Could not allocate the rewind buffer.");
+
+      if (!started_from_load)
+         set_input_descriptors();
+   }
 }
 
 static void set_input_descriptors()
@@ -895,6 +1044,7 @@ static void set_input_descriptors()
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_START,  "Start" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L,      "L" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R,      "R" },
+      { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L2,     "Rewind" },
       { 0 },
    };
 
@@ -912,8 +1062,18 @@ static void set_input_descriptors()
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L,      "L" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R,      "R" },
       { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_R2,     "Fast Forward" },
+      { 0, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_L2,     "Rewind" },
       { 0 },
    };
+   size_t descriptors_count    = sizeof(descriptors) / sizeof(descriptors[0]);
+   size_t descriptors_ff_count = sizeof(descriptors_ff) / sizeof(descriptors_ff[0]);
+
+   /* Drop the trailing rewind entry when it is disabled */
+   if (!rewind_enabled())
+   {
+      memset(&descriptors[descriptors_count - 2], 0, sizeof(descriptors[0]));
+      memset(&descriptors_ff[descriptors_ff_count - 2], 0, sizeof(descriptors_ff[0]));
+   }
 
    if (libretro_supports_ff_override)
       environ_cb(RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS, descriptors_ff);
@@ -941,16 +1101,31 @@ bool retro_load_game(const struct retro_game_info* info)
       return false;
 
    use_libretro_save_method = 0;
+
+   /* Set before the core options are read, frame
+    * mixing depends on the output format */
+   enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_RGB565;
+#ifdef FRONTEND_SUPPORTS_XRGB8888
+   /* A natively 32bit frontend would otherwise
+    * convert every frame */
+   fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+      fmt = RETRO_PIXEL_FORMAT_RGB565;
+#endif
+   if (fmt == RETRO_PIXEL_FORMAT_RGB565 &&
+       !environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+      info_msg("RGB565 is not supported.");
+
+   video_pixel_size = (fmt == RETRO_PIXEL_FORMAT_XRGB8888) ?
+         sizeof(u32) : sizeof(u16);
+   init_video_output(fmt == RETRO_PIXEL_FORMAT_XRGB8888);
+
    check_variables(1);
    set_input_descriptors();
 
    char filename_bios[MAX_PATH];
    const char* dir = NULL;
 
-   enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_RGB565;
-   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
-      info_msg("RGB565 is not supported.");
-
    extract_directory(main_path, info->path, sizeof(main_path));
 
    if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) && dir)
@@ -998,6 +1173,7 @@ bool retro_load_game(const struct retro_game_info* info)
    }
 
    reset_gba();
+   rewind_reset();
 
    set_memory_descriptors();
 
@@ -1014,6 +1190,9 @@ void retro_unload_game(void)
 {
    update_backup();
 
+   log_rewind_stats();
+   rewind_reset();
+
    if (libretro_ff_enabled)
       set_fastforward_override(false);
 
@@ -1097,10 +1276,16 @@ size_t retro_get_memory_size(unsigned id)
 void retro_run(void)
 {
    bool updated = false;
+   bool rewound = false;
 
    input_poll_cb();
    update_input();
 
+   /* Step back one snapshot, then run a frame from there to
+    * produce output */
+   if (libretro_rewind_pressed)
+      rewound = rewind_step();
+
    /* Check whether current frame should
     * be skipped */
    skip_next_frame = 0;
@@ -1171,6 +1356,15 @@ void retro_run(void)
       update_audio_latency = false;
    }
 
+   /* Skip sound synthesis for frames whose audio
+    * the frontend is going to discard (fast forward
+    * with audio muted, run-ahead, ...) */
+   {
+      int av_enable = 3;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av_enable))
+         global_process_audio = (av_enable & 2) ? 1 : 0;
+   }
+
    /* This runs just a frame */
    #ifdef HAVE_DYNAREC
    if (dynarec_enable)
@@ -1179,6 +1373,9 @@ void retro_run(void)
    #endif
       execute_arm(execute_cycles);
 
+   if (!rewound)
+      rewind_capture();
+
    render_audio();
    video_run();
 
@@ -156,6 +156,17 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "disabled"
    },
+   {
+      "gpsp_line_reuse",
+      "Reuse Unchanged Lines",
+      "Copies scanlines whose display registers and video memory are unchanged since the previous frame instead of drawing them again. Speeds up games with static areas such as status bars, at the cost of some overhead on lines that do change.",
+      {
+         { "enabled",  NULL },
+         { "disabled", NULL },
+         { NULL, NULL },
+      },
+      "disabled"
+   },
    {
       "gpsp_save_method",
       "Backup Save Method (Restart)",
@@ -167,6 +178,18 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "gpSP"
    },
+   {
+      "gpsp_audio_rate",
+      "Audio Output Rate (Restart)",
+      "Sample rate of the audio sent to the frontend. 'native' outputs the internal mixing rate (65536 Hz) and leaves resampling to the frontend. 48000 and 44100 Hz resample it in the core with a filter that removes aliasing, so the frontend doesn't need to resample again if the audio device runs at that rate.",
+      {
+         { "native", NULL },
+         { "48000",  "48000 Hz" },
+         { "44100",  "44100 Hz" },
+         { NULL, NULL },
+      },
+      "native"
+   },
 #if defined(HAVE_DYNAREC)
    {
       "gpsp_drc",
@@ -306,6 +329,38 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "4"
    },
+   {
+      "gpsp_rewind_buffer",
+      "Rewind Buffer Size",
+      "Memory reserved for the built-in rewind history, rewind by holding L2. Snapshots are stored as compressed differences, so the history length depends on the game.",
+      {
+         { "disabled", NULL },
+         { "8MB",      NULL },
+         { "16MB",     NULL },
+         { "32MB",     NULL },
+         { "64MB",     NULL },
+         { NULL, NULL },
+      },
+      "disabled"
+   },
+   {
+      "gpsp_rewind_interval",
+      "Rewind Granularity",
+      "Number of frames between rewind snapshots. Higher values lower the per-frame cost and make the history longer, but rewind in coarser steps.",
+      {
+         { "1",  NULL },
+         { "2",  NULL },
+         { "3",  NULL },
+         { "4",  NULL },
+         { "5",  NULL },
+         { "10", NULL },
+         { "15", NULL },
+         { "30", NULL },
+         { "60", NULL },
+         { NULL, NULL },
+      },
+      "2"
+   },
    { NULL, NULL, NULL, {{0}}, NULL },
 };
 
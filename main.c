@@ -235,6 +235,8 @@ u32 update_gba(void)
              process_cheats();
 
           vcount = 0;
+          // The frame must be fully drawn before it's handed out.
+          video_render_sync();
           // We completed a frame, tell the dynarec to exit to the main thread
           reg[COMPLETED_FRAME] = 1;
         }
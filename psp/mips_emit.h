@@ -2864,6 +2864,15 @@ static void emit_pmemld_stub(
   *tr_ptr = translation_ptr;
 }
 
+// Flags the unit containing offset a0 in a dirty map (see gba_memory.h)
+// Clobbers a0 and temp.
+#define emit_mark_dirty(map, shift)                                           \
+  mips_emit_srl(reg_temp, reg_a0, shift);                                     \
+  mips_emit_lui(reg_a0, (((u32)map) + 0x8000) >> 16);                         \
+  mips_emit_addu(reg_a0, reg_a0, reg_temp);                                   \
+  mips_emit_addiu(reg_temp, reg_zero, 0xFF);                                  \
+  mips_emit_sb(reg_temp, reg_a0, ((u32)map))                                  \
+
 // Generates the stub to store memory for a given region and size
 // Handles "special" cases like weirdly mapped memory
 static void emit_pmemst_stub(
@@ -2955,8 +2964,12 @@ static void emit_pmemst_stub(
   }
 
   // Post processing store:
-  // Signal that OAM was updated
+  // Flag the VRAM page or OAM entry as dirty, signal that OAM was updated
+  if (region == 6) {
+    emit_mark_dirty(vram_dirty, VRAM_DIRTY_SHIFT);
+  }
   if (region == 7) {
+    emit_mark_dirty(oam_dirty, OAM_DIRTY_SHIFT);
     // Write any nonzero data
     mips_emit_sw(reg_base, reg_base, ReOff_OamUpd);
     generate_function_return_swap_delay();
@@ -3017,11 +3030,12 @@ static void emit_palette_hdl(
   mips_emit_srl(reg_temp, reg_a0, 24);
   mips_emit_xori(reg_temp, reg_temp, 5);
   mips_emit_b(bne, reg_zero, reg_temp, st_phndlr_branch(memop_number));
-  mips_emit_andi(reg_rv, reg_a0, memmask);   // Clear upper bits (mirroring)
+  mips_emit_andi(reg_a0, reg_a0, memmask);   // Clear upper bits (mirroring)
   if (size == 0) {
     double_byte(reg_a1, reg_temp);    // value = value | (value << 8)
   }
-  mips_emit_addu(reg_rv, reg_rv, reg_base);
+  mips_emit_addu(reg_rv, reg_a0, reg_base);
+  emit_mark_dirty(palette_dirty, PALETTE_DIRTY_SHIFT);
 
   // Store the data in real palette memory
   if (realsize == 2) {
@@ -0,0 +1,363 @@
+/* gameplaySP
+ *
+ * Copyright (C) 2006 Exophase <exophase@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "common.h"
+
+// Only the newest snapshot is kept in full (rewind_state). The ring holds
+// one delta per older snapshot, each delta being the XOR of two consecutive
+// snapshots encoded as 32bit word runs:
+//
+//   <equal words count> <changed words count> <changed words XOR values>
+//
+// with both counts stored as 7bit varints. Stepping back XORs the newest
+// delta into rewind_state, which turns it into the previous snapshot.
+//
+// Ring entries are laid out as <u32 length> <delta> <u32 length> so they
+// can be dropped from the tail and popped from the head. They may wrap
+// around the end of the ring.
+
+// Worst case encoded size of a delta on top of the snapshot size.
+#define REWIND_DELTA_OVERHEAD  64
+
+static u8 *rewind_ring = NULL;
+static u32 rewind_ring_size = 0;
+static u32 rewind_ring_head = 0;
+static u32 rewind_ring_tail = 0;
+static u32 rewind_ring_used = 0;
+static u32 rewind_count = 0;
+
+static u8 *rewind_state = NULL;
+static u8 *rewind_state_new = NULL;
+static u8 *rewind_delta = NULL;
+static u32 rewind_state_size = 0;
+static u32 rewind_state_valid = 0;
+
+static u32 rewind_interval = 1;
+static u32 rewind_frame_counter = 0;
+static rewind_clock_type rewind_clock = NULL;
+
+static rewind_stats_type rewind_stats;
+
+static u8 *rewind_put_length(u8 *dest, u32 value)
+{
+  while(value >= 0x80)
+  {
+    *(dest++) = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  *(dest++) = value;
+
+  return dest;
+}
+
+static const u8 *rewind_get_length(const u8 *src, u32 *value)
+{
+  u32 shift = 0;
+  u32 result = 0;
+
+  do
+  {
+    result |= (*src & 0x7F) << shift;
+    shift += 7;
+  } while(*(src++) & 0x80);
+
+  *value = result;
+  return src;
+}
+
+static u32 rewind_encode(const u32 *old_state, const u32 *new_state,
+ u32 words, u8 *dest)
+{
+  u8 *dest_ptr = dest;
+  u32 i = 0;
+
+  while(i < words)
+  {
+    u32 equal_start = i;
+    u32 changed_start;
+
+    while((i < words) && (old_state[i] == new_state[i]))
+      i++;
+
+    if(i == words)
+      break;
+
+    changed_start = i;
+    while((i < words) && (old_state[i] != new_state[i]))
+      i++;
+
+    dest_ptr = rewind_put_length(dest_ptr, changed_start - equal_start);
+    dest_ptr = rewind_put_length(dest_ptr, i - changed_start);
+
+    for(; changed_start < i; changed_start++)
+    {
+      u32 value = old_state[changed_start] ^ new_state[changed_start];
+      memcpy(dest_ptr, &value, 4);
+      dest_ptr += 4;
+    }
+  }
+
+  return dest_ptr - dest;
+}
+
+static void rewind_apply(u32 *state, const u8 *src, u32 size)
+{
+  const u8 *src_end = src + size;
+
+  while(src < src_end)
+  {
+    u32 equal_words, changed_words;
+
+    src = rewind_get_length(src, &equal_words);
+    src = rewind_get_length(src, &changed_words);
+    state += equal_words;
+
+    while(changed_words--)
+    {
+      u32 value;
+      memcpy(&value, src, 4);
+      *(state++) ^= value;
+      src += 4;
+    }
+  }
+}
+
+static void rewind_ring_write(u32 position, const void *src, u32 size)
+{
+  u32 first = rewind_ring_size - position;
+
+  if(first > size)
+    first = size;
+
+  memcpy(rewind_ring + position, src, first);
+  memcpy(rewind_ring, (const u8 *)src + first, size - first);
+}
+
+static void rewind_ring_read(u32 position, void *dest, u32 size)
+{
+  u32 first = rewind_ring_size - position;
+
+  if(first > size)
+    first = size;
+
+  memcpy(dest, rewind_ring + position, first);
+  memcpy((u8 *)dest + first, rewind_ring, size - first);
+}
+
+static u32 rewind_ring_wrap(u32 position)
+{
+  return (position >= rewind_ring_size) ?
+   (position - rewind_ring_size) : position;
+}
+
+static void rewind_drop_oldest(void)
+{
+  u32 length;
+
+  rewind_ring_read(rewind_ring_tail, &length, 4);
+  rewind_ring_tail = rewind_ring_wrap(rewind_ring_tail + length + 8);
+  rewind_ring_used -= length + 8;
+  rewind_count--;
+}
+
+static void rewind_push_delta(u32 length)
+{
+  u32 entry_size = length + 8;
+
+  // Doesn't fit at all, the history can't be kept continuous.
+  if(entry_size > rewind_ring_size)
+  {
+    rewind_ring_head = 0;
+    rewind_ring_tail = 0;
+    rewind_ring_used = 0;
+    rewind_count = 0;
+    return;
+  }
+
+  while((rewind_ring_size - rewind_ring_used) < entry_size)
+    rewind_drop_oldest();
+
+  rewind_ring_write(rewind_ring_head, &length, 4);
+  rewind_ring_write(rewind_ring_wrap(rewind_ring_head + 4), rewind_delta,
+   length);
+  rewind_ring_write(rewind_ring_wrap(rewind_ring_head + 4 + length),
+   &length, 4);
+
+  rewind_ring_head = rewind_ring_wrap(rewind_ring_head + entry_size);
+  rewind_ring_used += entry_size;
+  rewind_count++;
+}
+
+static u32 rewind_pop_delta(void)
+{
+  u32 length;
+  u32 start;
+
+  rewind_ring_read(rewind_ring_wrap(rewind_ring_head + rewind_ring_size - 4),
+   &length, 4);
+  start = rewind_ring_wrap(rewind_ring_head + rewind_ring_size -
+   (length + 8));
+  rewind_ring_read(rewind_ring_wrap(start + 4), rewind_delta, length);
+
+  rewind_ring_head = start;
+  rewind_ring_used -= length + 8;
+  rewind_count--;
+
+  return length;
+}
+
+void rewind_term(void)
+{
+  free(rewind_ring);
+  free(rewind_state);
+  free(rewind_state_new);
+  free(rewind_delta);
+
+  rewind_ring = NULL;
+  rewind_state = NULL;
+  rewind_state_new = NULL;
+  rewind_delta = NULL;
+  rewind_ring_size = 0;
+
+  rewind_reset();
+}
+
+void rewind_reset(void)
+{
+  rewind_ring_head = 0;
+  rewind_ring_tail = 0;
+  rewind_ring_used = 0;
+  rewind_count = 0;
+  rewind_state_valid = 0;
+  rewind_frame_counter = 0;
+  memset(&rewind_stats, 0, sizeof(rewind_stats));
+}
+
+u32 init_rewind(u32 buffer_size, u32 interval, rewind_clock_type clock)
+{
+  rewind_term();
+
+  if(buffer_size == 0)
+    return 1;
+
+  if(interval < 1)
+    interval = 1;
+  if(interval > REWIND_INTERVAL_MAX)
+    interval = REWIND_INTERVAL_MAX;
+
+  rewind_interval = interval;
+  rewind_clock = clock;
+
+  rewind_ring = malloc(buffer_size);
+  // Extra room for padding the snapshot to a whole number of words.
+  rewind_state = calloc(1, GBA_STATE_MEM_SIZE + 4);
+  rewind_state_new = calloc(1, GBA_STATE_MEM_SIZE + 4);
+  rewind_delta = malloc(GBA_STATE_MEM_SIZE + REWIND_DELTA_OVERHEAD);
+
+  if(!rewind_ring || !rewind_state || !rewind_state_new || !rewind_delta)
+  {
+    rewind_term();
+    return 0;
+  }
+
+  rewind_ring_size = buffer_size;
+  return 1;
+}
+
+u32 rewind_enabled(void)
+{
+  return rewind_ring != NULL;
+}
+
+// Called once per emulated frame while not rewinding.
+
+void rewind_capture(void)
+{
+  u64 start_time = 0;
+  u32 state_size;
+  u32 length;
+  u8 *swap;
+
+  if(!rewind_ring)
+    return;
+
+  if(++rewind_frame_counter < rewind_interval)
+    return;
+
+  rewind_frame_counter = 0;
+
+  if(rewind_clock)
+    start_time = rewind_clock();
+
+  gba_save_state(rewind_state_new);
+  state_size = (state_mem_write_ptr - rewind_state_new + 3) & ~3;
+
+  if(rewind_state_valid)
+  {
+    length = rewind_encode((u32 *)rewind_state, (u32 *)rewind_state_new,
+     state_size / 4, rewind_delta);
+    rewind_push_delta(length);
+
+    rewind_stats.last_delta_size = length;
+    rewind_stats.total_delta_size += length;
+  }
+
+  swap = rewind_state;
+  rewind_state = rewind_state_new;
+  rewind_state_new = swap;
+  rewind_state_size = state_size;
+  rewind_state_valid = 1;
+
+  if(rewind_clock)
+  {
+    rewind_stats.last_capture_usec = rewind_clock() - start_time;
+    rewind_stats.total_capture_usec += rewind_stats.last_capture_usec;
+  }
+
+  rewind_stats.captures++;
+}
+
+// Goes back one snapshot and loads it. Once the history runs out the oldest
+// snapshot is loaded again, returns 0 if there's none at all.
+
+u32 rewind_step(void)
+{
+  if(!rewind_ring || !rewind_state_valid)
+    return 0;
+
+  if(rewind_count)
+  {
+    u32 length = rewind_pop_delta();
+    rewind_apply((u32 *)rewind_state, rewind_delta, length);
+  }
+
+  gba_load_state(rewind_state);
+  rewind_frame_counter = 0;
+
+  return 1;
+}
+
+void rewind_get_stats(rewind_stats_type *stats)
+{
+  *stats = rewind_stats;
+  stats->buffer_size = rewind_ring_size;
+  stats->buffer_used = rewind_ring_used;
+  stats->snapshots = rewind_count;
+  stats->state_size = rewind_state_size;
+}
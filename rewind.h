@@ -0,0 +1,53 @@
+/* gameplaySP
+ *
+ * Copyright (C) 2006 Exophase <exophase@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __GPSP_REWIND_H__
+#define __GPSP_REWIND_H__
+
+// Snapshots are taken every rewind_interval frames. Each one is stored as
+// the XOR against the following snapshot, run length compressed, in a ring
+// of buffer_size bytes. The oldest snapshots are dropped when it fills up.
+
+#define REWIND_INTERVAL_MAX  60
+
+// Optional time source used to measure the capture cost, in microseconds.
+typedef u64 (*rewind_clock_type)(void);
+
+typedef struct
+{
+  u32 buffer_size;
+  u32 buffer_used;
+  u32 snapshots;
+  u32 state_size;
+  u32 last_delta_size;
+  u32 last_capture_usec;
+  u32 captures;
+  u64 total_delta_size;
+  u64 total_capture_usec;
+} rewind_stats_type;
+
+u32 init_rewind(u32 buffer_size, u32 interval, rewind_clock_type clock);
+void rewind_term(void);
+void rewind_reset(void);
+void rewind_capture(void);
+u32 rewind_step(void);
+u32 rewind_enabled(void);
+void rewind_get_stats(rewind_stats_type *stats);
+
+#endif
@@ -19,6 +19,7 @@
 
 
 #include "common.h"
+#include <math.h>
 #ifndef __LIBRETRO__
 #include "frontend/plat.h"
 #endif
@@ -38,6 +39,12 @@ static u32 sound_buffer_base;
 static u32 sound_last_cpu_ticks;
 static fixed16_16 gbc_sound_tick_step;
 
+#ifdef HAVE_AUDIO_THREAD
+static void sync_audio_thread(void);
+#else
+#define sync_audio_thread()
+#endif
+
 /* Queue 1 sample to the top of the DS FIFO, wrap around circularly */
 
 void sound_timer_queue8(u32 channel, u8 value)
@@ -81,92 +88,184 @@ void sound_timer_queue32(u32 channel, u32 value)
 }
 
 
-void sound_timer(fixed8_24 frequency_step, u32 channel)
+// Direct Sound output isn't mixed as the timers overflow. The samples each
+// FIFO pops are logged, in runs sharing the timer step and channel
+// settings, and mixed into sound_buffer in one pass by render_direct_sound().
+// That runs with render_audio() and before anything uses the channels'
+// buffer positions.
+
+#define DIRECT_SOUND_LOG_SAMPLES 2048
+#define DIRECT_SOUND_LOG_RUNS    64
+
+typedef struct
 {
-  unsigned sample_status = DIRECT_SOUND_INACTIVE;
-  direct_sound_struct *ds = direct_sound_channel + channel;
+  fixed8_24 frequency_step;
+  u32 status;
+  u32 volume;
+  u32 start;
+} direct_sound_run_type;
 
-  fixed8_24 fifo_fractional = ds->fifo_fractional;
-  u32 buffer_index = ds->buffer_index;
-  s16 current_sample, next_sample;
+typedef struct
+{
+  // The popped sample and the one after it, interpolated between.
+  s8 samples[DIRECT_SOUND_LOG_SAMPLES][2];
+  direct_sound_run_type runs[DIRECT_SOUND_LOG_RUNS];
+  u32 sample_count;
+  u32 run_count;
+} direct_sound_log_type;
 
-  current_sample = ds->fifo[ds->fifo_base] * 16;
-  ds->fifo_base = (ds->fifo_base + 1) % 32;
-  next_sample = ds->fifo[ds->fifo_base] * 16;
+static direct_sound_log_type direct_sound_log[2];
 
-  if(sound_on == 1)
-  {
-    if(ds->volume == DIRECT_SOUND_VOLUME_50)
-    {
-      current_sample >>= 1;
-      next_sample >>= 1;
-    }
+#define direct_sound_sample()                                                 \
+  (current_sample + fp16_16_to_u32((next_sample - current_sample) *           \
+   (fifo_fractional >> 8)))                                                   \
 
-    sample_status = ds->status;
+#define direct_sound_render_sample_right()                                    \
+  sound_buffer[buffer_index + 1] += direct_sound_sample()                     \
 
-  }
+#define direct_sound_render_sample_left()                                     \
+  sound_buffer[buffer_index] += direct_sound_sample()                         \
+
+#define direct_sound_render_sample_leftright()                                \
+{                                                                             \
+  s16 dest_sample = direct_sound_sample();                                    \
+  sound_buffer[buffer_index] += dest_sample;                                  \
+  sound_buffer[buffer_index + 1] += dest_sample;                              \
+}                                                                             \
 
-  // Unqueue 1 sample from the base of the DS FIFO and place it on the audio
-  // buffer for as many samples as necessary. If the DS FIFO is 16 bytes or
-  // smaller and if DMA is enabled for the sound channel initiate a DMA transfer
-  // to the DS FIFO.
+// Each popped sample is interpolated towards the next one for as many
+// output samples as it lasts.
 
-  switch(sample_status)
+#define direct_sound_render_samples(type)                                     \
+  for(i = 0; i < sample_count; i++)                                           \
+  {                                                                           \
+    s16 current_sample = samples[i][0] * sample_scale;                        \
+    s16 next_sample = samples[i][1] * sample_scale;                           \
+                                                                              \
+    while(fifo_fractional <= 0xFFFFFF)                                        \
+    {                                                                         \
+      direct_sound_render_sample_##type();                                    \
+      fifo_fractional += frequency_step;                                      \
+      buffer_index = (buffer_index + 2) % BUFFER_SIZE;                        \
+    }                                                                         \
+                                                                              \
+    fifo_fractional = fp8_24_fractional_part(fifo_fractional);                \
+  }                                                                           \
+
+static void render_direct_sound_samples(s8 (*samples)[2],
+ u32 sample_count, u32 status, s32 sample_scale, fixed8_24 frequency_step,
+ fixed8_24 *fractional_ptr, u32 *buffer_index_ptr)
+{
+  fixed8_24 fifo_fractional = *fractional_ptr;
+  u32 buffer_index = *buffer_index_ptr;
+  u32 i;
+
+  switch(status)
   {
-     case DIRECT_SOUND_INACTIVE:
-        /* render samples NULL */
+    case DIRECT_SOUND_INACTIVE:
+      // Nothing is mixed in but the buffer position still moves on.
+      for(i = 0; i < sample_count; i++)
+      {
         while(fifo_fractional <= 0xFFFFFF)
         {
-           fifo_fractional += frequency_step;
-           buffer_index = (buffer_index + 2) % BUFFER_SIZE;
+          fifo_fractional += frequency_step;
+          buffer_index = (buffer_index + 2) % BUFFER_SIZE;
         }
-        break;
 
-     case DIRECT_SOUND_RIGHT:
-        /* render samples RIGHT */
-        while(fifo_fractional <= 0xFFFFFF)
-        {
-           s16 dest_sample = current_sample +
-              fp16_16_to_u32((next_sample - current_sample) * (fifo_fractional >> 8));
+        fifo_fractional = fp8_24_fractional_part(fifo_fractional);
+      }
+      break;
 
-           sound_buffer[buffer_index + 1]     += dest_sample;
+    case DIRECT_SOUND_RIGHT:
+      direct_sound_render_samples(right);
+      break;
 
-           fifo_fractional += frequency_step;
-           buffer_index = (buffer_index + 2) % BUFFER_SIZE;
-        }
-        break;
+    case DIRECT_SOUND_LEFT:
+      direct_sound_render_samples(left);
+      break;
 
-     case DIRECT_SOUND_LEFT:
-        /* render samples LEFT */
-        while(fifo_fractional <= 0xFFFFFF)
-        {
-           s16 dest_sample = current_sample +
-              fp16_16_to_u32((next_sample - current_sample) * (fifo_fractional >> 8));
+    case DIRECT_SOUND_LEFTRIGHT:
+      direct_sound_render_samples(leftright);
+      break;
+  }
 
-           sound_buffer[buffer_index]     += dest_sample;
+  *fractional_ptr = fifo_fractional;
+  *buffer_index_ptr = buffer_index;
+}
 
-           fifo_fractional += frequency_step;
-           buffer_index = (buffer_index + 2) % BUFFER_SIZE;
-        }
-        break;
+static void render_direct_sound_channel(u32 channel)
+{
+  direct_sound_struct *ds = direct_sound_channel + channel;
+  direct_sound_log_type *log = direct_sound_log + channel;
+  u32 run_number;
 
-     case DIRECT_SOUND_LEFTRIGHT:
-        /* render samples LEFT and RIGHT. */
-        while(fifo_fractional <= 0xFFFFFF)
-        {
-           s16 dest_sample = current_sample +
-              fp16_16_to_u32((next_sample - current_sample) * (fifo_fractional >> 8));
+  for(run_number = 0; run_number < log->run_count; run_number++)
+  {
+    direct_sound_run_type *run = log->runs + run_number;
+    u32 end = (run_number + 1 < log->run_count) ?
+     run[1].start : log->sample_count;
+    // Samples are 8bit, scaled up to 12bit for full volume.
+    s32 sample_scale = (run->volume == DIRECT_SOUND_VOLUME_50) ? 8 : 16;
+
+    render_direct_sound_samples(log->samples + run->start,
+     end - run->start, run->status, sample_scale, run->frequency_step,
+     &ds->fifo_fractional, &ds->buffer_index);
+  }
 
-           sound_buffer[buffer_index]     += dest_sample;
-           sound_buffer[buffer_index + 1] += dest_sample;
-           fifo_fractional += frequency_step;
-           buffer_index = (buffer_index + 2) % BUFFER_SIZE;
-        }
-        break;
+  log->sample_count = 0;
+  log->run_count = 0;
+}
+
+void render_direct_sound(void)
+{
+  render_direct_sound_channel(0);
+  render_direct_sound_channel(1);
+}
+
+void sound_timer(fixed8_24 frequency_step, u32 channel)
+{
+  direct_sound_struct *ds = direct_sound_channel + channel;
+  direct_sound_log_type *log = direct_sound_log + channel;
+  direct_sound_run_type *run = log->runs + log->run_count - 1;
+  u32 status = (sound_on == 1) ? ds->status : DIRECT_SOUND_INACTIVE;
+  u32 sample_number;
+
+  if((log->sample_count == DIRECT_SOUND_LOG_SAMPLES) ||
+   (log->run_count == DIRECT_SOUND_LOG_RUNS))
+  {
+    render_direct_sound_channel(channel);
+  }
+
+  if((log->run_count == 0) || (run->frequency_step != frequency_step) ||
+   (run->status != status) || (run->volume != ds->volume))
+  {
+    run = log->runs + log->run_count;
+    run->frequency_step = frequency_step;
+    run->status = status;
+    run->volume = ds->volume;
+    run->start = log->sample_count;
+    log->run_count++;
   }
 
-  ds->buffer_index = buffer_index;
-  ds->fifo_fractional = fp8_24_fractional_part(fifo_fractional);
+  // Unqueue 1 sample from the base of the DS FIFO, it's rendered for as
+  // many samples as necessary later. If the DS FIFO is 16 bytes or smaller
+  // and if DMA is enabled for the sound channel initiate a DMA transfer to
+  // the DS FIFO.
+
+  // Without audio output only the FIFO is kept going.
+
+  if(global_process_audio)
+  {
+    sample_number = log->sample_count;
+    log->samples[sample_number][0] = ds->fifo[ds->fifo_base];
+    ds->fifo_base = (ds->fifo_base + 1) % 32;
+    log->samples[sample_number][1] = ds->fifo[ds->fifo_base];
+    log->sample_count = sample_number + 1;
+  }
+  else
+  {
+    ds->fifo_base = (ds->fifo_base + 1) % 32;
+  }
 
   if(((ds->fifo_top - ds->fifo_base) % 32) <= 16)
   {
@@ -328,7 +427,6 @@ u32 gbc_sound_master_volume;
 #define update_tone_noenvelope()                                              \
 
 #define update_tone_counters(envelope_op, sweep_op)                           \
-  tick_counter += gbc_sound_tick_step;                                        \
   if(tick_counter > 0xFFFF)                                                   \
   {                                                                           \
     if(gs->length_status)                                                     \
@@ -359,8 +457,28 @@ u32 gbc_sound_master_volume;
   gbc_sound_render_sample_right();                                            \
   gbc_sound_render_sample_left()                                              \
 
-#define gbc_sound_render_samples(type, sample_length, envelope_op, sweep_op)  \
-  for(i = 0; i < buffer_ticks; i++)                                           \
+// The length, envelope and sweep counters tick every 256Hz, which is
+// hundreds of output samples apart. Samples are rendered in spans up to
+// the next tick so the inner loops don't check the counters.
+
+#define gbc_sound_render_spans(render_span, envelope_op, sweep_op)            \
+  samples_left = buffer_ticks;                                                \
+  while(samples_left)                                                         \
+  {                                                                           \
+    u32 span = ((0xFFFF - tick_counter) / gbc_sound_tick_step) + 1;           \
+                                                                              \
+    if(span > samples_left)                                                   \
+      span = samples_left;                                                    \
+                                                                              \
+    render_span;                                                              \
+                                                                              \
+    samples_left -= span;                                                     \
+    tick_counter += span * gbc_sound_tick_step;                               \
+    update_tone_counters(envelope_op, sweep_op);                              \
+  }                                                                           \
+
+#define gbc_sound_render_samples_span(type, sample_length)                    \
+  for(i = 0; i < span; i++)                                                   \
   {                                                                           \
     current_sample =                                                          \
      sample_data[fp16_16_to_u32(sample_index) % sample_length];               \
@@ -368,10 +486,12 @@ u32 gbc_sound_master_volume;
                                                                               \
     sample_index += frequency_step;                                           \
     buffer_index = (buffer_index + 2) % BUFFER_SIZE;                          \
-                                                                              \
-    update_tone_counters(envelope_op, sweep_op);                              \
   }                                                                           \
 
+#define gbc_sound_render_samples(type, sample_length, envelope_op, sweep_op)  \
+  gbc_sound_render_spans(gbc_sound_render_samples_span(type, sample_length),  \
+   envelope_op, sweep_op)                                                     \
+
 #define gbc_noise_wrap_full 32767
 
 #define gbc_noise_wrap_half 126
@@ -386,8 +506,8 @@ u32 gbc_sound_master_volume;
    ((s32)(noise_table7[fp16_16_to_u32(sample_index) >> 5] <<                  \
    (fp16_16_to_u32(sample_index) & 0x1F)) >> 31) & 0x0F                       \
 
-#define gbc_sound_render_noise(type, noise_type, envelope_op, sweep_op)       \
-  for(i = 0; i < buffer_ticks; i++)                                           \
+#define gbc_sound_render_noise_span(type, noise_type)                        \
+  for(i = 0; i < span; i++)                                                   \
   {                                                                           \
     get_noise_sample_##noise_type();                                          \
     gbc_sound_render_sample_##type();                                         \
@@ -398,9 +518,24 @@ u32 gbc_sound_master_volume;
       sample_index -= u32_to_fp16_16(gbc_noise_wrap_##noise_type);            \
                                                                               \
     buffer_index = (buffer_index + 2) % BUFFER_SIZE;                          \
-    update_tone_counters(envelope_op, sweep_op);                              \
   }                                                                           \
 
+#define gbc_sound_render_noise(type, noise_type, envelope_op, sweep_op)       \
+  gbc_sound_render_spans(gbc_sound_render_noise_span(type, noise_type),       \
+   envelope_op, sweep_op)                                                     \
+
+// Without audio output only the counters are run, they can turn channels
+// off. The sample positions are moved on as if the samples were rendered.
+
+#define gbc_sound_skip_samples(sample_length, envelope_op, sweep_op)          \
+  gbc_sound_render_spans(sample_index += span * frequency_step,               \
+   envelope_op, sweep_op)                                                     \
+
+#define gbc_sound_skip_noise(noise_type, envelope_op, sweep_op)               \
+  gbc_sound_render_spans(sample_index = (sample_index +                       \
+   (span * frequency_step)) % u32_to_fp16_16(gbc_noise_wrap_##noise_type),    \
+   envelope_op, sweep_op)                                                     \
+
 #define gbc_sound_render_channel(type, sample_length, envelope_op, sweep_op)  \
   buffer_index = gbc_sound_buffer_index;                                      \
   sample_index = gs->sample_index;                                            \
@@ -409,22 +544,32 @@ u32 gbc_sound_master_volume;
                                                                               \
   update_volume(envelope_op);                                                 \
                                                                               \
-  switch(gs->status)                                                          \
+  if(global_process_audio)                                                    \
   {                                                                           \
-    case GBC_SOUND_INACTIVE:                                                  \
-      break;                                                                  \
+    switch(gs->status)                                                        \
+    {                                                                         \
+      case GBC_SOUND_INACTIVE:                                                \
+        break;                                                                \
                                                                               \
-    case GBC_SOUND_LEFT:                                                      \
-      gbc_sound_render_##type(left, sample_length, envelope_op, sweep_op);    \
-      break;                                                                  \
+      case GBC_SOUND_LEFT:                                                    \
+        gbc_sound_render_##type(left, sample_length, envelope_op,             \
+         sweep_op);                                                           \
+        break;                                                                \
                                                                               \
-    case GBC_SOUND_RIGHT:                                                     \
-      gbc_sound_render_##type(right, sample_length, envelope_op, sweep_op);   \
-      break;                                                                  \
+      case GBC_SOUND_RIGHT:                                                   \
+        gbc_sound_render_##type(right, sample_length, envelope_op,            \
+         sweep_op);                                                           \
+        break;                                                                \
                                                                               \
-    case GBC_SOUND_LEFTRIGHT:                                                 \
-      gbc_sound_render_##type(both, sample_length, envelope_op, sweep_op);    \
-      break;                                                                  \
+      case GBC_SOUND_LEFTRIGHT:                                               \
+        gbc_sound_render_##type(both, sample_length, envelope_op,             \
+         sweep_op);                                                           \
+        break;                                                                \
+    }                                                                         \
+  }                                                                           \
+  else if(gs->status != GBC_SOUND_INACTIVE)                                   \
+  {                                                                           \
+    gbc_sound_skip_##type(sample_length, envelope_op, sweep_op);              \
   }                                                                           \
                                                                               \
   gs->sample_index = sample_index;                                            \
@@ -439,6 +584,7 @@ void update_gbc_sound(u32 cpu_ticks)
   fixed16_16 sample_index, frequency_step;
   fixed16_16 tick_counter;
   u32 buffer_index;
+  u32 samples_left;
   s32 volume_left, volume_right;
   u32 envelope_volume;
   s32 current_sample;
@@ -572,10 +718,16 @@ void reset_sound(void)
   gbc_sound_struct *gs = gbc_sound_channel;
   u32 i;
 
+  sync_audio_thread();
+
   sound_on = 0;
   sound_buffer_base = 0;
   sound_last_cpu_ticks = 0;
   memset(sound_buffer, 0, sizeof(sound_buffer));
+  direct_sound_log[0].sample_count = 0;
+  direct_sound_log[0].run_count = 0;
+  direct_sound_log[1].sample_count = 0;
+  direct_sound_log[1].run_count = 0;
 
   for(i = 0; i < 2; i++, ds++)
   {
@@ -620,6 +772,8 @@ void init_sound(int need_reset)
 #define sound_savestate_builder(type)                         \
 void sound_##type##_savestate(void)                           \
 {                                                             \
+  render_direct_sound();                                      \
+  sync_audio_thread();                                        \
   state_mem_##type##_variable(sound_on);                      \
   state_mem_##type##_variable(sound_buffer_base);             \
   state_mem_##type##_variable(sound_last_cpu_ticks);          \
@@ -644,32 +798,411 @@ static retro_audio_sample_batch_t audio_batch_cb;
 void retro_set_audio_sample(retro_audio_sample_t cb) { }
 void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) { audio_batch_cb = cb; }
 
-void render_audio(void)
+static void output_audio(s16 *samples, u32 frames)
+{
+#ifdef __LIBRETRO__
+   audio_batch_cb(samples, frames);
+#else
+   if (global_process_audio)
+     plat_sound_write(samples, frames * 4);
+#endif
+}
+
+// If the host wants a lower rate than sound_frequency the mixed audio is
+// resampled to it here, with a polyphase windowed sinc filter that also
+// cuts what would alias at the lower rate. Each output sample takes
+// RESAMPLE_TAPS input samples, weighted by the filter phase closest to
+// where it falls between them. With rate control the resampler also runs
+// at equal rates, so the frontend can stretch the output slightly to keep
+// its audio buffer from draining or filling up.
+
+#define RESAMPLE_TAPS       32
+#define RESAMPLE_PHASES     256
+#define RESAMPLE_FRAMES     256
+#define RESAMPLE_MAX_ADJUST 0.01f
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+u32 sound_output_frequency = GBA_SOUND_FREQUENCY;
+
+static u32 resample_enabled = 0;
+static u32 resample_requested_frequency = 0;
+static u32 resample_rate_control = 0;
+static fixed8_24 resample_step;
+
+// The rate control step changes every frame while the audio thread may be
+// resampling, so it's only read once per block.
+#ifdef HAVE_AUDIO_THREAD
+#define load_resample_step()                                                  \
+  __atomic_load_n(&resample_step, __ATOMIC_RELAXED)                           \
+
+#define store_resample_step(step)                                             \
+  __atomic_store_n(&resample_step, step, __ATOMIC_RELAXED)                    \
+
+#else
+#define load_resample_step() resample_step
+#define store_resample_step(step) resample_step = (step)
+#endif
+static u32 resample_fraction;
+static u32 resample_history_length;
+static s16 resample_kernel[RESAMPLE_PHASES][RESAMPLE_TAPS];
+static s16 resample_history[2][RESAMPLE_TAPS + RESAMPLE_FRAMES];
+
+static void init_resample_kernel(void)
 {
-   static s16 stream_base[512];
-   s16 *source;
+   // Blackman window, with the cutoff placed so that the transition band
+   // ends at the output's Nyquist frequency.
+   double cutoff = (0.5 * sound_output_frequency / sound_frequency) -
+    (2.75 / RESAMPLE_TAPS);
+   u32 phase, tap;
+
+   if (cutoff < 0.05)
+      cutoff = 0.05;
+
+   for (phase = 0; phase < RESAMPLE_PHASES; phase++)
+   {
+      double taps[RESAMPLE_TAPS];
+      double sum = 0.0;
+      s32 total = 0;
+
+      for (tap = 0; tap < RESAMPLE_TAPS; tap++)
+      {
+         double t = (double)tap - (RESAMPLE_TAPS / 2 - 1) -
+          ((double)phase / RESAMPLE_PHASES);
+         double x = 2.0 * M_PI * (t + RESAMPLE_TAPS / 2) / RESAMPLE_TAPS;
+         double value = 2.0 * cutoff;
+
+         if (t != 0.0)
+            value = sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+
+         taps[tap] = value * (0.42 - 0.5 * cos(x) + 0.08 * cos(2.0 * x));
+         sum += taps[tap];
+      }
+
+      // Each phase is normalized to unity gain (1.0 is 1 << 15).
+      for (tap = 0; tap < RESAMPLE_TAPS; tap++)
+      {
+         resample_kernel[phase][tap] = (s16)floor(taps[tap] * 32768.0 / sum
+          + 0.5);
+         total += resample_kernel[phase][tap];
+      }
+
+      resample_kernel[phase][RESAMPLE_TAPS / 2 - 1] += 32768 - total;
+   }
+}
+
+static void init_resampler(void)
+{
+   u32 frequency = resample_requested_frequency;
+
+   sync_audio_thread();
+
+   if ((frequency == 0) || (frequency > sound_frequency))
+      frequency = sound_frequency;
+
+   resample_enabled = (frequency < sound_frequency) || resample_rate_control;
+   sound_output_frequency = frequency;
+   resample_fraction = 0;
+   resample_history_length = 0;
+
+   if (resample_enabled)
+   {
+      store_resample_step(float_to_fp8_24((double)sound_frequency /
+       frequency));
+      init_resample_kernel();
+   }
+}
+
+void init_sound_output(u32 frequency)
+{
+   resample_requested_frequency = frequency;
+   init_resampler();
+}
+
+void init_sound_rate_control(u32 enable)
+{
+   if (resample_rate_control != enable)
+   {
+      resample_rate_control = enable;
+      init_resampler();
+   }
+}
+
+// Outputs (1 + adjust) times as many samples as the nominal rate, only
+// takes effect with rate control enabled.
+
+void adjust_sound_output_rate(float adjust)
+{
+   if (adjust > RESAMPLE_MAX_ADJUST)
+      adjust = RESAMPLE_MAX_ADJUST;
+   if (adjust < -RESAMPLE_MAX_ADJUST)
+      adjust = -RESAMPLE_MAX_ADJUST;
+
+   if (resample_rate_control)
+   {
+      store_resample_step(float_to_fp8_24((double)sound_frequency /
+       (sound_output_frequency * (1.0 + adjust))));
+   }
+}
+
+// Takes RESAMPLE_FRAMES stereo frames. The taps are kept deinterleaved so
+// the compiler can vectorize the dot products.
+
+static void resample_audio(const s16 *source)
+{
+   static s16 stream_resampled[(RESAMPLE_FRAMES * 2 + 1) * 2];
+   u32 length = resample_history_length;
+   u32 frames = 0;
+   u32 position = 0;
+   u32 fraction = resample_fraction;
+   fixed8_24 step = load_resample_step();
    u32 i;
 
-   while (((gbc_sound_buffer_index - sound_buffer_base) & BUFFER_SIZE_MASK) > 512)
+   for (i = 0; i < RESAMPLE_FRAMES; i++)
+   {
+      resample_history[0][length + i] = source[i * 2];
+      resample_history[1][length + i] = source[i * 2 + 1];
+   }
+   length += RESAMPLE_FRAMES;
+
+   while ((position + RESAMPLE_TAPS) <= length)
    {
-      source = (s16 *)(sound_buffer + sound_buffer_base);
-      for(i = 0; i < 512; i++)
+      const s16 *kernel = resample_kernel[fraction >> 16];
+      const s16 *left = resample_history[0] + position;
+      const s16 *right = resample_history[1] + position;
+      s32 left_sum = 0;
+      s32 right_sum = 0;
+
+      for (i = 0; i < RESAMPLE_TAPS; i++)
       {
-         s32 current_sample = source[i];
-         if(current_sample > 2047)
-            current_sample = 2047;
-         if(current_sample < -2048)
-            current_sample = -2048;
-         stream_base[i] = current_sample * 16;
-         source[i] = 0;
+         left_sum += left[i] * kernel[i];
+         right_sum += right[i] * kernel[i];
       }
-#ifdef __LIBRETRO__
-      audio_batch_cb(stream_base, 256);
-#else
-      if (global_process_audio)
-        plat_sound_write(stream_base, 1024);
+
+      left_sum >>= 15;
+      right_sum >>= 15;
+      if (left_sum > 32767)
+         left_sum = 32767;
+      if (left_sum < -32768)
+         left_sum = -32768;
+      if (right_sum > 32767)
+         right_sum = 32767;
+      if (right_sum < -32768)
+         right_sum = -32768;
+
+      stream_resampled[frames * 2] = left_sum;
+      stream_resampled[frames * 2 + 1] = right_sum;
+      frames++;
+
+      fraction += step;
+      position += fraction >> 24;
+      fraction = fp8_24_fractional_part(fraction);
+   }
+
+   // Keep what the next outputs still need.
+   length -= position;
+   memmove(resample_history[0], resample_history[0] + position,
+    length * sizeof(s16));
+   memmove(resample_history[1], resample_history[1] + position,
+    length * sizeof(s16));
+
+   resample_history_length = length;
+   resample_fraction = fraction;
+
+   if (frames)
+      output_audio(stream_resampled, frames);
+}
+
+// Clamps, scales and outputs the 512 samples at sound_buffer_base, and
+// clears them for the next time around the buffer.
+
+static void output_sound_buffer(void)
+{
+   static s16 stream_base[RESAMPLE_FRAMES * 2];
+   s16 *source = (s16 *)(sound_buffer + sound_buffer_base);
+   u32 i;
+
+   for(i = 0; i < 512; i++)
+   {
+      s32 current_sample = source[i];
+      if(current_sample > 2047)
+         current_sample = 2047;
+      if(current_sample < -2048)
+         current_sample = -2048;
+      stream_base[i] = current_sample * 16;
+      source[i] = 0;
+   }
+
+   if (resample_enabled)
+      resample_audio(stream_base);
+   else
+      output_audio(stream_base, RESAMPLE_FRAMES);
+}
+
+#define sound_buffer_pending(end)                                             \
+   (((end) - sound_buffer_base) & BUFFER_SIZE_MASK)                           \
+
+#ifdef HAVE_AUDIO_THREAD
+
+#include <pthread.h>
+
+// The audio thread outputs the samples up to audio_thread_write, which
+// render_audio() sets once the frame's samples are mixed. Only the audio
+// thread moves sound_buffer_base while it runs, and it only touches
+// samples behind audio_thread_write, which the emulation doesn't mix
+// into anymore. If the thread falls AUDIO_THREAD_MAX_PENDING samples
+// behind (usually because the backend is full) render_audio() waits for
+// it, which keeps the emulation paced by the audio output as before.
+
+#define AUDIO_THREAD_MAX_PENDING 4096
+
+static u32 audio_thread_running = 0;
+static u32 audio_thread_quit = 0;
+static u32 audio_thread_paused = 0;
+static u32 audio_thread_busy = 0;
+static u32 audio_thread_write;
+static pthread_t audio_thread;
+static pthread_mutex_t audio_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t audio_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t audio_done_cond = PTHREAD_COND_INITIALIZER;
+
+static void *audio_thread_function(void *unused)
+{
+   pthread_mutex_lock(&audio_mutex);
+
+   while (1)
+   {
+      while (!audio_thread_quit && (audio_thread_paused ||
+       (sound_buffer_pending(audio_thread_write) <= 512)))
+      {
+         audio_thread_busy = 0;
+         pthread_cond_broadcast(&audio_done_cond);
+         pthread_cond_wait(&audio_work_cond, &audio_mutex);
+      }
+
+      if (audio_thread_quit)
+         break;
+
+      audio_thread_busy = 1;
+      pthread_mutex_unlock(&audio_mutex);
+
+      output_sound_buffer();
+
+      pthread_mutex_lock(&audio_mutex);
+      sound_buffer_base = (sound_buffer_base + 512) & BUFFER_SIZE_MASK;
+      pthread_cond_broadcast(&audio_done_cond);
+   }
+
+   audio_thread_busy = 0;
+   pthread_mutex_unlock(&audio_mutex);
+   return NULL;
+}
+
+// Waits for the audio thread to output what it has and keeps it stopped
+// until the next render_audio(), so the sound state can be changed.
+
+static void sync_audio_thread(void)
+{
+   if (!audio_thread_running)
+      return;
+
+   pthread_mutex_lock(&audio_mutex);
+   audio_thread_paused = 1;
+   while (audio_thread_busy)
+      pthread_cond_wait(&audio_done_cond, &audio_mutex);
+   pthread_mutex_unlock(&audio_mutex);
+}
+
+static void submit_audio_thread(void)
+{
+   pthread_mutex_lock(&audio_mutex);
+   audio_thread_write = gbc_sound_buffer_index;
+   audio_thread_paused = 0;
+   pthread_cond_signal(&audio_work_cond);
+
+   while (sound_buffer_pending(audio_thread_write) > AUDIO_THREAD_MAX_PENDING)
+      pthread_cond_wait(&audio_done_cond, &audio_mutex);
+   pthread_mutex_unlock(&audio_mutex);
+}
+
+void init_audio_thread(u32 enable)
+{
+   if (enable == audio_thread_running)
+      return;
+
+   if (audio_thread_running)
+   {
+      pthread_mutex_lock(&audio_mutex);
+      audio_thread_quit = 1;
+      pthread_cond_signal(&audio_work_cond);
+      pthread_mutex_unlock(&audio_mutex);
+      pthread_join(audio_thread, NULL);
+      audio_thread_running = 0;
+      return;
+   }
+
+   audio_thread_quit = 0;
+   audio_thread_paused = 1;
+   if (pthread_create(&audio_thread, NULL, audio_thread_function, NULL))
+      return;
+
+   audio_thread_running = 1;
+}
+
+#endif
+
+// With audio processing off nothing is mixed, so the pending samples
+// (all silence but what was mixed before it got turned off) are dropped
+// and the Direct Sound channels put back in step with the GBC ones.
+
+static void skip_audio(void)
+{
+   u32 pending = sound_buffer_pending(gbc_sound_buffer_index);
+   u32 ahead = 0;
+   u32 i;
+
+   sync_audio_thread();
+
+   // A running Direct Sound channel can be mixed slightly past the GBC
+   // channels, a stopped one is left behind and resynced when it starts.
+   for (i = 0; i < 2; i++)
+   {
+      u32 channel_ahead = (direct_sound_channel[i].buffer_index -
+       gbc_sound_buffer_index) & BUFFER_SIZE_MASK;
+      if ((channel_ahead < (BUFFER_SIZE / 2)) && (channel_ahead > ahead))
+         ahead = channel_ahead;
+      direct_sound_channel[i].buffer_index = gbc_sound_buffer_index;
+   }
+
+   for (i = 0; i < pending + ahead; i++)
+      sound_buffer[(sound_buffer_base + i) & BUFFER_SIZE_MASK] = 0;
+
+   sound_buffer_base = gbc_sound_buffer_index;
+}
+
+void render_audio(void)
+{
+   render_direct_sound();
+
+   if (!global_process_audio)
+   {
+      skip_audio();
+      return;
+   }
+
+#ifdef HAVE_AUDIO_THREAD
+   if (audio_thread_running)
+   {
+      submit_audio_thread();
+      return;
+   }
 #endif
-      sound_buffer_base += 512;
-      sound_buffer_base &= BUFFER_SIZE_MASK;
+
+   while (sound_buffer_pending(gbc_sound_buffer_index) > 512)
+   {
+      output_sound_buffer();
+      sound_buffer_base = (sound_buffer_base + 512) & BUFFER_SIZE_MASK;
    }
 }
@@ -112,6 +112,7 @@ extern u32 gbc_sound_buffer_index;
 extern u32 gbc_sound_last_cpu_ticks;
 
 extern u32 sound_frequency;
+extern u32 sound_output_frequency;
 extern u32 sound_on;
 
 extern u32 global_enable_audio;
@@ -128,8 +129,16 @@ void init_sound(int need_reset);
 void sound_write_savestate(void);
 void sound_read_savestate(void);
 
+void init_sound_output(u32 frequency);
+void init_sound_rate_control(u32 enable);
+void adjust_sound_output_rate(float adjust);
+void render_direct_sound(void);
 void render_audio(void);
 
+#ifdef HAVE_AUDIO_THREAD
+void init_audio_thread(u32 enable);
+#endif
+
 void reset_sound(void);
 
 #endif
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "frontend/scale_kernels.h"
+
+/* Times the frontend's smooth scalers with the plain C kernels and the
+ * ones picked for this CPU, and checks that both give the same output.
+ * Run on the target device, e.g. './bench_scale 2000'. */
+
+#define SRC_SIZE (240 * 160)
+#define DST_SIZE (320 * 240)
+
+typedef void (*scaler_t)(const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h);
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(scaler_t scaler, const scale_kernels_t *kernels,
+    uint16_t *dst, const uint16_t *src, int h, int frames)
+{
+  double start = now();
+  int i;
+
+  for (i = 0; i < frames; i++)
+    scaler(kernels, dst, src, h);
+
+  return (now() - start) * 1e6 / frames;
+}
+
+int main(int argc, char **argv)
+{
+  static const struct {
+    const char *name;
+    scaler_t scaler;
+    int h;
+  } tests[] = {
+    { "smooth full",   gba_smooth_upscale,       240 },
+    { "smooth aspect", gba_smooth_upscale,       214 },
+    { "sharp full",    gba_smooth_subpx_upscale, 240 },
+    { "sharp aspect",  gba_smooth_subpx_upscale, 214 },
+  };
+  int frames = (argc > 1) ? atoi(argv[1]) : 1000;
+  uint16_t *src = malloc(SRC_SIZE * sizeof(uint16_t));
+  uint16_t *dst_c = calloc(DST_SIZE, sizeof(uint16_t));
+  uint16_t *dst = calloc(DST_SIZE, sizeof(uint16_t));
+  int failed = 0;
+  unsigned i;
+
+  if (!src || !dst_c || !dst || frames <= 0)
+    return 1;
+
+  /* Noise for the exactness check, with some runs of equal pixels as in
+   * real frames */
+  srand(1);
+  for (i = 0; i < SRC_SIZE; i++)
+    src[i] = ((i % 7) < 3 && i) ? src[i - 1] : (rand() & 0xFFFF);
+
+  printf("%d frames, kernels: %s\n", frames, scale_kernels->name);
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    double time_c, time;
+    int same;
+
+    tests[i].scaler(&scale_kernels_c, dst_c, src, tests[i].h);
+    tests[i].scaler(scale_kernels, dst, src, tests[i].h);
+    same = !memcmp(dst_c, dst, DST_SIZE * sizeof(uint16_t));
+    failed |= !same;
+
+    time_c = bench(tests[i].scaler, &scale_kernels_c, dst, src,
+        tests[i].h, frames);
+    time = bench(tests[i].scaler, scale_kernels, dst, src,
+        tests[i].h, frames);
+
+    printf("%-14s c %8.1f us  %-5s %8.1f us  %5.2fx  %s\n",
+        tests[i].name, time_c, scale_kernels->name, time, time_c / time,
+        same ? "ok" : "MISMATCH");
+  }
+
+  free(src);
+  free(dst_c);
+  free(dst);
+  return failed;
+}
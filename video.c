@@ -18,11 +18,93 @@
  */
 
 #include "common.h"
+#include "gba_cc_lut.h"
+
+#ifdef ARM_ARCH_NEON_RENDERERS
+#include "arm/video_neon.h"
+#endif
 
 u16* gba_screen_pixels = NULL;
 
-#define get_screen_pixels()   gba_screen_pixels
-#define get_screen_pitch()    GBA_SCREEN_PITCH
+// Set by frontends that have the lines drawn straight into their
+// framebuffer instead (see video_set_screen_target).
+static u16 *screen_target = NULL;
+static u32 screen_target_pitch = GBA_SCREEN_PITCH;
+
+#define get_screen_pixels()                                                   \
+  (screen_target ? screen_target : gba_screen_pixels)                         \
+
+#define get_screen_pitch()    screen_target_pitch
+
+// With color correction on palette_ram_corrected holds the corrected
+// palette_ram_converted colors (see update_palette_correction). Pixels
+// written straight from the palette are taken from it, mode 3/5 pixels are
+// corrected as they are converted. Color effects are applied to the colors
+// as they are and corrected afterwards, as the output would be.
+
+static u32 color_correction = 0;
+static u16 palette_ram_corrected[512];
+
+#define correct_color(color)                                                  \
+  gba_cc_lut[(((color) & 0xFFC0) >> 1) | ((color) & 0x1F)]                    \
+
+#define palette_ram_output                                                    \
+  (color_correction ? palette_ram_corrected : palette_ram_converted)          \
+
+#define PALETTE_ROW_COLORS ((1 << PALETTE_DIRTY_SHIFT) / sizeof(u16))
+
+static void correct_palette(u16 *dest, const u16 *source, u32 first,
+ u32 count)
+{
+  u32 i;
+
+  for(i = first; i < first + count; i++)
+    dest[i] = correct_color(source[i]);
+}
+
+#ifdef HAVE_RENDER_THREAD
+
+// The ARM blending routines read io_registers/palette_ram_converted
+// directly, which the render thread must not do.
+#undef ARM_ARCH_BLENDING_OPTS
+
+// Everything up to update_scanline() reads the display state through these.
+// They point to the live state when rendering is done inline and to the
+// render thread's copies while it's running. The registers and affine
+// references are per thread since band workers draw different lines at
+// once.
+
+#define render_local __thread
+
+static u16 render_thread_io_registers[0x58 / 2];
+// Tile fetches with 8bpp/extended char bases can run past the end of VRAM,
+// which for the live copy lands in the neighbouring globals.
+static u8 render_thread_vram[1024 * 128];
+static u16 render_thread_palette[512];
+static u16 render_thread_palette_corrected[512];
+static u16 render_thread_oam[512];
+static s32 render_thread_affine_x[2];
+static s32 render_thread_affine_y[2];
+
+static render_local u16 *render_io_registers = io_registers;
+static u8 *render_vram = vram;
+static u16 *render_palette_ram_converted = palette_ram_converted;
+static u16 *render_palette_ram_corrected = palette_ram_corrected;
+static u16 *render_oam_ram = oam_ram;
+static render_local s32 *render_affine_reference_x = affine_reference_x;
+static render_local s32 *render_affine_reference_y = affine_reference_y;
+
+#define io_registers render_io_registers
+#define vram render_vram
+#define palette_ram_converted render_palette_ram_converted
+#define palette_ram_corrected render_palette_ram_corrected
+#define oam_ram render_oam_ram
+
+#else
+
+#define render_local
+
+#endif
 
 static void render_scanline_conditional_tile(u32 start, u32 end, u16 *scanline,
  u32 enable_flags, u32 dispcnt, u32 bldcnt, const tile_layer_render_struct
@@ -31,6 +113,58 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
  u32 enable_flags, u32 dispcnt, u32 bldcnt, const bitmap_layer_render_struct
  *layer_renderers);
 
+// 4bpp tiles decoded to one palette index per byte. The layout follows VRAM
+// with every 4 byte row expanded to 8 bytes, so a 4bpp tile pointer maps to
+// the cache by doubling its offset. The second copy holds every row
+// horizontally flipped. It covers more than VRAM for OBJ fetches that run
+// past the end of it.
+
+#define TILE_CACHE_SIZE  (1024 * 128 * 2)
+
+static u8 tile_cache_4bpp[2][TILE_CACHE_SIZE] __attribute__((aligned(8)));
+
+#define tile_cache_row(flip, tile_ptr)                                        \
+  (tile_cache_4bpp[flip] + (((tile_ptr) - vram) * 2))                         \
+
+static void update_tile_cache_page(u32 page)
+{
+  u8 *src = vram + (page << VRAM_DIRTY_SHIFT);
+  u8 *dest = tile_cache_4bpp[0] + (page << (VRAM_DIRTY_SHIFT + 1));
+  u8 *dest_flip = tile_cache_4bpp[1] + (page << (VRAM_DIRTY_SHIFT + 1));
+  u32 i, j;
+
+  for(i = 0; i < (1 << VRAM_DIRTY_SHIFT) / 4; i++)
+  {
+    for(j = 0; j < 4; j++)
+    {
+      dest[j * 2] = src[j] & 0x0F;
+      dest[(j * 2) + 1] = src[j] >> 4;
+      dest_flip[7 - (j * 2)] = src[j] & 0x0F;
+      dest_flip[6 - (j * 2)] = src[j] >> 4;
+    }
+
+    src += 4;
+    dest += 8;
+    dest_flip += 8;
+  }
+}
+
+// Redecodes the pages written to since the last call.
+
+static void update_tile_cache(void)
+{
+  u32 page;
+
+  for(page = 0; page < VRAM_DIRTY_PAGES; page++)
+  {
+    if(vram_dirty[page] & DIRTY_CLIENT_TILE_CACHE)
+    {
+      update_tile_cache_page(page);
+      vram_dirty[page] &= ~DIRTY_CLIENT_TILE_CACHE;
+    }
+  }
+}
+
 #define tile_expand_base_normal(index)                                        \
   current_pixel = palette[current_pixel];                                     \
   dest_ptr[index] = current_pixel                                             \
@@ -362,13 +496,14 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
   tile_8bpp_draw_four_##combine_op(4, alpha_op, flip)                         \
 
 
-// Operations for isolating 4bpp tiles in a 32bit block
+// 4bpp tiles are drawn from the tile cache, where every pixel is a byte.
+// These isolate them in 32bit blocks of four.
 
 #define tile_4bpp_pixel_op_mask(op_param)                                     \
-  current_pixel = current_pixels & 0x0F                                       \
+  current_pixel = current_pixels & 0xFF                                       \
 
 #define tile_4bpp_pixel_op_shift_mask(shift)                                  \
-  current_pixel = (current_pixels >> shift) & 0x0F                            \
+  current_pixel = (current_pixels >> shift) & 0xFF                            \
 
 #define tile_4bpp_pixel_op_shift(shift)                                       \
   current_pixel = current_pixels >> shift                                     \
@@ -429,95 +564,31 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
   }                                                                           \
 
 
-// Draws eight background pixels in transparent mode, for alpha or normal
-// renderers.
-
-#define tile_4bpp_draw_eight_base_zero(value)                                 \
-  dest_ptr[0] = value;                                                        \
-  dest_ptr[1] = value;                                                        \
-  dest_ptr[2] = value;                                                        \
-  dest_ptr[3] = value;                                                        \
-  dest_ptr[4] = value;                                                        \
-  dest_ptr[5] = value;                                                        \
-  dest_ptr[6] = value;                                                        \
-  dest_ptr[7] = value                                                         \
-
-
-// Draws eight background pixels for the alpha renderer, basically color zero
-// with the background flag high.
-
-#define tile_4bpp_draw_eight_base_zero_alpha()                                \
-  tile_4bpp_draw_eight_base_zero(bg_combine)                                  \
-
-#define tile_4bpp_draw_eight_base_zero_color16()                              \
-  tile_4bpp_draw_eight_base_zero_alpha()                                      \
-
-#define tile_4bpp_draw_eight_base_zero_color32()                              \
-  tile_4bpp_draw_eight_base_zero_alpha()                                      \
-
-
-// Draws eight background pixels for the normal renderer, just a bunch of
-// zeros.
-
-#define tile_4bpp_draw_eight_base_zero_normal()                               \
-  current_pixel = palette[0];                                                 \
-  tile_4bpp_draw_eight_base_zero(current_pixel)                               \
-
-
-// Draws eight 4bpp pixels.
-
-#define tile_4bpp_draw_eight_noflip(combine_op, alpha_op)                     \
-  tile_4bpp_draw_##combine_op(0, mask, 0, alpha_op);                          \
-  tile_4bpp_draw_##combine_op(1, shift_mask, 4, alpha_op);                    \
-  tile_4bpp_draw_##combine_op(2, shift_mask, 8, alpha_op);                    \
-  tile_4bpp_draw_##combine_op(3, shift_mask, 12, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(4, shift_mask, 16, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(5, shift_mask, 20, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(6, shift_mask, 24, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(7, shift, 28, alpha_op)                         \
-
-
-// Draws eight 4bpp pixels in reverse order (for hflip).
-
-#define tile_4bpp_draw_eight_flip(combine_op, alpha_op)                       \
-  tile_4bpp_draw_##combine_op(7, mask, 0, alpha_op);                          \
-  tile_4bpp_draw_##combine_op(6, shift_mask, 4, alpha_op);                    \
-  tile_4bpp_draw_##combine_op(5, shift_mask, 8, alpha_op);                    \
-  tile_4bpp_draw_##combine_op(4, shift_mask, 12, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(3, shift_mask, 16, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(2, shift_mask, 20, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(1, shift_mask, 24, alpha_op);                   \
-  tile_4bpp_draw_##combine_op(0, shift, 28, alpha_op)                         \
+// Draws four 4bpp pixels.
 
+#define tile_4bpp_draw_four(index, combine_op, alpha_op)                      \
+  tile_4bpp_draw_##combine_op(index + 0, mask, 0, alpha_op);                  \
+  tile_4bpp_draw_##combine_op(index + 1, shift_mask, 8, alpha_op);            \
+  tile_4bpp_draw_##combine_op(index + 2, shift_mask, 16, alpha_op);           \
+  tile_4bpp_draw_##combine_op(index + 3, shift, 24, alpha_op)                 \
 
-// Draws eight 4bpp pixels in base mode, checks if all are zero, if so draws
-// the appropriate background pixels.
+#define tile_4bpp_draw_four_base(index, alpha_op)                             \
+  tile_4bpp_draw_four(index, base, alpha_op)                                  \
 
-#define tile_4bpp_draw_eight_base(alpha_op, flip_op)                          \
-  if(current_pixels != 0)                                                     \
-  {                                                                           \
-    tile_4bpp_draw_eight_##flip_op(base, alpha_op);                           \
-  }                                                                           \
-  else                                                                        \
-  {                                                                           \
-    tile_4bpp_draw_eight_base_zero_##alpha_op();                              \
-  }                                                                           \
 
-
-// Draws eight 4bpp pixels in transparent (layered) mode, checks if all are
+// Draws four 4bpp pixels in transparent (layered) mode, checks if all are
 // zero and if so draws nothing.
 
-#define tile_4bpp_draw_eight_transparent(alpha_op, flip_op)                   \
+#define tile_4bpp_draw_four_transparent(index, alpha_op)                      \
   if(current_pixels != 0)                                                     \
   {                                                                           \
-    tile_4bpp_draw_eight_##flip_op(transparent, alpha_op);                    \
+    tile_4bpp_draw_four(index, transparent, alpha_op);                        \
   }                                                                           \
 
-
-#define tile_4bpp_draw_eight_copy(alpha_op, flip_op)                          \
+#define tile_4bpp_draw_four_copy(index, alpha_op)                             \
   if(current_pixels != 0)                                                     \
   {                                                                           \
-    tile_4bpp_draw_eight_##flip_op(copy, alpha_op);                           \
+    tile_4bpp_draw_four(index, copy, alpha_op);                               \
   }                                                                           \
 
 // Gets the current tile in 4bpp mode, also getting the current palette and
@@ -529,15 +600,21 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
   tile_ptr = tile_base + ((current_tile & 0x3FF) * 32);                       \
 
 
-// Helper macro for drawing clipped 4bpp tiles.
+// Helper macro for drawing clipped 4bpp tiles, starting offset pixels into
+// the row. Flipped tiles use the flipped copy of the row, so they're drawn
+// the same way.
 
-#define partial_tile_4bpp(combine_op, alpha_op)                               \
+#define partial_tile_4bpp(flip, offset, combine_op, alpha_op)                 \
+{                                                                             \
+  u8 *tile_row = tile_cache_row(flip, tile_ptr) + (offset);                   \
+                                                                              \
   for(i = 0; i < partial_tile_run; i++)                                       \
   {                                                                           \
-    tile_4bpp_draw_##combine_op(0, mask, 0, alpha_op);                        \
-    current_pixels >>= 4;                                                     \
+    current_pixel = tile_row[i];                                              \
+    tile_4bpp_draw_##combine_op(0, none, 0, alpha_op);                        \
     advance_dest_ptr_##combine_op(1);                                         \
   }                                                                           \
+}                                                                             \
 
 
 // Draws a 4bpp tile clipped against the left edge of the screen.
@@ -545,8 +622,7 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
 // how many to draw.
 
 #define partial_tile_right_noflip_4bpp(combine_op, alpha_op)                  \
-  current_pixels = eswap32(*((u32 *)tile_ptr)) >> (partial_tile_offset * 4);  \
-  partial_tile_4bpp(combine_op, alpha_op)                                     \
+  partial_tile_4bpp(0, partial_tile_offset, combine_op, alpha_op)             \
 
 
 // Draws a 4bpp tile clipped against both edges of the screen, same as right.
@@ -559,40 +635,38 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
 // partial_tile_offset is how many to draw.
 
 #define partial_tile_left_noflip_4bpp(combine_op, alpha_op)                   \
-  current_pixels = eswap32(*((u32 *)tile_ptr));                               \
-  partial_tile_4bpp(combine_op, alpha_op)                                     \
+  partial_tile_4bpp(0, 0, combine_op, alpha_op)                               \
 
 
 // Draws a complete 4bpp tile row (not clipped)
+
+#define tile_4bpp(flip, combine_op, alpha_op)                                 \
+{                                                                             \
+  u32 *tile_row = (u32 *)tile_cache_row(flip, tile_ptr);                      \
+                                                                              \
+  current_pixels = eswap32(tile_row[0]);                                      \
+  tile_4bpp_draw_four_##combine_op(0, alpha_op);                              \
+  current_pixels = eswap32(tile_row[1]);                                      \
+  tile_4bpp_draw_four_##combine_op(4, alpha_op);                              \
+}                                                                             \
+
 #define tile_noflip_4bpp(combine_op, alpha_op)                                \
-  current_pixels = eswap32(*((u32 *)tile_ptr));                               \
-  tile_4bpp_draw_eight_##combine_op(alpha_op, noflip)                         \
+  tile_4bpp(0, combine_op, alpha_op)                                          \
 
 
 // Like the above, but draws flipped tiles.
 
-#define partial_tile_flip_4bpp(combine_op, alpha_op)                          \
-  for(i = 0; i < partial_tile_run; i++)                                       \
-  {                                                                           \
-    tile_4bpp_draw_##combine_op(0, shift, 28, alpha_op);                      \
-    current_pixels <<= 4;                                                     \
-    advance_dest_ptr_##combine_op(1);                                         \
-  }                                                                           \
-
 #define partial_tile_right_flip_4bpp(combine_op, alpha_op)                    \
-  current_pixels = eswap32(*((u32 *)tile_ptr)) << (partial_tile_offset * 4);  \
-  partial_tile_flip_4bpp(combine_op, alpha_op)                                \
+  partial_tile_4bpp(1, partial_tile_offset, combine_op, alpha_op)             \
 
 #define partial_tile_mid_flip_4bpp(combine_op, alpha_op)                      \
   partial_tile_right_flip_4bpp(combine_op, alpha_op)                          \
 
 #define partial_tile_left_flip_4bpp(combine_op, alpha_op)                     \
-  current_pixels = eswap32(*((u32 *)tile_ptr));                               \
-  partial_tile_flip_4bpp(combine_op, alpha_op)                                \
+  partial_tile_4bpp(1, 0, combine_op, alpha_op)                               \
 
 #define tile_flip_4bpp(combine_op, alpha_op)                                  \
-  current_pixels = eswap32(*((u32 *)tile_ptr));                               \
-  tile_4bpp_draw_eight_##combine_op(alpha_op, flip)                           \
+  tile_4bpp(1, combine_op, alpha_op)                                          \
 
 
 // Draws a single (partial or complete) tile from the tilemap, flipping
@@ -814,7 +888,7 @@ static void render_scanline_conditional_bitmap(u32 start, u32 end, u16 *scanline
 
 
 #define render_scanline_extra_variables_base_normal(bg_type)                  \
-  u16 *palette = palette_ram_converted                                        \
+  u16 *palette = palette_ram_output                                           \
 
 
 #define render_scanline_extra_variables_base_alpha(bg_type)                   \
@@ -2336,8 +2410,13 @@ static void render_scanline_text_transparent_alpha(u32 layer,
 s32 affine_reference_x[2];
 s32 affine_reference_y[2];
 
+#ifdef HAVE_RENDER_THREAD
+#define affine_reference_x render_affine_reference_x
+#define affine_reference_y render_affine_reference_y
+#endif
+
 #define affine_render_bg_pixel_normal()                                       \
-  current_pixel = palette_ram_converted[0]                                    \
+  current_pixel = palette_ram_output[0]                                       \
 
 #define affine_render_bg_pixel_alpha()                                        \
   current_pixel = bg_combine                                                  \
@@ -2566,6 +2645,8 @@ render_scanline_affine_builder(transparent, alpha);
 
 #define bitmap_render_pixel_mode3(alpha_op)                                   \
   convert_palette(current_pixel);                                             \
+  if(color_correction)                                                        \
+    current_pixel = correct_color(current_pixel);                             \
   *dest_ptr = current_pixel                                                   \
 
 #define bitmap_render_pixel_mode4(alpha_op)                                   \
@@ -2676,7 +2757,7 @@ render_scanline_affine_builder(transparent, alpha);
 
 
 #define render_scanline_vram_setup_mode4()                                    \
-  u16 *palette = palette_ram_converted;                                       \
+  u16 *palette = palette_ram_output;                                          \
   u8 *src_ptr = vram;                                                         \
   if(read_ioreg(REG_DISPCNT) & 0x10)                                          \
     src_ptr = vram + 0xA000;                                                  \
@@ -2725,6 +2806,182 @@ render_scanline_bitmap_builder(mode4, normal, 240, 160);
 render_scanline_bitmap_builder(mode5, normal, 160, 128);
 
 
+#ifdef ARM_ARCH_NEON_RENDERERS
+
+// Text layers for NEON: the visible part of the line is expanded into
+// palette indices a whole tile row at a time, starting at the tile the line
+// begins in. Returns where the first pixel ended up in line, which needs
+// room for 31 tiles.
+
+static u16 *render_scanline_text_indices(u32 layer, u32 start, u32 end,
+ u16 *line)
+{
+  u32 bg_control = read_ioreg(REG_BG0CNT + layer);
+  u32 map_size = (bg_control >> 14) & 0x03;
+  u32 map_width = map_widths[map_size];
+  u32 horizontal_offset =
+   (read_ioreg(REG_BG0HOFS + (layer * 2)) + start) % 512;
+  u32 vertical_offset = (read_ioreg(REG_VCOUNT) +
+   read_ioreg(REG_BG0VOFS + (layer * 2))) % 512;
+  u32 tile_x = horizontal_offset / 8;
+  u32 tile_count = ((horizontal_offset % 8) + (end - start) + 7) / 8;
+  u32 pixel_row = vertical_offset % 8;
+  u16 *map_base = (u16 *)(vram + ((bg_control >> 8) & 0x1F) * (1024 * 2));
+  u16 *map_ptr;
+  u8 *tile_base = vram + (((bg_control >> 2) & 0x03) * (1024 * 16));
+  u16 *dest_ptr = line;
+  u32 i;
+
+  if((map_size & 0x02) && (vertical_offset >= 256))
+  {
+    map_base += ((map_width / 8) * 32) +
+     (((vertical_offset - 256) / 8) * 32);
+  }
+  else
+  {
+    map_base += (((vertical_offset % 256) / 8) * 32);
+  }
+
+  for(i = 0; i < tile_count; i++, tile_x++)
+  {
+    u32 current_tile;
+    u32 tile_row = pixel_row;
+
+    // 512 wide maps continue in the next screen block, wrapping at 64 tiles.
+    if(map_size & 0x01)
+      map_ptr = map_base + ((tile_x & 0x20) * 32) + (tile_x & 0x1F);
+    else
+      map_ptr = map_base + (tile_x & 0x1F);
+
+    current_tile = eswap16(*map_ptr);
+
+    if(current_tile & 0x800)
+      tile_row = 7 - tile_row;
+
+    if(bg_control & 0x80)
+    {
+      neon_tile_row_8bpp(dest_ptr, tile_base + ((current_tile & 0x3FF) * 64) +
+       (tile_row * 8), current_tile & 0x400);
+    }
+    else
+    {
+      neon_tile_row_4bpp(dest_ptr, tile_cache_row((current_tile >> 10) & 0x01,
+       tile_base + ((current_tile & 0x3FF) * 32) + (tile_row * 4)),
+       (current_tile >> 12) << 4);
+    }
+
+    dest_ptr += 8;
+  }
+
+  return line + (horizontal_offset % 8);
+}
+
+#define neon_compose_args_normal(combine_op)                                  \
+  palette                                                                     \
+
+#define neon_compose_args_alpha(combine_op)                                   \
+  neon_compose_args_##combine_op##_color()                                    \
+
+#define neon_compose_args_color16(combine_op)                                 \
+  neon_compose_args_##combine_op##_color()                                    \
+
+#define neon_compose_args_color32(combine_op)                                 \
+  neon_compose_args_##combine_op##_color()                                    \
+
+#define neon_compose_args_base_color()                                        \
+  pixel_combine, bg_combine                                                   \
+
+#define neon_compose_args_transparent_color()                                 \
+  pixel_combine                                                               \
+
+#define render_scanline_text_neon_builder(combine_op, alpha_op)               \
+static void render_scanline_text_neon_##combine_op##_##alpha_op(u32 layer,    \
+ u32 start, u32 end, void *scanline)                                          \
+{                                                                             \
+  render_scanline_extra_variables_##combine_op##_##alpha_op(text_neon);       \
+  u16 line[31 * 8];                                                           \
+  u16 *src_ptr = render_scanline_text_indices(layer, start, end, line);       \
+                                                                              \
+  neon_compose_##combine_op##_##alpha_op(                                     \
+   ((render_scanline_dest_##alpha_op *)scanline) + start, src_ptr,            \
+   end - start, neon_compose_args_##alpha_op(combine_op));                    \
+}                                                                             \
+
+render_scanline_text_neon_builder(base, normal);
+render_scanline_text_neon_builder(transparent, normal);
+render_scanline_text_neon_builder(base, color16);
+render_scanline_text_neon_builder(transparent, color16);
+render_scanline_text_neon_builder(base, color32);
+render_scanline_text_neon_builder(transparent, color32);
+render_scanline_text_neon_builder(base, alpha);
+render_scanline_text_neon_builder(transparent, alpha);
+
+
+// Unscaled bitmap lines are converted as whole rows, anything else goes to
+// the C renderers.
+
+#define render_scanline_bitmap_row_mode3(dest, src, count)                    \
+  neon_bitmap_row_16bpp(dest, src, count)                                     \
+
+#define render_scanline_bitmap_row_mode5(dest, src, count)                    \
+  neon_bitmap_row_16bpp(dest, src, count)                                     \
+
+#define render_scanline_bitmap_row_mode4(dest, src, count)                    \
+  neon_bitmap_row_8bpp(dest, src, count, palette)                             \
+
+// Corrected direct colors go through the lookup table a pixel at a time.
+#define render_scanline_bitmap_neon_mode3()  !color_correction
+#define render_scanline_bitmap_neon_mode4()  1
+#define render_scanline_bitmap_neon_mode5()  !color_correction
+
+#define render_scanline_bitmap_neon_builder(type, width, height)              \
+static void render_scanline_bitmap_##type##_neon(u32 start, u32 end,          \
+ void *scanline)                                                              \
+{                                                                             \
+  s32 dx = (s16)read_ioreg(REG_BG2PA);                                        \
+  s32 dy = (s16)read_ioreg(REG_BG2PC);                                        \
+  s32 pixel_x, pixel_y;                                                       \
+  s32 count = end - start;                                                    \
+  u16 *dest_ptr = ((u16 *)scanline) + start;                                  \
+                                                                              \
+  if((dx != 0x100) || (dy != 0) || !render_scanline_bitmap_neon_##type())    \
+  {                                                                           \
+    render_scanline_bitmap_##type##_normal(start, end, scanline);             \
+    return;                                                                   \
+  }                                                                           \
+                                                                              \
+  pixel_x = (affine_reference_x[0] >> 8) + start;                             \
+  pixel_y = affine_reference_y[0] >> 8;                                       \
+                                                                              \
+  if((u32)pixel_y < (u32)height)                                              \
+  {                                                                           \
+    render_scanline_vram_setup_##type();                                      \
+                                                                              \
+    if(pixel_x < 0)                                                           \
+    {                                                                         \
+      count += pixel_x;                                                       \
+      dest_ptr -= pixel_x;                                                    \
+      pixel_x = 0;                                                            \
+    }                                                                         \
+                                                                              \
+    if((pixel_x + count) > width)                                             \
+      count = width - pixel_x;                                                \
+                                                                              \
+    if(count > 0)                                                             \
+    {                                                                         \
+      render_scanline_bitmap_row_##type(dest_ptr,                             \
+       src_ptr + (pixel_y * width) + pixel_x, count);                         \
+    }                                                                         \
+  }                                                                           \
+}                                                                             \
+
+render_scanline_bitmap_neon_builder(mode3, 240, 160);
+render_scanline_bitmap_neon_builder(mode4, 240, 160);
+render_scanline_bitmap_neon_builder(mode5, 160, 128);
+
+#endif
+
+
 // Fill in the renderers for a layer based on the mode type,
 
 #define tile_layer_render_functions(type)                                     \
@@ -2777,14 +3034,59 @@ static const bitmap_layer_render_struct bitmap_mode_renderers[3] =
   bitmap_layer_render_functions(mode5)
 };
 
+#ifdef ARM_ARCH_NEON_RENDERERS
+
+static const tile_layer_render_struct tile_mode_renderers_neon[3][4] =
+{
+  {
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(text_neon)
+  },
+  {
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(affine), tile_layer_render_functions(text_neon)
+  },
+  {
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(text_neon),
+    tile_layer_render_functions(affine), tile_layer_render_functions(affine)
+  }
+};
+
+static const bitmap_layer_render_struct bitmap_mode_renderers_neon[3] =
+{
+  { render_scanline_bitmap_mode3_neon },
+  { render_scanline_bitmap_mode4_neon },
+  { render_scanline_bitmap_mode5_neon }
+};
+
+#endif
+
+// The renderers in use, picked by init_video.
+static const tile_layer_render_struct (*tile_layer_renderers)[4] =
+ tile_mode_renderers;
+static const bitmap_layer_render_struct *bitmap_layer_renderers =
+ bitmap_mode_renderers;
+
+void init_video(void)
+{
+#ifdef ARM_ARCH_NEON_RENDERERS
+  tile_layer_renderers = tile_mode_renderers_neon;
+  bitmap_layer_renderers = bitmap_mode_renderers_neon;
+#endif
+}
+
 
 #define render_scanline_layer_functions_tile()                                \
   const tile_layer_render_struct *layer_renderers =                           \
-   tile_mode_renderers[dispcnt & 0x07]                                        \
+   tile_layer_renderers[dispcnt & 0x07]                                       \
 
 #define render_scanline_layer_functions_bitmap()                              \
   const bitmap_layer_render_struct *layer_renderers =                         \
-   bitmap_mode_renderers + ((dispcnt & 0x07) - 3)                             \
+   bitmap_layer_renderers + ((dispcnt & 0x07) - 3)                            \
 
 
 // Adjust a flipped obj's starting position
@@ -3128,7 +3430,7 @@ static u32 obj_alpha_count[160];
 
 
 #define render_scanline_obj_extra_variables_normal(bg_type)                   \
-  u16 *palette = palette_ram_converted + 256                                  \
+  u16 *palette = palette_ram_output + 256                                     \
 
 #define render_scanline_obj_extra_variables_color()                           \
   u32 pixel_combine = color_combine_mask(4) | (1 << 8)                        \
@@ -3324,144 +3626,343 @@ render_scanline_obj_builder(copy, copy_bitmap, 2D, no_partial_alpha);
 
 
 
-static void order_obj(u32 video_mode)
-{
-  s32 obj_num, priority, row;
-  s32 obj_x, obj_y;
-  s32 obj_size, obj_mode;
-  s32 obj_width, obj_height;
-  u32 obj_priority;
-  u32 obj_attribute_0, obj_attribute_1, obj_attribute_2;
-  u32 current_count;
-  u16 *oam_ptr = oam_ram + 508;
-
-  for(priority = 0; priority < 5; priority++)
-  {
-    for(row = 0; row < 160; row++)
-      obj_priority_count[priority][row] = 0;
-  }
+// Where order_obj last put each OBJ in the lists, an empty row range if it
+// isn't drawn, along with the OAM entry it was placed from. OBJs are only
+// placed again when that changes, the lists are never rebuilt from scratch.
 
-  for(row = 0; row < 160; row++)
-    obj_alpha_count[row] = 0;
+typedef struct
+{
+  u16 attributes[4];
+  u8 priority;
+  u8 alpha;
+  u8 row_start;
+  u8 row_end;
+} obj_placement_type;
 
-  for(obj_num = 127; obj_num >= 0; obj_num--, oam_ptr -= 4)
-  {
-    obj_attribute_0 = eswap16(oam_ptr[0]);
-    obj_attribute_2 = eswap16(oam_ptr[2]);
-    obj_size = obj_attribute_0 & 0xC000;
-    obj_priority = (obj_attribute_2 >> 10) & 0x03;
-    obj_mode = (obj_attribute_0 >> 10) & 0x03;
-
-    if(((obj_attribute_0 & 0x0300) != 0x0200) && (obj_size != 0xC000) &&
-     (obj_mode != 3) && ((video_mode < 3) ||
-     ((obj_attribute_2 & 0x3FF) >= 512)))
-    {
-      obj_y = obj_attribute_0 & 0xFF;
-      if(obj_y > 160)
-        obj_y -= 256;
+static obj_placement_type obj_placement[128];
+static u8 obj_placement_dirty[128];
+static u32 obj_placement_bitmap_mode = 0;
+static u32 obj_placement_all = 1;
 
-      obj_attribute_1 = eswap16(oam_ptr[1]);
-      obj_size = ((obj_size >> 12) & 0x0C) | (obj_attribute_1 >> 14);
-      obj_height = obj_height_table[obj_size];
-      obj_width = obj_width_table[obj_size];
+// Line reuse (see render_scanline_reuse) needs to know which rows changing
+// OBJs were on. Serials of the last change to any OBJ on each row.
 
-      if(obj_attribute_0 & 0x200)
-      {
-        obj_height *= 2;
-        obj_width *= 2;
-      }
+static u32 line_reuse_serial = 1;
+static u32 line_reuse_obj_rows[160];
 
-      if(((obj_y + obj_height) > 0) && (obj_y < 160))
-      {
-        obj_x = (s32)(obj_attribute_1 << 23) >> 23;
+static void touch_obj_rows(s32 row_start, s32 row_end)
+{
+  s32 row;
 
-        if(((obj_x + obj_width) > 0) && (obj_x < 240))
-        {
-          if(obj_y < 0)
-          {
-            obj_height += obj_y;
-            obj_y = 0;
-          }
-
-          if((obj_y + obj_height) >= 160)
-            obj_height = 160 - obj_y;
-
-          if(obj_mode == 1)
-          {
-            for(row = obj_y; row < obj_y + obj_height; row++)
-            {
-              current_count = obj_priority_count[obj_priority][row];
-              obj_priority_list[obj_priority][row][current_count] = obj_num;
-              obj_priority_count[obj_priority][row] = current_count + 1;
-              obj_alpha_count[row]++;
-            }
-          }
-          else
-          {
-            if(obj_mode == 2)
-              obj_priority = 4;
-
-            for(row = obj_y; row < obj_y + obj_height; row++)
-            {
-              current_count = obj_priority_count[obj_priority][row];
-              obj_priority_list[obj_priority][row][current_count] = obj_num;
-              obj_priority_count[obj_priority][row] = current_count + 1;
-            }
-          }
-        }
-      }
-    }
-  }
+  for(row = row_start; row < row_end; row++)
+    line_reuse_obj_rows[row] = line_reuse_serial;
 }
 
-u32 layer_order[16];
-u32 layer_count;
+// Flags the OBJs whose OAM entries were written to since the last call
+// (OAM_DIRTY_SHIFT makes every dirty entry a single OBJ).
 
-static void order_layers(u32 layer_flags)
+static void update_obj_placement_dirty(void)
 {
-  s32 priority, layer_number;
-  layer_count = 0;
+  u32 i;
 
-  for(priority = 3; priority >= 0; priority--)
+  for(i = 0; i < OAM_DIRTY_ENTRIES; i++)
   {
-    for(layer_number = 3; layer_number >= 0; layer_number--)
-    {
-      if(((layer_flags >> layer_number) & 1) &&
-       ((read_ioreg(REG_BG0CNT + layer_number) & 0x03) == priority))
-      {
-        layer_order[layer_count] = layer_number;
-        layer_count++;
-      }
-    }
-
-    if((obj_priority_count[priority][read_ioreg(REG_VCOUNT)] > 0)
-     && (layer_flags & 0x10))
+    if(oam_dirty[i] & DIRTY_CLIENT_OBJ_LIST)
     {
-      layer_order[layer_count] = priority | 0x04;
-      layer_count++;
+      obj_placement_dirty[i] = 1;
+      oam_dirty[i] &= ~DIRTY_CLIENT_OBJ_LIST;
     }
   }
 }
 
-#define fill_line(_start, _end)                                               \
-  u32 i;                                                                      \
-                                                                              \
-  for(i = _start; i < _end; i++)                                              \
-    dest_ptr[i] = color;                                                      \
+static void obj_list_remove(u32 obj_num, u32 priority, u32 alpha,
+ s32 row_start, s32 row_end)
+{
+  s32 row;
 
+  for(row = row_start; row < row_end; row++)
+  {
+    u8 *obj_list = obj_priority_list[priority][row];
+    u32 obj_count = obj_priority_count[priority][row] - 1;
+    u32 i;
 
-#define fill_line_color_normal()                                              \
-  color = palette_ram_converted[color]                                        \
+    for(i = 0; obj_list[i] != obj_num; i++);
+    for(; i < obj_count; i++)
+      obj_list[i] = obj_list[i + 1];
 
-#define fill_line_color_alpha()                                               \
+    obj_priority_count[priority][row] = obj_count;
+    obj_alpha_count[row] -= alpha;
+  }
+}
 
-#define fill_line_color_color16()                                             \
+// The lists are in descending OBJ order so that lower numbered OBJs end up
+// on top. OBJs are placed from the highest down, so search from the end.
 
-#define fill_line_color_color32()                                             \
+static void obj_list_insert(u32 obj_num, u32 priority, u32 alpha,
+ s32 row_start, s32 row_end)
+{
+  s32 row;
 
-#define fill_line_builder(type)                                               \
-static void fill_line_##type(u16 color, render_scanline_dest_##type *dest_ptr,\
- u32 start, u32 end)                                                          \
+  for(row = row_start; row < row_end; row++)
+  {
+    u8 *obj_list = obj_priority_list[priority][row];
+    u32 obj_count = obj_priority_count[priority][row];
+    u32 i = obj_count;
+
+    while((i > 0) && (obj_list[i - 1] < obj_num))
+    {
+      obj_list[i] = obj_list[i - 1];
+      i--;
+    }
+
+    obj_list[i] = obj_num;
+    obj_priority_count[priority][row] = obj_count + 1;
+    obj_alpha_count[row] += alpha;
+  }
+}
+
+static void get_obj_placement(u32 obj_num, u32 video_mode,
+ obj_placement_type *placement)
+{
+  s32 obj_x, obj_y;
+  s32 obj_size, obj_mode;
+  s32 obj_width, obj_height;
+  u32 obj_priority;
+  u32 obj_attribute_0, obj_attribute_1, obj_attribute_2;
+  u16 *oam_ptr = oam_ram + (obj_num * 4);
+  s32 row_start = 0;
+  s32 row_end = 0;
+  u32 alpha = 0;
+
+  obj_attribute_0 = eswap16(oam_ptr[0]);
+  obj_attribute_2 = eswap16(oam_ptr[2]);
+  obj_size = obj_attribute_0 & 0xC000;
+  obj_priority = (obj_attribute_2 >> 10) & 0x03;
+  obj_mode = (obj_attribute_0 >> 10) & 0x03;
+
+  if(((obj_attribute_0 & 0x0300) != 0x0200) && (obj_size != 0xC000) &&
+   (obj_mode != 3) && ((video_mode < 3) ||
+   ((obj_attribute_2 & 0x3FF) >= 512)))
+  {
+    obj_y = obj_attribute_0 & 0xFF;
+    if(obj_y > 160)
+      obj_y -= 256;
+
+    obj_attribute_1 = eswap16(oam_ptr[1]);
+    obj_size = ((obj_size >> 12) & 0x0C) | (obj_attribute_1 >> 14);
+    obj_height = obj_height_table[obj_size];
+    obj_width = obj_width_table[obj_size];
+
+    if(obj_attribute_0 & 0x200)
+    {
+      obj_height *= 2;
+      obj_width *= 2;
+    }
+
+    if(((obj_y + obj_height) > 0) && (obj_y < 160))
+    {
+      obj_x = (s32)(obj_attribute_1 << 23) >> 23;
+
+      if(((obj_x + obj_width) > 0) && (obj_x < 240))
+      {
+        row_start = obj_y;
+        row_end = obj_y + obj_height;
+
+        if(row_start < 0)
+          row_start = 0;
+
+        if(row_end > 160)
+          row_end = 160;
+
+        if(obj_mode == 1)
+          alpha = 1;
+
+        if(obj_mode == 2)
+          obj_priority = 4;
+      }
+    }
+  }
+
+  memcpy(placement->attributes, oam_ptr, sizeof(placement->attributes));
+  placement->priority = obj_priority;
+  placement->alpha = alpha;
+  placement->row_start = row_start;
+  placement->row_end = row_end;
+}
+
+static void place_obj(u32 obj_num, u32 video_mode)
+{
+  obj_placement_type *current = obj_placement + obj_num;
+  obj_placement_type placement;
+  s32 row_start, row_end;
+  s32 old_start = current->row_start;
+  s32 old_end = current->row_end;
+  u32 priority, alpha;
+
+  get_obj_placement(obj_num, video_mode, &placement);
+  row_start = placement.row_start;
+  row_end = placement.row_end;
+  priority = placement.priority;
+  alpha = placement.alpha;
+
+  if((priority == current->priority) && (alpha == current->alpha))
+  {
+    // Only the rows it moved off of and onto change.
+    obj_list_remove(obj_num, priority, alpha, old_start,
+     (old_end < row_start) ? old_end : row_start);
+    obj_list_remove(obj_num, priority, alpha,
+     (old_start > row_end) ? old_start : row_end, old_end);
+    obj_list_insert(obj_num, priority, alpha, row_start,
+     (row_end < old_start) ? row_end : old_start);
+    obj_list_insert(obj_num, priority, alpha,
+     (row_start > old_end) ? row_start : old_end, row_end);
+  }
+  else
+  {
+    obj_list_remove(obj_num, current->priority, current->alpha, old_start,
+     old_end);
+    obj_list_insert(obj_num, priority, alpha, row_start, row_end);
+  }
+
+  *current = placement;
+}
+
+// Past this many changed OBJs moving them around the lists costs more than
+// building the lists again.
+#define OBJ_PLACEMENT_REBUILD  48
+
+static void order_obj(u32 video_mode)
+{
+  u32 bitmap_mode = (video_mode >= 3);
+  u8 changed[128];
+  u32 changed_count = 0;
+  s32 obj_num, priority, row;
+  u32 i;
+
+  for(obj_num = 127; obj_num >= 0; obj_num--)
+  {
+    // OAM is often rewritten as a whole with mostly the same values.
+    if(obj_placement_dirty[obj_num] &&
+     memcmp(obj_placement[obj_num].attributes, oam_ram + (obj_num * 4),
+     sizeof(obj_placement[obj_num].attributes)))
+    {
+      changed[changed_count] = obj_num;
+      changed_count++;
+    }
+
+    obj_placement_dirty[obj_num] = 0;
+  }
+
+  // Which OBJs are drawn at all depends on the mode being a bitmap one.
+  if(obj_placement_all || (bitmap_mode != obj_placement_bitmap_mode) ||
+   (changed_count > OBJ_PLACEMENT_REBUILD))
+  {
+    for(priority = 0; priority < 5; priority++)
+    {
+      for(row = 0; row < 160; row++)
+        obj_priority_count[priority][row] = 0;
+    }
+
+    for(row = 0; row < 160; row++)
+      obj_alpha_count[row] = 0;
+
+    for(obj_num = 127; obj_num >= 0; obj_num--)
+    {
+      obj_placement_type *placement = obj_placement + obj_num;
+      u32 current_count;
+
+      get_obj_placement(obj_num, video_mode, placement);
+      priority = placement->priority;
+
+      for(row = placement->row_start; row < placement->row_end; row++)
+      {
+        current_count = obj_priority_count[priority][row];
+        obj_priority_list[priority][row][current_count] = obj_num;
+        obj_priority_count[priority][row] = current_count + 1;
+        obj_alpha_count[row] += placement->alpha;
+      }
+    }
+
+    obj_placement_bitmap_mode = bitmap_mode;
+    obj_placement_all = 0;
+    touch_obj_rows(0, 160);
+    return;
+  }
+
+  for(i = 0; i < changed_count; i++)
+  {
+    obj_placement_type *placement = obj_placement + changed[i];
+
+    // The fourth halfword is an affine parameter, which any OBJ can use.
+    if(placement->attributes[3] != oam_ram[(changed[i] * 4) + 3])
+      touch_obj_rows(0, 160);
+
+    touch_obj_rows(placement->row_start, placement->row_end);
+    place_obj(changed[i], video_mode);
+    touch_obj_rows(placement->row_start, placement->row_end);
+  }
+}
+
+render_local u32 layer_order[16];
+render_local u32 layer_count;
+
+static void order_layers(u32 layer_flags)
+{
+  s32 priority, layer_number;
+  layer_count = 0;
+
+  for(priority = 3; priority >= 0; priority--)
+  {
+    for(layer_number = 3; layer_number >= 0; layer_number--)
+    {
+      if(((layer_flags >> layer_number) & 1) &&
+       ((read_ioreg(REG_BG0CNT + layer_number) & 0x03) == priority))
+      {
+        layer_order[layer_count] = layer_number;
+        layer_count++;
+      }
+    }
+
+    if((obj_priority_count[priority][read_ioreg(REG_VCOUNT)] > 0)
+     && (layer_flags & 0x10))
+    {
+      layer_order[layer_count] = priority | 0x04;
+      layer_count++;
+    }
+  }
+}
+
+#ifdef ARM_ARCH_NEON_RENDERERS
+
+#define fill_line(_start, _end)                                               \
+  if(sizeof(*dest_ptr) == 2)                                                  \
+    neon_fill_16((u16 *)dest_ptr + _start, color, _end - _start);             \
+  else                                                                        \
+    neon_fill_32((u32 *)dest_ptr + _start, color, _end - _start)              \
+
+#else
+
+#define fill_line(_start, _end)                                               \
+  u32 i;                                                                      \
+                                                                              \
+  for(i = _start; i < _end; i++)                                              \
+    dest_ptr[i] = color;                                                      \
+
+#endif
+
+
+#define fill_line_color_normal()                                              \
+  color = palette_ram_output[color]                                           \
+
+#define fill_line_color_alpha()                                               \
+
+#define fill_line_color_color16()                                             \
+
+#define fill_line_color_color32()                                             \
+
+#define fill_line_builder(type)                                               \
+static void fill_line_##type(u16 color, render_scanline_dest_##type *dest_ptr,\
+ u32 start, u32 end)                                                          \
 {                                                                             \
   fill_line_color_##type();                                                   \
   fill_line(start, end);                                                      \
@@ -3616,6 +4117,15 @@ void expand_blend(u32 *screen_src_ptr, u16 *screen_dest_ptr,
   if(blend_b > 16)
     blend_b = 16;
 
+#ifdef X86_ARCH_BLENDING_OPTS
+  if(x86_blend_kernels)
+  {
+    x86_blend_kernels->blend(screen_src_ptr + start, screen_dest_ptr + start,
+     end - start, palette_ram_converted, blend_a, blend_b);
+    return;
+  }
+#endif
+
   // The individual colors can saturate over 31, this should be taken
   // care of in an alternate pass as it incurs a huge additional speedhit.
   if((blend_a + blend_b) > 16)
@@ -3642,6 +4152,15 @@ static void expand_darken(u16 *screen_src_ptr, u16 *screen_dest_ptr,
   if(blend < 0)
     blend = 0;
 
+#ifdef X86_ARCH_BLENDING_OPTS
+  if(x86_blend_kernels)
+  {
+    x86_blend_kernels->fade(screen_src_ptr + start, screen_dest_ptr + start,
+     end - start, palette_ram_converted, 0, blend);
+    return;
+  }
+#endif
+
   expand_loop(darken, effect_condition_fade(pixel_top), pixel_top);
 }
 
@@ -3662,6 +4181,16 @@ static void expand_brighten(u16 *screen_src_ptr, u16 *screen_dest_ptr,
   upper = ((0x07E0F81F * blend) >> 4) & 0x07E0F81F;
   blend = 16 - blend;
 
+#ifdef X86_ARCH_BLENDING_OPTS
+  if(x86_blend_kernels)
+  {
+    x86_blend_kernels->fade(screen_src_ptr + start, screen_dest_ptr + start,
+     end - start, palette_ram_converted, (upper | (upper >> 16)) & 0xFFFF,
+     blend);
+    return;
+  }
+#endif
+
   expand_loop(brighten, effect_condition_fade(pixel_top), pixel_top);
 
 }
@@ -3690,6 +4219,16 @@ static void expand_darken_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_pt
   if(blend_b > 16)
     blend_b = 16;
 
+#ifdef X86_ARCH_BLENDING_OPTS
+  if(x86_blend_kernels)
+  {
+    x86_blend_kernels->fade_partial_alpha(screen_src_ptr + start,
+     screen_dest_ptr + start, end - start, palette_ram_converted, blend_a,
+     blend_b, 0, blend);
+    return;
+  }
+#endif
+
   expand_partial_alpha(darken);
 }
 
@@ -3718,6 +4257,16 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
   if(blend_b > 16)
     blend_b = 16;
 
+#ifdef X86_ARCH_BLENDING_OPTS
+  if(x86_blend_kernels)
+  {
+    x86_blend_kernels->fade_partial_alpha(screen_src_ptr + start,
+     screen_dest_ptr + start, end - start, palette_ram_converted, blend_a,
+     blend_b, (upper | (upper >> 16)) & 0xFFFF, blend);
+    return;
+  }
+#endif
+
   expand_partial_alpha(brighten);
 }
 
@@ -3783,6 +4332,21 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
   (((read_ioreg(REG_BLDY) & 0x1F) != 0) &&                                    \
    ((read_ioreg(REG_BLDCNT) & 0x3F) != 0))                                    \
 
+// Color effects are applied to the uncorrected colors, the lines they
+// output are corrected once they're done.
+
+static void correct_line(u16 *scanline, u32 start, u32 end)
+{
+  u32 i;
+
+  for(i = start; i < end; i++)
+    scanline[i] = correct_color(scanline[i]);
+}
+
+#define expand_correct(_start, _end)                                          \
+  if(color_correction)                                                        \
+    correct_line(scanline, _start, _end)                                      \
+
 #define render_layers_color_effect(renderer, layer_condition,                 \
  alpha_condition, fade_condition, _start, _end)                               \
 {                                                                             \
@@ -3801,6 +4365,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
           {                                                                   \
             renderer(alpha, alpha_obj, screen_buffer);                        \
             expand_blend(screen_buffer, scanline, _start, _end);              \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3814,6 +4379,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
             renderer(color32, partial_alpha, screen_buffer);                  \
             expand_brighten_partial_alpha(screen_buffer, scanline,            \
              _start, _end);                                                   \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3827,6 +4393,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
             renderer(color32, partial_alpha, screen_buffer);                  \
             expand_darken_partial_alpha(screen_buffer, scanline,              \
              _start, _end);                                                   \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3835,6 +4402,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
                                                                               \
       renderer(color32, partial_alpha, screen_buffer);                        \
       expand_blend(screen_buffer, scanline, _start, _end);                    \
+      expand_correct(_start, _end);                                           \
     }                                                                         \
     else                                                                      \
     {                                                                         \
@@ -3849,6 +4417,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
             u32 screen_buffer[240];                                           \
             renderer(alpha, alpha_obj, screen_buffer);                        \
             expand_blend(screen_buffer, scanline, _start, _end);              \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3861,6 +4430,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
           {                                                                   \
             renderer(color16, color16, scanline);                             \
             expand_brighten(scanline, scanline, _start, _end);                \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3873,6 +4443,7 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
           {                                                                   \
             renderer(color16, color16, scanline);                             \
             expand_darken(scanline, scanline, _start, _end);                  \
+            expand_correct(_start, _end);                                     \
             return;                                                           \
           }                                                                   \
           break;                                                              \
@@ -3922,6 +4493,8 @@ static void expand_brighten_partial_alpha(u32 *screen_src_ptr, u16 *screen_dest_
         break;                                                                \
       }                                                                       \
     }                                                                         \
+    if(color_correction)                                                      \
+      pixel_top = correct_color(pixel_top);                                   \
     fill_line_color16(pixel_top, scanline, _start, _end);                     \
   }                                                                           \
 }                                                                             \
@@ -4410,52 +4983,1047 @@ render_scanline_window_builder(bitmap);
 
 static const u32 active_layers[6] = { 0x1F, 0x17, 0x1C, 0x14, 0x14, 0x14 };
 
-void update_scanline(void)
+// Line reuse: a line whose inputs haven't changed since it was last drawn
+// is copied from a cache of what was drawn then. The inputs are the display
+// registers and affine references, compared as they are, and the memory the
+// line's layers read: 2KB VRAM blocks, the BG and OBJ palettes and the OBJs
+// on its row, each carrying the serial of its last change. Keeping a copy
+// of the output makes this independent of what happens to the screen
+// buffer between frames. Only done when drawing inline, the render thread
+// and bands don't see the memory changes here.
+
+#define LINE_REUSE_BLOCK_SHIFT  11
+#define LINE_REUSE_BLOCKS       (0x18000 >> LINE_REUSE_BLOCK_SHIFT)
+
+typedef struct
 {
-  u32 pitch = get_screen_pitch();
-  u32 dispcnt = read_ioreg(REG_DISPCNT);
-  u32 vcount = read_ioreg(REG_VCOUNT);
-  u16 *screen_offset = get_screen_pixels() + (vcount * pitch);
-  u32 video_mode = dispcnt & 0x07;
+  u16 io_registers[0x58 / 2];
+  s32 affine_reference_x[2];
+  s32 affine_reference_y[2];
+  u32 serial;
+} line_reuse_line_type;
+
+static u32 line_reuse_requested = 0;
+static u32 line_reuse_blocked = 0;
+static u32 line_reuse_enabled = 0;
+static u32 line_reuse_vram[LINE_REUSE_BLOCKS];
+static u32 line_reuse_palette[2];
+static line_reuse_line_type line_reuse_lines[160];
+static u16 line_reuse_cache[160][240];
+
+static void update_line_reuse(void)
+{
+  u32 enabled = line_reuse_requested && !line_reuse_blocked;
+  u32 i;
 
-  // If OAM has been modified since the last scanline has been updated then
-  // reorder and reprofile the OBJ lists.
-  if(reg[OAM_UPDATED])
+  // Nothing was tracked while it was off.
+  if(enabled && !line_reuse_enabled)
   {
-    order_obj(video_mode);
-    reg[OAM_UPDATED] = 0;
+    for(i = 0; i < 160; i++)
+      line_reuse_lines[i].serial = 0;
   }
 
-  order_layers((dispcnt >> 8) & active_layers[video_mode]);
+  line_reuse_enabled = enabled;
+}
 
-  if(skip_next_frame)
-    return;
+void init_line_reuse(u32 enable)
+{
+  line_reuse_requested = enable;
+  update_line_reuse();
+}
+
+static void update_line_reuse_serials(void)
+{
+  u32 i;
+
+  for(i = 0; i < VRAM_DIRTY_PAGES; i++)
+  {
+    if(vram_dirty[i] & DIRTY_CLIENT_LINE_REUSE)
+    {
+      line_reuse_vram[i >> (LINE_REUSE_BLOCK_SHIFT - VRAM_DIRTY_SHIFT)] =
+       line_reuse_serial;
+      vram_dirty[i] &= ~DIRTY_CLIENT_LINE_REUSE;
+    }
+  }
 
-  // If the screen is in in forced blank draw pure white.
-  if(dispcnt & 0x80)
+  for(i = 0; i < PALETTE_DIRTY_ROWS; i++)
   {
-    fill_line_color16(0xFFFF, screen_offset, 0, 240);
+    if(palette_dirty[i] & DIRTY_CLIENT_LINE_REUSE)
+    {
+      line_reuse_palette[i >= (PALETTE_DIRTY_ROWS / 2)] = line_reuse_serial;
+      palette_dirty[i] &= ~DIRTY_CLIENT_LINE_REUSE;
+    }
   }
-  else
+}
+
+static u32 line_reuse_vram_serial(u32 serial, u32 start, u32 size)
+{
+  u32 block = start >> LINE_REUSE_BLOCK_SHIFT;
+  // Rounded up, a range can end part way into a block (mode 3 does).
+  u32 end_block = (start + size + (1 << LINE_REUSE_BLOCK_SHIFT) - 1) >>
+   LINE_REUSE_BLOCK_SHIFT;
+
+  if(end_block > LINE_REUSE_BLOCKS)
+    end_block = LINE_REUSE_BLOCKS;
+
+  for(; block < end_block; block++)
+  {
+    if(line_reuse_vram[block] > serial)
+      serial = line_reuse_vram[block];
+  }
+
+  return serial;
+}
+
+// Latest change to anything the line reads. Text layers may fetch any tile
+// from their char base and bitmap layers any pixel of their frame.
+
+static u32 line_reuse_inputs(u32 dispcnt, u32 vcount)
+{
+  u32 video_mode = dispcnt & 0x07;
+  u32 layers = (dispcnt >> 8) & active_layers[video_mode];
+  u32 serial = line_reuse_palette[0];
+  u32 layer;
+
+  if(video_mode < 3)
   {
-    if(video_mode < 3)
+    for(layer = 0; layer < 4; layer++)
     {
-      if(dispcnt >> 13)
+      u32 bg_control = read_ioreg(REG_BG0CNT + layer);
+      u32 map_base = ((bg_control >> 8) & 0x1F) * 2048;
+      u32 char_base = ((bg_control >> 2) & 0x03) * 16384;
+      u32 map_size = bg_control >> 14;
+
+      if(!(layers & (1 << layer)))
+        continue;
+
+      if((video_mode == 0) || ((video_mode == 1) && (layer < 2)))
       {
-        render_scanline_window_tile(screen_offset, dispcnt);
+        serial = line_reuse_vram_serial(serial, map_base,
+         2048 << ((map_size & 0x01) + (map_size >> 1)));
+        serial = line_reuse_vram_serial(serial, char_base,
+         (bg_control & 0x80) ? 0x10000 : 0x8000);
       }
       else
       {
-        render_scanline_tile(screen_offset, dispcnt);
+        serial = line_reuse_vram_serial(serial, map_base,
+         256 << (map_size * 2));
+        serial = line_reuse_vram_serial(serial, char_base, 0x4000);
       }
     }
+  }
+  else if(layers & 0x04)
+  {
+    if(video_mode == 3)
+      serial = line_reuse_vram_serial(serial, 0, 240 * 160 * 2);
     else
-    {
-      if(dispcnt >> 13)
-        render_scanline_window_bitmap(screen_offset, dispcnt);
-      else
-        render_scanline_bitmap(screen_offset, dispcnt);
-    }
+      serial = line_reuse_vram_serial(serial,
+       (dispcnt & 0x10) ? 0xA000 : 0, 0xA000);
+  }
+
+  if((layers & 0x10) || (dispcnt & 0x8000))
+  {
+    serial = line_reuse_vram_serial(serial, 0x10000, 0x8000);
+
+    if(line_reuse_palette[1] > serial)
+      serial = line_reuse_palette[1];
+
+    if(line_reuse_obj_rows[vcount] > serial)
+      serial = line_reuse_obj_rows[vcount];
+  }
+
+  return serial;
+}
+
+// DISPSTAT and VCOUNT don't affect what's drawn.
+#define line_reuse_registers_match(line)                                      \
+  (!memcmp(line->io_registers, io_registers, 4) &&                            \
+   !memcmp(line->io_registers + 4, io_registers + 4,                          \
+   sizeof(line->io_registers) - 8))                                           \
+
+// The affine references only matter for the affine layers drawn, BG2 uses
+// the first and BG3 the second.
+#define line_reuse_affine_match(line, layer)                                  \
+  (!(affine_layers & (1 << (layer))) ||                                       \
+   ((line->affine_reference_x[(layer) - 2] ==                                 \
+   affine_reference_x[(layer) - 2]) &&                                        \
+   (line->affine_reference_y[(layer) - 2] ==                                  \
+   affine_reference_y[(layer) - 2])))                                         \
+
+static u32 reuse_scanline(u16 *screen_offset, u32 dispcnt, u32 vcount)
+{
+  line_reuse_line_type *line = line_reuse_lines + vcount;
+  u32 video_mode = dispcnt & 0x07;
+  u32 affine_layers = (dispcnt >> 8) & active_layers[video_mode] &
+   ((video_mode == 0) ? 0x00 : (video_mode == 2) ? 0x0C : 0x04);
+
+  update_line_reuse_serials();
+
+  if(line->serial && line_reuse_registers_match(line) &&
+   line_reuse_affine_match(line, 2) && line_reuse_affine_match(line, 3) &&
+   (line_reuse_inputs(dispcnt, vcount) <= line->serial))
+  {
+    memcpy(screen_offset, line_reuse_cache[vcount],
+     sizeof(line_reuse_cache[vcount]));
+    return 1;
+  }
+
+  return 0;
+}
+
+static void save_scanline(u16 *screen_offset, u32 vcount)
+{
+  line_reuse_line_type *line = line_reuse_lines + vcount;
+
+  memcpy(line->io_registers, io_registers, sizeof(line->io_registers));
+  memcpy(line->affine_reference_x, affine_reference_x,
+   sizeof(line->affine_reference_x));
+  memcpy(line->affine_reference_y, affine_reference_y,
+   sizeof(line->affine_reference_y));
+  memcpy(line_reuse_cache[vcount], screen_offset,
+   sizeof(line_reuse_cache[vcount]));
+
+  // Later changes get a higher serial than the one the line was drawn at.
+  line->serial = line_reuse_serial;
+  line_reuse_serial++;
+}
+
+// With XRGB8888 output gba_screen_pixels holds 32bit pixels. Lines are
+// still drawn as RGB565, into render_output_line, and widened into the
+// screen once done while they are still in the cache.
+
+static u32 output_xrgb8888 = 0;
+static render_local u16 render_output_line[240];
+
+#ifdef USE_BGR_FORMAT
+  #define output_red(color)     ((color) & 0x1F)
+  #define output_blue(color)    ((color) >> 11)
+#else
+  #define output_red(color)     ((color) >> 11)
+  #define output_blue(color)    ((color) & 0x1F)
+#endif
+
+#define output_green(color)     (((color) >> 5) & 0x3F)
+
+#define convert_xrgb8888(color)                                               \
+  ((((output_red(color) << 3) | (output_red(color) >> 2)) << 16) |            \
+   (((output_green(color) << 2) | (output_green(color) >> 4)) << 8) |         \
+   ((output_blue(color) << 3) | (output_blue(color) >> 2)))                   \
+
+static void output_line_xrgb8888(u32 *dest, const u16 *src)
+{
+  u32 i;
+
+  for(i = 0; i < 240; i++)
+  {
+    u32 color = src[i];
+    dest[i] = convert_xrgb8888(color);
+  }
+}
+
+static void render_scanline(u32 oam_updated)
+{
+  u32 pitch = get_screen_pitch();
+  u32 dispcnt = read_ioreg(REG_DISPCNT);
+  u32 vcount = read_ioreg(REG_VCOUNT);
+  u16 *screen_offset = output_xrgb8888 ? render_output_line :
+   get_screen_pixels() + (vcount * pitch);
+  u32 video_mode = dispcnt & 0x07;
+
+  // If OAM has been modified since the last scanline has been updated then
+  // reorder and reprofile the OBJ lists.
+  if(oam_updated)
+    order_obj(video_mode);
+
+  order_layers((dispcnt >> 8) & active_layers[video_mode]);
+
+  if(skip_next_frame)
+    return;
+
+  if(!line_reuse_enabled || !reuse_scanline(screen_offset, dispcnt, vcount))
+  {
+    // If the screen is in in forced blank draw pure white.
+    if(dispcnt & 0x80)
+    {
+      fill_line_color16(0xFFFF, screen_offset, 0, 240);
+    }
+    else
+    {
+      if(video_mode < 3)
+      {
+        if(dispcnt >> 13)
+        {
+          render_scanline_window_tile(screen_offset, dispcnt);
+        }
+        else
+        {
+          render_scanline_tile(screen_offset, dispcnt);
+        }
+      }
+      else
+      {
+        if(dispcnt >> 13)
+          render_scanline_window_bitmap(screen_offset, dispcnt);
+        else
+          render_scanline_bitmap(screen_offset, dispcnt);
+      }
+    }
+
+    if(line_reuse_enabled)
+      save_scanline(screen_offset, vcount);
+  }
+
+  if(output_xrgb8888)
+  {
+    output_line_xrgb8888((u32 *)get_screen_pixels() + (vcount * pitch),
+     screen_offset);
+  }
+}
+
+#ifdef HAVE_RENDER_THREAD
+
+// From here on the live state is used again.
+#undef io_registers
+#undef vram
+#undef palette_ram_converted
+#undef palette_ram_corrected
+#undef oam_ram
+#undef affine_reference_x
+#undef affine_reference_y
+
+#include <pthread.h>
+
+// At every HBlank the emulation thread appends to a single producer/single
+// consumer command queue: the VRAM pages, palette rows and OAM entries
+// changed since the previous line (from the DIRTY_CLIENT_RENDER bit of the
+// dirty maps), followed by the line's display registers. The render thread
+// applies them to its copies in order, so every line is drawn with the
+// memory contents it had at its HBlank, then renders the line.
+
+#define RENDER_QUEUE_SIZE  (256 * 1024)
+
+typedef enum
+{
+  RENDER_COMMAND_WRAP,
+  RENDER_COMMAND_VRAM,
+  RENDER_COMMAND_PALETTE,
+  RENDER_COMMAND_OAM,
+  RENDER_COMMAND_LINE,
+  RENDER_COMMAND_QUIT
+} render_command_type;
+
+typedef struct
+{
+  u32 command;
+  u32 offset;
+  u32 size;
+} render_command_header_type;
+
+typedef struct
+{
+  u16 io_registers[0x58 / 2];
+  s32 affine_reference_x[2];
+  s32 affine_reference_y[2];
+  u32 oam_updated;
+} render_line_type;
+
+static u8 render_queue[RENDER_QUEUE_SIZE] __attribute__((aligned(4)));
+
+// Free running byte counters, only written by their own side.
+static u32 render_queue_write = 0;
+static u32 render_queue_read = 0;
+
+static u32 render_thread_running = 0;
+static u32 render_thread_sleeping = 0;
+static u32 render_producer_sleeping = 0;
+static pthread_t render_thread;
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_done_cond = PTHREAD_COND_INITIALIZER;
+
+#define render_atomic_load(variable)                                          \
+  __atomic_load_n(&(variable), __ATOMIC_SEQ_CST)                              \
+
+#define render_atomic_store(variable, value)                                  \
+  __atomic_store_n(&(variable), value, __ATOMIC_SEQ_CST)                      \
+
+// Sleeps until condition holds. The other side checks the sleeping flag
+// after every update and signals under the mutex, so wakeups can't be lost.
+
+#define render_wait(condition, sleeping_flag, cond)                           \
+  if(!(condition))                                                            \
+  {                                                                           \
+    pthread_mutex_lock(&render_mutex);                                        \
+    render_atomic_store(sleeping_flag, 1);                                    \
+    while(!(condition))                                                       \
+      pthread_cond_wait(&cond, &render_mutex);                                \
+    render_atomic_store(sleeping_flag, 0);                                    \
+    pthread_mutex_unlock(&render_mutex);                                      \
+  }                                                                           \
+
+#define render_wake(sleeping_flag, cond)                                      \
+  if(render_atomic_load(sleeping_flag))                                       \
+  {                                                                           \
+    pthread_mutex_lock(&render_mutex);                                        \
+    pthread_cond_signal(&cond);                                               \
+    pthread_mutex_unlock(&render_mutex);                                      \
+  }                                                                           \
+
+#define render_queue_free()                                                   \
+  (RENDER_QUEUE_SIZE - (render_queue_write -                                  \
+   render_atomic_load(render_queue_read)))                                    \
+
+static void *render_thread_function(void *unused)
+{
+  u32 read = render_queue_read;
+
+  render_io_registers = render_thread_io_registers;
+  render_affine_reference_x = render_thread_affine_x;
+  render_affine_reference_y = render_thread_affine_y;
+
+  while(1)
+  {
+    render_command_header_type *header;
+    u8 *payload;
+
+    render_wait(render_atomic_load(render_queue_write) != read,
+     render_thread_sleeping, render_queue_cond);
+
+    header = (render_command_header_type *)
+     (render_queue + (read % RENDER_QUEUE_SIZE));
+    payload = (u8 *)(header + 1);
+
+    switch(header->command)
+    {
+      case RENDER_COMMAND_WRAP:
+        read += RENDER_QUEUE_SIZE - (read % RENDER_QUEUE_SIZE);
+        render_atomic_store(render_queue_read, read);
+        render_wake(render_producer_sleeping, render_done_cond);
+        continue;
+
+      case RENDER_COMMAND_VRAM:
+      {
+        u32 page = header->offset >> VRAM_DIRTY_SHIFT;
+        u32 end_page = (header->offset + header->size) >> VRAM_DIRTY_SHIFT;
+
+        memcpy(render_thread_vram + header->offset, payload, header->size);
+        for(; page < end_page; page++)
+          update_tile_cache_page(page);
+        break;
+      }
+
+      case RENDER_COMMAND_PALETTE:
+        memcpy((u8 *)render_thread_palette + header->offset, payload,
+         header->size);
+        if(color_correction)
+        {
+          correct_palette(render_thread_palette_corrected,
+           render_thread_palette, header->offset / 2, header->size / 2);
+        }
+        break;
+
+      case RENDER_COMMAND_OAM:
+      {
+        u32 entry = header->offset >> OAM_DIRTY_SHIFT;
+        u32 end_entry = (header->offset + header->size) >> OAM_DIRTY_SHIFT;
+
+        memcpy((u8 *)render_thread_oam + header->offset, payload,
+         header->size);
+        for(; entry < end_entry; entry++)
+          obj_placement_dirty[entry] = 1;
+        break;
+      }
+
+      case RENDER_COMMAND_LINE:
+      {
+        render_line_type *line = (render_line_type *)payload;
+
+        memcpy(render_thread_io_registers, line->io_registers,
+         sizeof(line->io_registers));
+        memcpy(render_thread_affine_x, line->affine_reference_x,
+         sizeof(render_thread_affine_x));
+        memcpy(render_thread_affine_y, line->affine_reference_y,
+         sizeof(render_thread_affine_y));
+        render_scanline(line->oam_updated);
+        break;
+      }
+
+      case RENDER_COMMAND_QUIT:
+        // Consumed, so that a restarted thread doesn't quit right away.
+        render_atomic_store(render_queue_read,
+         read + sizeof(render_command_header_type));
+        return NULL;
+    }
+
+    read += sizeof(render_command_header_type) + header->size;
+    render_atomic_store(render_queue_read, read);
+    render_wake(render_producer_sleeping, render_done_cond);
+  }
+}
+
+// Returns space for a command with size bytes of payload, waiting for the
+// render thread to free it up if needed. Commands never wrap around.
+
+static u8 *render_queue_reserve(u32 command, u32 offset, u32 size)
+{
+  u32 total_size = sizeof(render_command_header_type) + size;
+  u32 contiguous = RENDER_QUEUE_SIZE - (render_queue_write % RENDER_QUEUE_SIZE);
+  render_command_header_type *header;
+
+  if(contiguous < total_size)
+  {
+    render_wait(render_queue_free() >= contiguous, render_producer_sleeping,
+     render_done_cond);
+    *(u32 *)(render_queue + (render_queue_write % RENDER_QUEUE_SIZE)) =
+     RENDER_COMMAND_WRAP;
+    render_atomic_store(render_queue_write, render_queue_write + contiguous);
+    render_wake(render_thread_sleeping, render_queue_cond);
+  }
+
+  render_wait(render_queue_free() >= total_size, render_producer_sleeping,
+   render_done_cond);
+
+  header = (render_command_header_type *)
+   (render_queue + (render_queue_write % RENDER_QUEUE_SIZE));
+  header->command = command;
+  header->offset = offset;
+  header->size = size;
+
+  return (u8 *)(header + 1);
+}
+
+static void render_queue_commit(u32 size)
+{
+  render_atomic_store(render_queue_write, render_queue_write +
+   sizeof(render_command_header_type) + size);
+  render_wake(render_thread_sleeping, render_queue_cond);
+}
+
+static void render_queue_memory(u32 command, u8 *dirty, u32 units,
+ u32 shift, u8 *source)
+{
+  u32 unit = 0;
+
+  while(unit < units)
+  {
+    u32 first;
+    u32 size;
+
+    if(!(dirty[unit] & DIRTY_CLIENT_RENDER))
+    {
+      unit++;
+      continue;
+    }
+
+    // Send runs of dirty units as a single command.
+    first = unit;
+    while((unit < units) && (dirty[unit] & DIRTY_CLIENT_RENDER))
+    {
+      dirty[unit] &= ~DIRTY_CLIENT_RENDER;
+      unit++;
+    }
+
+    size = (unit - first) << shift;
+    memcpy(render_queue_reserve(command, first << shift, size),
+     source + (first << shift), size);
+    render_queue_commit(size);
+  }
+}
+
+static void render_queue_line(void)
+{
+  render_line_type *line;
+
+  render_queue_memory(RENDER_COMMAND_VRAM, vram_dirty, VRAM_DIRTY_PAGES,
+   VRAM_DIRTY_SHIFT, vram);
+  render_queue_memory(RENDER_COMMAND_PALETTE, palette_dirty,
+   PALETTE_DIRTY_ROWS, PALETTE_DIRTY_SHIFT, (u8 *)palette_ram_converted);
+  render_queue_memory(RENDER_COMMAND_OAM, oam_dirty, OAM_DIRTY_ENTRIES,
+   OAM_DIRTY_SHIFT, (u8 *)oam_ram);
+
+  line = (render_line_type *)render_queue_reserve(RENDER_COMMAND_LINE, 0,
+   sizeof(render_line_type));
+  memcpy(line->io_registers, io_registers, sizeof(line->io_registers));
+  memcpy(line->affine_reference_x, affine_reference_x,
+   sizeof(line->affine_reference_x));
+  memcpy(line->affine_reference_y, affine_reference_y,
+   sizeof(line->affine_reference_y));
+  line->oam_updated = reg[OAM_UPDATED];
+  render_queue_commit(sizeof(render_line_type));
+
+  reg[OAM_UPDATED] = 0;
+}
+
+// Points the shared memory state at the render copies or the live arrays.
+// Only valid while no other thread is drawing.
+
+static void render_use_copies(u32 enable)
+{
+  // The OBJ lists were following the other OAM.
+  obj_placement_all = 1;
+
+  line_reuse_blocked = enable;
+  update_line_reuse();
+
+  if(enable)
+  {
+    render_vram = render_thread_vram;
+    render_palette_ram_converted = render_thread_palette;
+    render_palette_ram_corrected = render_thread_palette_corrected;
+    render_oam_ram = render_thread_oam;
+  }
+  else
+  {
+    u32 i;
+
+    render_vram = vram;
+    render_palette_ram_converted = palette_ram_converted;
+    render_palette_ram_corrected = palette_ram_corrected;
+    render_oam_ram = oam_ram;
+
+    // The tile cache was following the copies.
+    for(i = 0; i < VRAM_DIRTY_PAGES; i++)
+      vram_dirty[i] |= DIRTY_CLIENT_TILE_CACHE;
+  }
+}
+
+// The copies are kept current through the DIRTY_CLIENT_RENDER bits, which
+// nothing clears while they're unused. Refreshes all of them when they're
+// next used.
+
+static void render_invalidate_copies(void)
+{
+  u32 i;
+
+  for(i = 0; i < VRAM_DIRTY_PAGES; i++)
+    vram_dirty[i] |= DIRTY_CLIENT_RENDER;
+  for(i = 0; i < PALETTE_DIRTY_ROWS; i++)
+    palette_dirty[i] |= DIRTY_CLIENT_RENDER;
+  for(i = 0; i < OAM_DIRTY_ENTRIES; i++)
+    oam_dirty[i] |= DIRTY_CLIENT_RENDER;
+  reg[OAM_UPDATED] = 1;
+}
+
+// Deferred frame rendering: while VRAM, palette and OAM stay unchanged the
+// registers of each line are only recorded. Once the last visible line is
+// reached the recorded lines are drawn from the memory copies in bands of
+// RENDER_BAND_LINES by a pool of workers, which runs during VBlank and is
+// waited for by video_render_sync(). If the memory is written to mid frame
+// the lines recorded so far are drawn and the rest of the frame is drawn
+// line by line, updating the copies before each one.
+
+#define RENDER_BAND_WORKERS_MAX  16
+#define RENDER_BAND_LINES        8
+
+static render_line_type render_frame_lines[160];
+static u32 render_frame_start = 0;
+static u32 render_frame_count = 0;
+static u32 render_frame_serial = 0;
+
+static pthread_t render_band_threads[RENDER_BAND_WORKERS_MAX];
+static u32 render_band_workers = 0;
+static u32 render_band_generation = 0;
+static u32 render_band_pending = 0;
+static u32 render_band_busy = 0;
+static u32 render_band_next_line = 0;
+static u32 render_band_end_line = 0;
+static u32 render_band_quit = 0;
+static pthread_cond_t render_band_cond = PTHREAD_COND_INITIALIZER;
+
+static void render_band_lines(void)
+{
+  u32 end = render_band_end_line;
+  u32 line, last;
+
+  while((line = __atomic_fetch_add(&render_band_next_line, RENDER_BAND_LINES,
+   __ATOMIC_SEQ_CST)) < end)
+  {
+    last = line + RENDER_BAND_LINES;
+    if(last > end)
+      last = end;
+
+    for(; line < last; line++)
+    {
+      render_line_type *current_line = render_frame_lines + line;
+
+      render_io_registers = current_line->io_registers;
+      render_affine_reference_x = current_line->affine_reference_x;
+      render_affine_reference_y = current_line->affine_reference_y;
+      render_scanline(0);
+    }
+  }
+}
+
+static void *render_band_function(void *unused)
+{
+  u32 generation = 0;
+
+  pthread_mutex_lock(&render_mutex);
+
+  while(1)
+  {
+    while((render_band_generation == generation) && !render_band_quit)
+      pthread_cond_wait(&render_band_cond, &render_mutex);
+
+    if(render_band_quit)
+      break;
+
+    generation = render_band_generation;
+    pthread_mutex_unlock(&render_mutex);
+
+    render_band_lines();
+
+    pthread_mutex_lock(&render_mutex);
+    if(--render_band_pending == 0)
+      pthread_cond_signal(&render_done_cond);
+  }
+
+  pthread_mutex_unlock(&render_mutex);
+  return NULL;
+}
+
+static void render_bands_start(void)
+{
+  if(!render_frame_count)
+    return;
+
+  pthread_mutex_lock(&render_mutex);
+  render_band_next_line = render_frame_start;
+  render_band_end_line = render_frame_start + render_frame_count;
+  render_band_pending = render_band_workers;
+  render_band_generation++;
+  pthread_cond_broadcast(&render_band_cond);
+  pthread_mutex_unlock(&render_mutex);
+
+  render_band_busy = 1;
+  render_frame_count = 0;
+}
+
+static void render_bands_wait(void)
+{
+  if(!render_band_busy)
+    return;
+
+  pthread_mutex_lock(&render_mutex);
+  while(render_band_pending)
+    pthread_cond_wait(&render_done_cond, &render_mutex);
+  pthread_mutex_unlock(&render_mutex);
+
+  render_band_busy = 0;
+}
+
+static u32 render_dirty_pending(u8 *dirty, u32 units)
+{
+  u32 i;
+
+  for(i = 0; i < units; i++)
+  {
+    if(dirty[i] & DIRTY_CLIENT_RENDER)
+      return 1;
+  }
+
+  return 0;
+}
+
+static void render_update_copy(u8 *dirty, u32 units, u32 shift, u8 *dest,
+ u8 *source)
+{
+  u32 i;
+
+  for(i = 0; i < units; i++)
+  {
+    if(dirty[i] & DIRTY_CLIENT_RENDER)
+    {
+      memcpy(dest + (i << shift), source + (i << shift), 1 << shift);
+      dirty[i] &= ~DIRTY_CLIENT_RENDER;
+    }
+  }
+}
+
+// Brings the copies, the tile cache and the OBJ lists up to date. Only
+// valid while the band workers are idle.
+
+static void render_update_copies(void)
+{
+  u32 page, row;
+
+  for(page = 0; page < VRAM_DIRTY_PAGES; page++)
+  {
+    if(vram_dirty[page] & DIRTY_CLIENT_RENDER)
+    {
+      memcpy(render_thread_vram + (page << VRAM_DIRTY_SHIFT),
+       vram + (page << VRAM_DIRTY_SHIFT), 1 << VRAM_DIRTY_SHIFT);
+      update_tile_cache_page(page);
+      vram_dirty[page] &= ~DIRTY_CLIENT_RENDER;
+    }
+  }
+
+  for(row = 0; row < PALETTE_DIRTY_ROWS; row++)
+  {
+    if(palette_dirty[row] & DIRTY_CLIENT_RENDER)
+    {
+      memcpy(render_thread_palette + (row * PALETTE_ROW_COLORS),
+       palette_ram_converted + (row * PALETTE_ROW_COLORS),
+       PALETTE_ROW_COLORS * sizeof(u16));
+      if(color_correction)
+      {
+        correct_palette(render_thread_palette_corrected,
+         render_thread_palette, row * PALETTE_ROW_COLORS, PALETTE_ROW_COLORS);
+      }
+      palette_dirty[row] &= ~DIRTY_CLIENT_RENDER;
+    }
+  }
+
+  render_update_copy(oam_dirty, OAM_DIRTY_ENTRIES, OAM_DIRTY_SHIFT,
+   (u8 *)render_thread_oam, (u8 *)oam_ram);
+
+  if(reg[OAM_UPDATED])
+  {
+    update_obj_placement_dirty();
+    order_obj(read_ioreg(REG_DISPCNT) & 0x07);
+    reg[OAM_UPDATED] = 0;
+  }
+}
+
+static void render_record_line(u32 vcount)
+{
+  render_line_type *line;
+
+  if(vcount == 0)
+  {
+    // Anything left over from an unfinished frame.
+    render_bands_start();
+    render_bands_wait();
+    render_frame_serial = 0;
+  }
+
+  if(!render_frame_serial && render_frame_count && (reg[OAM_UPDATED] ||
+   (vcount != (render_frame_start + render_frame_count)) ||
+   render_dirty_pending(vram_dirty, VRAM_DIRTY_PAGES) ||
+   render_dirty_pending(palette_dirty, PALETTE_DIRTY_ROWS) ||
+   render_dirty_pending(oam_dirty, OAM_DIRTY_ENTRIES)))
+  {
+    // Memory changed mid frame, draw what was recorded and continue
+    // line by line.
+    render_bands_start();
+    render_bands_wait();
+    render_frame_serial = 1;
+  }
+
+  if(render_frame_serial)
+  {
+    render_update_copies();
+    render_scanline(0);
+    return;
+  }
+
+  if(render_frame_count == 0)
+  {
+    // Start of a deferred run.
+    render_bands_wait();
+    render_update_copies();
+    render_frame_start = vcount;
+  }
+
+  line = render_frame_lines + vcount;
+  memcpy(line->io_registers, io_registers, sizeof(line->io_registers));
+  memcpy(line->affine_reference_x, affine_reference_x,
+   sizeof(line->affine_reference_x));
+  memcpy(line->affine_reference_y, affine_reference_y,
+   sizeof(line->affine_reference_y));
+  line->oam_updated = 0;
+  render_frame_count++;
+
+  if(vcount == 159)
+    render_bands_start();
+}
+
+// Waits until every line handed to the render thread or the band workers
+// has been drawn. Must be called before the frame is presented.
+
+void video_render_sync(void)
+{
+  if(render_thread_running)
+  {
+    render_wait(render_atomic_load(render_queue_read) == render_queue_write,
+     render_producer_sleeping, render_done_cond);
+  }
+
+  if(render_band_workers)
+  {
+    render_bands_start();
+    render_bands_wait();
+  }
+}
+
+void init_render_bands(u32 workers)
+{
+  u32 i;
+
+  if(workers > RENDER_BAND_WORKERS_MAX)
+    workers = RENDER_BAND_WORKERS_MAX;
+
+  if(workers == render_band_workers)
+    return;
+
+  if(render_band_workers)
+  {
+    video_render_sync();
+
+    pthread_mutex_lock(&render_mutex);
+    render_band_quit = 1;
+    pthread_cond_broadcast(&render_band_cond);
+    pthread_mutex_unlock(&render_mutex);
+
+    for(i = 0; i < render_band_workers; i++)
+      pthread_join(render_band_threads[i], NULL);
+
+    render_band_quit = 0;
+    render_band_workers = 0;
+    render_use_copies(0);
+  }
+
+  if(!workers)
+    return;
+
+  init_render_thread(0);
+  render_invalidate_copies();
+  render_use_copies(1);
+  render_frame_count = 0;
+  // New workers start out waiting for generation 1.
+  render_band_generation = 0;
+
+  for(i = 0; i < workers; i++)
+  {
+    if(pthread_create(render_band_threads + i, NULL, render_band_function,
+     NULL))
+      break;
+  }
+
+  render_band_workers = i;
+
+  if(!render_band_workers)
+    render_use_copies(0);
+}
+
+void init_render_thread(u32 enable)
+{
+  if(enable == render_thread_running)
+    return;
+
+  if(render_thread_running)
+  {
+    render_queue_reserve(RENDER_COMMAND_QUIT, 0, 0);
+    render_queue_commit(0);
+    pthread_join(render_thread, NULL);
+    render_thread_running = 0;
+    render_use_copies(0);
+    return;
+  }
+
+  init_render_bands(0);
+
+  render_invalidate_copies();
+  render_use_copies(1);
+  if(pthread_create(&render_thread, NULL, render_thread_function, NULL))
+  {
+    render_use_copies(0);
+    return;
+  }
+
+  render_thread_running = 1;
+}
+
+#endif
+
+// Rows of palette_ram_corrected are corrected again once palette writes
+// dirty them, before the next line is drawn.
+
+static void update_palette_correction(void)
+{
+  u32 row;
+
+  for(row = 0; row < PALETTE_DIRTY_ROWS; row++)
+  {
+    if(palette_dirty[row] & DIRTY_CLIENT_COLOR_CORRECT)
+    {
+      correct_palette(palette_ram_corrected, palette_ram_converted,
+       row * PALETTE_ROW_COLORS, PALETTE_ROW_COLORS);
+      palette_dirty[row] &= ~DIRTY_CLIENT_COLOR_CORRECT;
+    }
+  }
+}
+
+void video_set_screen_target(u16 *pixels, u32 pitch)
+{
+  video_render_sync();
+  screen_target = pixels;
+  screen_target_pitch = pixels ? pitch : GBA_SCREEN_PITCH;
+}
+
+void init_video_output(u32 xrgb8888)
+{
+  video_render_sync();
+  output_xrgb8888 = xrgb8888;
+}
+
+void init_color_correction(u32 enable)
+{
+  u32 i;
+
+  if(enable == color_correction)
+    return;
+
+  video_render_sync();
+  color_correction = enable;
+
+  // Nothing was corrected while it was off.
+  if(enable)
+  {
+    correct_palette(palette_ram_corrected, palette_ram_converted, 0, 512);
+#ifdef HAVE_RENDER_THREAD
+    correct_palette(render_thread_palette_corrected, render_thread_palette,
+     0, 512);
+#endif
+
+    for(i = 0; i < PALETTE_DIRTY_ROWS; i++)
+      palette_dirty[i] &= ~DIRTY_CLIENT_COLOR_CORRECT;
+  }
+
+  // Lines drawn so far have the other colors.
+  for(i = 0; i < 160; i++)
+    line_reuse_lines[i].serial = 0;
+}
+
+void update_scanline(void)
+{
+  if(color_correction)
+    update_palette_correction();
+
+#ifdef HAVE_RENDER_THREAD
+  if(render_thread_running || render_band_workers)
+  {
+    // Skipped frames leave the dirty state alone, it's picked up with the
+    // next line that's actually drawn.
+    if(!skip_next_frame)
+    {
+      if(render_thread_running)
+        render_queue_line();
+      else
+        render_record_line(read_ioreg(REG_VCOUNT));
+    }
+  }
+  else
+#endif
+  {
+    if(!skip_next_frame)
+      update_tile_cache();
+
+    if(reg[OAM_UPDATED])
+      update_obj_placement_dirty();
+
+    render_scanline(reg[OAM_UPDATED]);
+    reg[OAM_UPDATED] = 0;
   }
 
   affine_reference_x[0] += (s16)read_ioreg(REG_BG2PB);
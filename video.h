@@ -20,10 +20,23 @@
 #ifndef VIDEO_H
 #define VIDEO_H
 
+void init_video(void);
+void video_set_screen_target(u16 *pixels, u32 pitch);
+void init_video_output(u32 xrgb8888);
+void init_line_reuse(u32 enable);
+void init_color_correction(u32 enable);
 void update_scanline(void);
 void video_write_savestate(void);
 void video_read_savestate(void);
 
+#ifdef HAVE_RENDER_THREAD
+void init_render_thread(u32 enable);
+void init_render_bands(u32 workers);
+void video_render_sync(void);
+#else
+#define video_render_sync()
+#endif
+
 extern s32 affine_reference_x[2];
 extern s32 affine_reference_y[2];
 
@@ -54,6 +67,40 @@ typedef enum
   filter_bilinear
 } video_filter_type;
 
+// Holds 32bit XRGB8888 pixels instead if enabled with init_video_output.
+// Frames are drawn into the buffer passed to video_set_screen_target
+// instead if there is one, its pitch is in pixels.
 extern u16* gba_screen_pixels;
 
+// On x86 the color effects are applied with SSE2 or AVX2 kernels, picked
+// at startup depending on the CPU (see x86/video_blend.c).
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define X86_ARCH_BLENDING_OPTS
+#endif
+
+// NEON capable ARM builds use NEON text and bitmap layer renderers (see
+// arm/video_neon.h).
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define ARM_ARCH_NEON_RENDERERS
+#endif
+
+#ifdef X86_ARCH_BLENDING_OPTS
+
+typedef struct
+{
+  void (* blend)(const u32 *src, u16 *dest, u32 count, const u16 *palette,
+   u32 blend_a, u32 blend_b);
+  void (* fade)(const u16 *src, u16 *dest, u32 count, const u16 *palette,
+   u32 upper, u32 factor);
+  void (* fade_partial_alpha)(const u32 *src, u16 *dest, u32 count,
+   const u16 *palette, u32 blend_a, u32 blend_b, u32 upper, u32 factor);
+} x86_blend_kernels_type;
+
+// NULL if the CPU has no SSE2, the C expand loops are used then.
+extern const x86_blend_kernels_type *x86_blend_kernels;
+
+#endif
+
 #endif
@@ -0,0 +1,367 @@
+/* gameplaySP
+ *
+ * Copyright (C) 2006 Exophase <exophase@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "common.h"
+
+#ifdef X86_ARCH_BLENDING_OPTS
+
+#include <immintrin.h>
+
+// Color effect kernels for the expand passes in video.c, 8 (SSE2) or 16
+// (AVX2) pixels at a time. The palette lookups stay scalar, the effect
+// conditions and the per channel math are done on 16bit lanes:
+//
+//   blend: min((top * blend_a + bottom * blend_b) >> 4, channel max)
+//   fade:  upper + ((top * factor) >> 4)
+//
+// Clamping every blend to the channel max covers both the saturating and
+// the non saturating C paths, the latter can't go over the max anyway.
+// Whatever doesn't fill a whole vector is handed down to the narrower
+// kernel and finally to the scalar one, so results are always identical
+// to the C expand loops.
+
+#define effect_alpha_mask  0x04000200
+#define effect_fade_mask   0x00000200
+
+const x86_blend_kernels_type *x86_blend_kernels = NULL;
+
+
+static u32 blend_color_scalar(u32 top, u32 bottom, u32 blend_a, u32 blend_b)
+{
+  u32 b = (((top & 0x1F) * blend_a) + ((bottom & 0x1F) * blend_b)) >> 4;
+  u32 g = ((((top >> 5) & 0x3F) * blend_a) +
+   (((bottom >> 5) & 0x3F) * blend_b)) >> 4;
+  u32 r = (((top >> 11) * blend_a) + ((bottom >> 11) * blend_b)) >> 4;
+
+  if(b > 0x1F)
+    b = 0x1F;
+  if(g > 0x3F)
+    g = 0x3F;
+  if(r > 0x1F)
+    r = 0x1F;
+
+  return b | (g << 5) | (r << 11);
+}
+
+static u32 fade_color_scalar(u32 top, u32 upper, u32 factor)
+{
+  u32 b = (upper & 0x1F) + (((top & 0x1F) * factor) >> 4);
+  u32 g = ((upper >> 5) & 0x3F) + ((((top >> 5) & 0x3F) * factor) >> 4);
+  u32 r = (upper >> 11) + (((top >> 11) * factor) >> 4);
+
+  return b | (g << 5) | (r << 11);
+}
+
+static void expand_blend_scalar(const u32 *src, u16 *dest, u32 count,
+ const u16 *palette, u32 blend_a, u32 blend_b)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+  {
+    u32 pixel_pair = src[i];
+    u32 pixel_top = palette[pixel_pair & 0x1FF];
+
+    if((pixel_pair & effect_alpha_mask) == effect_alpha_mask)
+    {
+      pixel_top = blend_color_scalar(pixel_top,
+       palette[(pixel_pair >> 16) & 0x1FF], blend_a, blend_b);
+    }
+
+    dest[i] = pixel_top;
+  }
+}
+
+static void expand_fade_scalar(const u16 *src, u16 *dest, u32 count,
+ const u16 *palette, u32 upper, u32 factor)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+  {
+    u32 pixel_source = src[i];
+    u32 pixel_top = palette[pixel_source & 0x1FF];
+
+    if(pixel_source & effect_fade_mask)
+      pixel_top = fade_color_scalar(pixel_top, upper, factor);
+
+    dest[i] = pixel_top;
+  }
+}
+
+static void expand_fade_partial_alpha_scalar(const u32 *src, u16 *dest,
+ u32 count, const u16 *palette, u32 blend_a, u32 blend_b, u32 upper,
+ u32 factor)
+{
+  u32 i;
+
+  for(i = 0; i < count; i++)
+  {
+    u32 pixel_pair = src[i];
+    u32 pixel_top = palette[pixel_pair & 0x1FF];
+
+    if((pixel_pair & effect_alpha_mask) == effect_alpha_mask)
+    {
+      pixel_top = blend_color_scalar(pixel_top,
+       palette[(pixel_pair >> 16) & 0x1FF], blend_a, blend_b);
+    }
+    else if(pixel_pair & effect_fade_mask)
+      pixel_top = fade_color_scalar(pixel_top, upper, factor);
+
+    dest[i] = pixel_top;
+  }
+}
+
+
+#define simd_type_sse2     __m128i
+#define simd_width_sse2    8
+#define simd_load_sse2(p)  _mm_loadu_si128((const __m128i *)(p))
+#define simd_store_sse2(p, v)                                                 \
+  _mm_storeu_si128((__m128i *)(p), v)                                         \
+
+#define simd_set16_sse2    _mm_set1_epi16
+#define simd_set32_sse2    _mm_set1_epi32
+#define simd_and_sse2      _mm_and_si128
+#define simd_or_sse2       _mm_or_si128
+#define simd_andnot_sse2   _mm_andnot_si128
+#define simd_add16_sse2    _mm_add_epi16
+#define simd_mul16_sse2    _mm_mullo_epi16
+#define simd_min16_sse2    _mm_min_epi16
+#define simd_srl16_sse2    _mm_srli_epi16
+#define simd_sll16_sse2    _mm_slli_epi16
+#define simd_cmp16_sse2    _mm_cmpeq_epi16
+#define simd_cmp32_sse2    _mm_cmpeq_epi32
+#define simd_pack32_sse2   _mm_packs_epi32
+
+#define simd_type_avx2     __m256i
+#define simd_width_avx2    16
+#define simd_load_avx2(p)  _mm256_loadu_si256((const __m256i *)(p))
+#define simd_store_avx2(p, v)                                                 \
+  _mm256_storeu_si256((__m256i *)(p), v)                                      \
+
+#define simd_set16_avx2    _mm256_set1_epi16
+#define simd_set32_avx2    _mm256_set1_epi32
+#define simd_and_avx2      _mm256_and_si256
+#define simd_or_avx2       _mm256_or_si256
+#define simd_andnot_avx2   _mm256_andnot_si256
+#define simd_add16_avx2    _mm256_add_epi16
+#define simd_mul16_avx2    _mm256_mullo_epi16
+#define simd_min16_avx2    _mm256_min_epi16
+#define simd_srl16_avx2    _mm256_srli_epi16
+#define simd_sll16_avx2    _mm256_slli_epi16
+#define simd_cmp16_avx2    _mm256_cmpeq_epi16
+#define simd_cmp32_avx2    _mm256_cmpeq_epi32
+
+// The AVX2 pack works on each 128bit half, the permute puts the quadwords
+// back in pixel order.
+#define simd_pack32_avx2(a, b)                                                \
+  _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8)                    \
+
+
+#define simd_select(isa, mask, a, b)                                          \
+  simd_or_##isa(simd_and_##isa(mask, a), simd_andnot_##isa(mask, b))          \
+
+// Palette colors of a whole vector of pixels, built straight in registers
+// (going through memory stalls on the store forwarding).
+
+#define simd_color(src, shift, index)                                         \
+  palette[(src[index] >> shift) & 0x1FF]                                      \
+
+#define simd_lookup_sse2(src, shift)                                          \
+  _mm_set_epi16(                                                              \
+   simd_color(src, shift, 7), simd_color(src, shift, 6),                      \
+   simd_color(src, shift, 5), simd_color(src, shift, 4),                      \
+   simd_color(src, shift, 3), simd_color(src, shift, 2),                      \
+   simd_color(src, shift, 1), simd_color(src, shift, 0))                      \
+
+#define simd_lookup_avx2(src, shift)                                          \
+  _mm256_set_epi16(                                                           \
+   simd_color(src, shift, 15), simd_color(src, shift, 14),                    \
+   simd_color(src, shift, 13), simd_color(src, shift, 12),                    \
+   simd_color(src, shift, 11), simd_color(src, shift, 10),                    \
+   simd_color(src, shift, 9), simd_color(src, shift, 8),                      \
+   simd_color(src, shift, 7), simd_color(src, shift, 6),                      \
+   simd_color(src, shift, 5), simd_color(src, shift, 4),                      \
+   simd_color(src, shift, 3), simd_color(src, shift, 2),                      \
+   simd_color(src, shift, 1), simd_color(src, shift, 0))                      \
+
+// Effect conditions as 0xFFFF/0 lanes, the pair version narrows two
+// vectors of 32bit pixel pairs.
+
+#define simd_condition16(isa, src, mask)                                      \
+  simd_cmp16_##isa(simd_and_##isa(simd_load_##isa(src),                       \
+   simd_set16_##isa(mask)), simd_set16_##isa(mask))                           \
+
+#define simd_condition32(isa, src, mask)                                      \
+  simd_pack32_##isa(                                                          \
+   simd_cmp32_##isa(simd_and_##isa(simd_load_##isa(src),                      \
+   simd_set32_##isa(mask)), simd_set32_##isa(mask)),                          \
+   simd_cmp32_##isa(simd_and_##isa(simd_load_##isa(src +                      \
+   (simd_width_##isa / 2)), simd_set32_##isa(mask)), simd_set32_##isa(mask))) \
+
+#define simd_channel(isa, color, shift, mask)                                 \
+  simd_and_##isa(simd_srl16_##isa(color, shift), simd_set16_##isa(mask))      \
+
+#define simd_blend_channel(isa, shift, mask)                                  \
+  simd_min16_##isa(simd_srl16_##isa(simd_add16_##isa(                         \
+   simd_mul16_##isa(simd_channel(isa, top, shift, mask), blend_a),            \
+   simd_mul16_##isa(simd_channel(isa, bottom, shift, mask), blend_b)), 4),    \
+   simd_set16_##isa(mask))                                                    \
+
+#define simd_fade_channel(isa, shift, mask)                                   \
+  simd_add16_##isa(simd_channel(isa, upper, shift, mask),                     \
+   simd_srl16_##isa(simd_mul16_##isa(simd_channel(isa, top, shift, mask),     \
+   factor), 4))                                                               \
+
+#define simd_merge_channels(isa, channel)                                     \
+  simd_or_##isa(simd_or_##isa(channel(isa, 0, 0x1F),                          \
+   simd_sll16_##isa(channel(isa, 5, 0x3F), 5)),                               \
+   simd_sll16_##isa(channel(isa, 11, 0x1F), 11))                              \
+
+
+#define blend_kernels_builder(isa)                                            \
+                                                                              \
+__attribute__((target(#isa)))                                                 \
+static simd_type_##isa blend_color_##isa(simd_type_##isa top,                 \
+ simd_type_##isa bottom, simd_type_##isa blend_a, simd_type_##isa blend_b)    \
+{                                                                             \
+  return simd_merge_channels(isa, simd_blend_channel);                        \
+}                                                                             \
+                                                                              \
+__attribute__((target(#isa)))                                                 \
+static simd_type_##isa fade_color_##isa(simd_type_##isa top,                  \
+ simd_type_##isa upper, simd_type_##isa factor)                               \
+{                                                                             \
+  return simd_merge_channels(isa, simd_fade_channel);                         \
+}                                                                             \
+                                                                              \
+__attribute__((target(#isa)))                                                 \
+static void expand_blend_##isa(const u32 *src, u16 *dest, u32 count,          \
+ const u16 *palette, u32 blend_a, u32 blend_b)                                \
+{                                                                             \
+  simd_type_##isa blend_a_vector = simd_set16_##isa(blend_a);                 \
+  simd_type_##isa blend_b_vector = simd_set16_##isa(blend_b);                 \
+                                                                              \
+  for(; count >= simd_width_##isa; count -= simd_width_##isa)                 \
+  {                                                                           \
+    simd_type_##isa top = simd_lookup_##isa(src, 0);                          \
+    simd_type_##isa bottom = simd_lookup_##isa(src, 16);                      \
+    simd_type_##isa alpha = simd_condition32(isa, src, effect_alpha_mask);    \
+                                                                              \
+    simd_store_##isa(dest, simd_select(isa, alpha,                            \
+     blend_color_##isa(top, bottom, blend_a_vector, blend_b_vector), top));   \
+                                                                              \
+    src += simd_width_##isa;                                                  \
+    dest += simd_width_##isa;                                                 \
+  }                                                                           \
+                                                                              \
+  expand_blend_##isa##_remainder(src, dest, count, palette, blend_a,          \
+   blend_b);                                                                  \
+}                                                                             \
+                                                                              \
+__attribute__((target(#isa)))                                                 \
+static void expand_fade_##isa(const u16 *src, u16 *dest, u32 count,           \
+ const u16 *palette, u32 upper, u32 factor)                                   \
+{                                                                             \
+  simd_type_##isa upper_vector = simd_set16_##isa(upper);                     \
+  simd_type_##isa factor_vector = simd_set16_##isa(factor);                   \
+                                                                              \
+  for(; count >= simd_width_##isa; count -= simd_width_##isa)                 \
+  {                                                                           \
+    /* src can be dest, it's completely read before storing. */               \
+    simd_type_##isa top = simd_lookup_##isa(src, 0);                          \
+    simd_type_##isa fade = simd_condition16(isa, src, effect_fade_mask);      \
+                                                                              \
+    simd_store_##isa(dest, simd_select(isa, fade,                             \
+     fade_color_##isa(top, upper_vector, factor_vector), top));               \
+                                                                              \
+    src += simd_width_##isa;                                                  \
+    dest += simd_width_##isa;                                                 \
+  }                                                                           \
+                                                                              \
+  expand_fade_##isa##_remainder(src, dest, count, palette, upper, factor);    \
+}                                                                             \
+                                                                              \
+__attribute__((target(#isa)))                                                 \
+static void expand_fade_partial_alpha_##isa(const u32 *src, u16 *dest,        \
+ u32 count, const u16 *palette, u32 blend_a, u32 blend_b, u32 upper,          \
+ u32 factor)                                                                  \
+{                                                                             \
+  simd_type_##isa blend_a_vector = simd_set16_##isa(blend_a);                 \
+  simd_type_##isa blend_b_vector = simd_set16_##isa(blend_b);                 \
+  simd_type_##isa upper_vector = simd_set16_##isa(upper);                     \
+  simd_type_##isa factor_vector = simd_set16_##isa(factor);                   \
+                                                                              \
+  for(; count >= simd_width_##isa; count -= simd_width_##isa)                 \
+  {                                                                           \
+    simd_type_##isa top = simd_lookup_##isa(src, 0);                          \
+    simd_type_##isa bottom = simd_lookup_##isa(src, 16);                      \
+    simd_type_##isa alpha = simd_condition32(isa, src, effect_alpha_mask);    \
+    simd_type_##isa fade = simd_condition32(isa, src, effect_fade_mask);      \
+                                                                              \
+    /* Alpha only ever applies where fade does as well. */                    \
+    simd_store_##isa(dest, simd_select(isa, alpha,                            \
+     blend_color_##isa(top, bottom, blend_a_vector, blend_b_vector),          \
+     simd_select(isa, fade, fade_color_##isa(top, upper_vector,               \
+     factor_vector), top)));                                                  \
+                                                                              \
+    src += simd_width_##isa;                                                  \
+    dest += simd_width_##isa;                                                 \
+  }                                                                           \
+                                                                              \
+  expand_fade_partial_alpha_##isa##_remainder(src, dest, count, palette,      \
+   blend_a, blend_b, upper, factor);                                          \
+}                                                                             \
+                                                                              \
+static const x86_blend_kernels_type blend_kernels_##isa =                     \
+{                                                                             \
+  expand_blend_##isa,                                                         \
+  expand_fade_##isa,                                                          \
+  expand_fade_partial_alpha_##isa                                             \
+}                                                                             \
+
+
+#define expand_blend_sse2_remainder              expand_blend_scalar
+#define expand_fade_sse2_remainder               expand_fade_scalar
+#define expand_fade_partial_alpha_sse2_remainder                              \
+  expand_fade_partial_alpha_scalar                                            \
+
+#define expand_blend_avx2_remainder              expand_blend_sse2
+#define expand_fade_avx2_remainder               expand_fade_sse2
+#define expand_fade_partial_alpha_avx2_remainder                              \
+  expand_fade_partial_alpha_sse2                                              \
+
+blend_kernels_builder(sse2);
+blend_kernels_builder(avx2);
+
+
+// Pick the widest kernels the CPU runs before anything gets rendered.
+
+__attribute__((constructor))
+static void init_x86_blend_kernels(void)
+{
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2"))
+    x86_blend_kernels = &blend_kernels_avx2;
+  else if(__builtin_cpu_supports("sse2"))
+    x86_blend_kernels = &blend_kernels_sse2;
+}
+
+#endif